@@ -0,0 +1,619 @@
+//
+// Title:			Offline audio render harness
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+// Runs the VDP's audio system on a host computer, playing a script of audio commands
+// through the real channel, sample, envelope, mixer and queue code, to:
+//   - check that changes to the audio code don't change its output, by comparing checksums or WAV files
+//   - measure how fast the audio code renders, to see how many channels a title can afford
+//
+// Build from the root of the repository with:
+//   g++ -std=c++17 -O2 -Iaudio_render/host -Ivideo audio_render/audio_render.cpp -o audio_render/audio_render
+// The host directory holds stand-ins for the Arduino core, ESP-IDF and vdp-gl's sound generator
+// vdp-gl's built-in waveforms are only approximated there, so checksums of renders using them will not match
+// the VDP, but are stable from one build of the harness to the next
+//
+// Usage:
+//   audio_render [-o output.wav] [-r repeats] [-v] script
+// The script is read from standard input if it is given as -
+//
+// Scripts have one command per line, with # starting a comment
+// Channel, waveform, volume and frequency values are as for VDU 23, 0, &85
+//   rate <sample rate>							set the sound generator sample rate
+//   enable <channel>							enable a channel
+//   disable <channel>							disable a channel
+//   waveform <channel> <waveform> [sample]		set a channel's waveform
+//   volume <channel> <volume>					set a channel's volume, or the overall volume for channel 255
+//   frequency <channel> <frequency>			set a channel's frequency
+//   play <channel> <volume> <frequency> <duration>	play a note
+//   off <channel>								release a channel's note
+//   adsr <channel> <attack> <decay> <sustain> <release>	set a channel's volume envelope
+//   stepped <channel> <step length> <repeats> <cumulative> <restrict> <adjustment> <steps>...
+//												set a channel's frequency envelope, with adjustment and step pairs
+//   noenvelope <channel>						remove a channel's envelopes
+//   sample <id> sine <length> <period> [base frequency]	make a signed 8-bit sample of a sine wave
+//   sample <id> noise <length> <seed> [base frequency]	make a signed 8-bit sample of random values
+//   sample <id> file <format> <rate> <path> [base frequency]	load a sample from a raw file
+//   loop <id> <start> <length>					set a sample's repeat section
+//   queue <time> <channel> <volume> <frequency> <duration>	queue a note on the audio clock
+//   resetclock									restart the queue's clock
+//   wait <ms>									render audio for a time
+//   waitidle [limit]							render audio until all channels are idle, up to a limit in ms
+//   compare <id> <frequency> <volume> <count> [position]
+//												play a sample with both EnhancedSamplesGenerator and the double precision
+//												ReferenceSamplesGenerator it replaced, checking they differ by at most 1 LSB
+//												Where a loop point falls exactly on an output sample, rounding decides which
+//												output loops, so the outputs can shift by a sample at each loop; these shifts
+//												are counted and reported separately from differences in level
+//   expect <checksum>							give the checksum, in hex, that the whole script's output should have
+//   level <from> <to> <min> <max>				check the loudest output sample between two times, in ms from the start
+//												of the script at the current sample rate, is between min and max
+//
+// After rendering, the number of samples and a checksum of the output are printed, along with
+// how long the audio driver and mixer took, and how many samples per second a single channel renders at,
+// counting each active channel's samples separately
+// Repeating a script runs it again from a fresh audio system, giving more stable timings
+// The exit status is non-zero if a compare command finds a difference of more than 1 LSB,
+// a level command finds the output too loud or too quiet,
+// or the checksum doesn't match the one given by an expect command
+//
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "agon_audio.h"
+#include "envelopes/adsr.h"
+#include "envelopes/frequency.h"
+#include "reference_samples_generator.h"
+
+bool verbose = false;
+
+void debug_log(const char *format, ...) {
+	if (verbose) {
+		va_list args;
+		va_start(args, format);
+		vfprintf(stderr, format, args);
+		va_end(args);
+	}
+}
+
+void force_debug_log(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Results of rendering a script
+struct RenderStats {
+	uint64_t	samples = 0;			// output samples rendered
+	uint64_t	channelSamples = 0;		// samples rendered by each active channel, added together
+	uint32_t	checksum = 0xFFFFFFFF;	// CRC-32 of the output
+	double		driverTime = 0;			// seconds spent in the audio driver
+	double		mixerTime = 0;			// seconds spent rendering samples
+	uint64_t	comparedSamples = 0;	// samples checked against the reference generator
+	int			largestDifference = 0;	// largest difference from the reference generator
+	uint64_t	timingShifts = 0;		// times the generator's output moved a sample ahead of or behind the reference
+	int			levelFailures = 0;		// level commands that found the output too loud or too quiet
+	bool		checksumExpected = false;	// whether the script gave an expected checksum
+	uint32_t	expectedChecksum = 0;
+};
+
+class AudioRenderer {
+	public:
+		AudioRenderer(std::ostream * wav) : wav(wav) {}
+
+		bool run(std::istream & script);
+		RenderStats & getStats() { return stats; }
+
+	private:
+		std::ostream *	wav;
+		RenderStats		stats;
+		uint32_t		deadlines[MAX_AUDIO_CHANNELS];
+		uint32_t		activeChannels = 0;
+		uint32_t		driverWake = 0;			// time the driver next needs to run
+		uint64_t		sampleFraction = 0;		// sample rate * ms carried over between milliseconds
+		std::vector<int8_t>	output;				// samples rendered in the current millisecond
+		std::vector<int8_t>	rendered;			// everything rendered so far, for level checks
+
+		bool command(const std::string & name, std::istringstream & args);
+		bool loadSample(uint16_t id, std::istringstream & args);
+		bool compareSample(uint16_t id, std::istringstream & args);
+		bool checkLevel(std::istringstream & args);
+		void render(uint32_t ms);
+		bool channelsIdle();
+		void runDriver();
+		void addSample(int8_t sample);
+};
+
+// Play a script, returning false if it has a bad command
+//
+bool AudioRenderer::run(std::istream & script) {
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(script, line)) {
+		lineNumber++;
+		auto comment = line.find('#');
+		if (comment != std::string::npos) {
+			line.erase(comment);
+		}
+		std::istringstream args(line);
+		std::string name;
+		if (!(args >> name)) {
+			continue;
+		}
+		if (!command(name, args)) {
+			fprintf(stderr, "audio_render: bad command at line %d: %s\n", lineNumber, line.c_str());
+			return false;
+		}
+	}
+	stats.checksum = ~stats.checksum;
+	return true;
+}
+
+bool AudioRenderer::command(const std::string & name, std::istringstream & args) {
+	int channel, a, b, c, d;
+	if (name == "rate" && args >> a) {
+		setSampleRate(255, a);
+	} else if (name == "enable" && args >> channel) {
+		return enableChannel(channel);
+	} else if (name == "disable" && args >> channel) {
+		return disableChannel(channel);
+	} else if (name == "waveform" && args >> channel >> a) {
+		b = 0;
+		args >> b;
+		return setWaveform(channel, a, b);
+	} else if (name == "volume" && args >> channel >> a) {
+		setVolume(channel, a);
+	} else if (name == "frequency" && args >> channel >> a) {
+		setFrequency(channel, a);
+	} else if (name == "play" && args >> channel >> a >> b >> c) {
+		playNote(channel, a, b, c);
+	} else if (name == "off" && args >> channel && channelEnabled(channel)) {
+		audioChannels[channel]->noteOff();
+	} else if (name == "adsr" && args >> channel >> a >> b >> c >> d && channelEnabled(channel)) {
+		audioChannels[channel]->setVolumeEnvelope(make_unique_psram<ADSRVolumeEnvelope>(a, b, c, d));
+	} else if (name == "stepped" && args >> channel >> a && channelEnabled(channel)) {
+		int repeats, cumulative, restrict;
+		if (!(args >> repeats >> cumulative >> restrict)) {
+			return false;
+		}
+		auto phases = make_shared_psram<std::vector<FrequencyStepPhase>>();
+		int16_t adjustment;
+		uint16_t steps;
+		while (args >> adjustment >> steps) {
+			phases->push_back({ adjustment, steps });
+		}
+		audioChannels[channel]->setFrequencyEnvelope(make_unique_psram<SteppedFrequencyEnvelope>(phases, a, repeats, cumulative, restrict));
+	} else if (name == "noenvelope" && args >> channel && channelEnabled(channel)) {
+		audioChannels[channel]->setVolumeEnvelope(nullptr);
+		audioChannels[channel]->setFrequencyEnvelope(nullptr);
+	} else if (name == "sample" && args >> a) {
+		return loadSample(a, args);
+	} else if (name == "loop" && args >> a >> b >> c && samples.find(a) != samples.end()) {
+		samples[a]->repeatStart = b;
+		samples[a]->repeatLength = c;
+	} else if (name == "compare" && args >> a) {
+		return compareSample(a, args);
+	} else if (name == "expect" && args >> std::hex >> stats.expectedChecksum) {
+		stats.checksumExpected = true;
+	} else if (name == "level") {
+		return checkLevel(args);
+	} else if (name == "queue" && args >> a >> channel >> b >> c >> d) {
+		QueuedAudioEvent event = { (uint8_t)channel, AUDIO_QUEUE_PLAY, (uint8_t)b, (uint16_t)c, (uint16_t)d };
+		return queueAudioEvent(a, event);
+	} else if (name == "resetclock") {
+		resetAudioQueueClock();
+	} else if (name == "wait" && args >> a) {
+		render(a);
+	} else if (name == "waitidle") {
+		a = 60000;
+		args >> a;
+		while (a-- > 0 && !channelsIdle()) {
+			render(1);
+		}
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Make a sample, as a sine wave, as noise, or from a raw file of sample data
+//
+bool AudioRenderer::loadSample(uint16_t id, std::istringstream & args) {
+	std::string source;
+	int format = AUDIO_FORMAT_8BIT_SIGNED;
+	int rate = AUDIO_DEFAULT_SAMPLE_RATE;
+	std::vector<uint8_t> data;
+	if (!(args >> source)) {
+		return false;
+	}
+	if (source == "sine") {
+		int length, period;
+		if (!(args >> length >> period) || length <= 0 || period <= 0) {
+			return false;
+		}
+		for (int i = 0; i < length; i++) {
+			data.push_back((int8_t)lround(127.0 * sin(i * 2.0 * M_PI / period)));
+		}
+	} else if (source == "noise") {
+		int length;
+		uint32_t seed;
+		if (!(args >> length >> seed) || length <= 0) {
+			return false;
+		}
+		for (int i = 0; i < length; i++) {
+			// a fixed generator, so the same seed gives the same sample on every host
+			seed = seed * 1664525 + 1013904223;
+			data.push_back(seed >> 24);
+		}
+	} else if (source == "file") {
+		std::string path;
+		if (!(args >> format >> rate >> path)) {
+			return false;
+		}
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			fprintf(stderr, "audio_render: cannot read %s\n", path.c_str());
+			return false;
+		}
+		data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	} else {
+		return false;
+	}
+	int baseFrequency = 0;
+	args >> baseFrequency;
+	if (data.empty()) {
+		return false;
+	}
+
+	auto block = make_shared_psram<BufferStream>(data.size());
+	block->writeBuffer(data.data(), data.size());
+	BufferVector blocks;
+	blocks.push_back(block);
+	samples[id] = make_shared_psram<AudioSample>(blocks, format, rate, baseFrequency);
+	return true;
+}
+
+// Play a sample with both the current and reference generators, noting the largest difference between them
+// Neither generator is attached to the mixer, so this doesn't affect the rendered output
+//
+bool AudioRenderer::compareSample(uint16_t id, std::istringstream & args) {
+	int frequency, volume, count;
+	uint32_t position = 0;
+	if (!(args >> frequency >> volume >> count)) {
+		return false;
+	}
+	args >> position;
+	auto sampleIter = samples.find(id);
+	if (sampleIter == samples.end() || !sampleIter->second || sampleIter->second->adpcmData || sampleIter->second->stream) {
+		fprintf(stderr, "audio_render: sample %d is not a PCM sample held in memory\n", id);
+		return false;
+	}
+	auto sample = sampleIter->second;
+	EnhancedSamplesGenerator generator(sample);
+	ReferenceSamplesGenerator reference(sample);
+	for (WaveformGenerator * g : { (WaveformGenerator *)&generator, (WaveformGenerator *)&reference }) {
+		g->setSampleRate(audioMixer->sampleRate());
+		g->setFrequency(frequency);
+		g->setVolume(volume);
+		g->enable(true);
+	}
+	generator.seekTo(position);
+	reference.seekTo(position);
+
+	// render a few extra reference samples, so the generator's output can be matched against them when it falls behind
+	const int realignLength = 8;	// samples that must match to accept a shift in timing
+	std::vector<int> output(count), expected(count + realignLength + 1);
+	for (auto & sample : output) {
+		sample = generator.getSample();
+	}
+	for (auto & sample : expected) {
+		sample = reference.getSample();
+	}
+	auto matches = [&](int i, int shift) {
+		for (int n = 0; n < realignLength && i + n < count; n++) {
+			auto r = i + n + shift;
+			if (r < 0 || r >= (int)expected.size() || abs(output[i + n] - expected[r]) > 1) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	// compare each output with the reference output at the same time, or a shifted time once a loop has
+	// moved them apart, counting the shift rather than a difference in level
+	// NB the output where the loop happens interpolates across the loop point differently in the two generators,
+	// so when the shift only matches from the next output, that output counts as part of the shift
+	int largest = 0;
+	int differing = 0;
+	int shift = 0;
+	int shifts = 0;
+	for (int i = 0; i < count; i++) {
+		auto difference = abs(output[i] - expected[i + shift]);
+		if (difference > 1) {
+			for (auto newShift : { shift + 1, shift - 1 }) {
+				if (i + newShift >= 0 && matches(i, newShift)) {
+					difference = abs(output[i] - expected[i + newShift]);
+				} else if (i + 1 < count && i + 1 + newShift >= 0 && matches(i + 1, newShift)) {
+					difference = 0;
+				} else {
+					continue;
+				}
+				shift = newShift;
+				shifts++;
+				break;
+			}
+		}
+		if (difference) {
+			differing++;
+			largest = std::max(largest, difference);
+		}
+	}
+	debug_log("compare: sample %d at %d Hz, volume %d: %d of %d samples differ, by up to %d, with %d timing shifts\n", id, frequency, volume, differing, count, largest, shifts);
+	stats.comparedSamples += count;
+	stats.largestDifference = std::max(stats.largestDifference, largest);
+	stats.timingShifts += shifts;
+	return true;
+}
+
+// Check the loudest output sample in a window of what has been rendered so far
+// A level that is out of range is reported and fails the script, but doesn't stop it
+//
+bool AudioRenderer::checkLevel(std::istringstream & args) {
+	uint32_t from, to;
+	int minimum, maximum;
+	if (!(args >> from >> to >> minimum >> maximum) || from >= to) {
+		return false;
+	}
+	uint64_t rate = audioMixer->sampleRate();
+	auto start = from * rate / 1000;
+	auto end = to * rate / 1000;
+	if (end > rendered.size()) {
+		fprintf(stderr, "audio_render: level window %d-%d ms has not been rendered yet\n", from, to);
+		return false;
+	}
+	int level = 0;
+	for (auto i = start; i < end; i++) {
+		level = std::max(level, abs(rendered[i]));
+	}
+	debug_log("level: %d-%d ms peaks at %d\n", from, to, level);
+	if (level < minimum || level > maximum) {
+		fprintf(stderr, "audio_render: level %d between %d and %d ms is outside %d to %d\n", level, from, to, minimum, maximum);
+		stats.levelFailures++;
+	}
+	return true;
+}
+
+// Render a number of milliseconds of audio, running the audio driver as it would run on the VDP
+//
+void AudioRenderer::render(uint32_t ms) {
+	auto rate = audioMixer->sampleRate();
+	while (ms--) {
+		if (audioChannelsToSchedule.load() || (int32_t)(millis() - driverWake) >= 0) {
+			auto start = Clock::now();
+			runDriver();
+			stats.driverTime += std::chrono::duration<double>(Clock::now() - start).count();
+		}
+
+		sampleFraction += rate;
+		auto count = sampleFraction / 1000;
+		sampleFraction %= 1000;
+
+		int active = 0;
+		for (int i = 0; i < MAX_AUDIO_CHANNELS; i++) {
+			if (channelEnabled(i) && (audioChannels[i]->getStatus() & AUDIO_STATUS_ACTIVE)) {
+				active++;
+			}
+		}
+		stats.channelSamples += active * count;
+
+		output.resize(count);
+		auto start = Clock::now();
+		for (uint32_t i = 0; i < count; i++) {
+			output[i] = soundGenerator->getSample();
+		}
+		stats.mixerTime += std::chrono::duration<double>(Clock::now() - start).count();
+		for (auto sample : output) {
+			addSample(sample);
+		}
+		hostClock()++;
+	}
+}
+
+bool AudioRenderer::channelsIdle() {
+	for (int i = 0; i < MAX_AUDIO_CHANNELS; i++) {
+		if (channelEnabled(i) && (audioChannels[i]->getStatus() & (AUDIO_STATUS_ACTIVE | AUDIO_STATUS_PLAYING))) {
+			return false;
+		}
+	}
+	return audioQueue.empty();
+}
+
+// One pass of the audio driver task's loop, noting when it would next wake
+// As on the VDP, long waits are capped at a second
+//
+void AudioRenderer::runDriver() {
+	auto now = millis();
+	auto wait = audioDriverStep(now, deadlines, activeChannels);
+	driverWake = now + std::min<uint32_t>(wait, 1000);
+}
+
+// Add a sample to the output, and to the checksum
+//
+void AudioRenderer::addSample(int8_t sample) {
+	uint8_t value = sample + 128;
+	stats.samples++;
+	rendered.push_back(sample);
+	stats.checksum ^= value;
+	for (int bit = 0; bit < 8; bit++) {
+		stats.checksum = (stats.checksum >> 1) ^ (0xEDB88320 & -(stats.checksum & 1));
+	}
+	if (wav) {
+		wav->put(value);
+	}
+}
+
+// Reset the audio system to how it is at power on
+//
+void resetAudio() {
+	for (int i = 0; i < MAX_AUDIO_CHANNELS; i++) {
+		delete audioChannels[i];
+	}
+	delete audioSequencer;
+	delete audioMixer;
+	audioQueue.clear();
+	audioQueueClockBase = 0;
+	samples.clear();
+	hostClock() = 0;
+	initAudio();
+}
+
+// Write a WAV header for 8-bit mono data
+//
+void writeWavHeader(std::ostream & wav, uint32_t sampleRate, uint32_t length) {
+	auto word = [&wav](uint32_t value, int bytes) {
+		for (int i = 0; i < bytes; i++) {
+			wav.put((value >> (i * 8)) & 0xFF);
+		}
+	};
+	wav.write("RIFF", 4);
+	word(36 + length, 4);
+	wav.write("WAVEfmt ", 8);
+	word(16, 4);				// format chunk length
+	word(1, 2);					// PCM
+	word(1, 2);					// mono
+	word(sampleRate, 4);
+	word(sampleRate, 4);		// bytes per second
+	word(1, 2);					// bytes per sample
+	word(8, 2);					// bits per sample
+	wav.write("data", 4);
+	word(length, 4);
+}
+
+int main(int argc, char * argv[]) {
+	const char * outputPath = nullptr;
+	const char * scriptPath = nullptr;
+	int repeats = 1;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc) {
+			outputPath = argv[++i];
+		} else if (arg == "-r" && i + 1 < argc) {
+			repeats = std::max(1, atoi(argv[++i]));
+		} else if (arg == "-v") {
+			verbose = true;
+		} else if (!scriptPath) {
+			scriptPath = argv[i];
+		} else {
+			scriptPath = nullptr;
+			break;
+		}
+	}
+	if (!scriptPath) {
+		fprintf(stderr, "Usage: %s [-o output.wav] [-r repeats] [-v] script\n", argv[0]);
+		return 1;
+	}
+
+	std::string script;
+	{
+		std::ifstream file;
+		std::istream * input = &std::cin;
+		if (std::string(scriptPath) != "-") {
+			file.open(scriptPath);
+			if (!file) {
+				fprintf(stderr, "audio_render: cannot read %s\n", scriptPath);
+				return 1;
+			}
+			input = &file;
+		}
+		std::stringstream contents;
+		contents << input->rdbuf();
+		script = contents.str();
+	}
+
+	std::ofstream wav;
+	if (outputPath) {
+		wav.open(outputPath, std::ios::binary);
+		if (!wav) {
+			fprintf(stderr, "audio_render: cannot write %s\n", outputPath);
+			return 1;
+		}
+		// the header is written again once the length is known
+		writeWavHeader(wav, 0, 0);
+	}
+
+	RenderStats total;
+	for (int run = 0; run < repeats; run++) {
+		resetAudio();
+		// only the first run is written out, as every run renders the same audio
+		AudioRenderer renderer(run == 0 && outputPath ? &wav : nullptr);
+		std::istringstream input(script);
+		if (!renderer.run(input)) {
+			return 1;
+		}
+		auto &stats = renderer.getStats();
+		if (run > 0 && stats.checksum != total.checksum) {
+			fprintf(stderr, "audio_render: run %d checksum %08x differs from first run %08x\n", run + 1, stats.checksum, total.checksum);
+			return 1;
+		}
+		total.samples = stats.samples;
+		total.checksum = stats.checksum;
+		total.channelSamples += stats.channelSamples;
+		total.driverTime += stats.driverTime;
+		total.mixerTime += stats.mixerTime;
+		total.comparedSamples = stats.comparedSamples;
+		total.largestDifference = stats.largestDifference;
+		total.timingShifts = stats.timingShifts;
+		total.levelFailures = stats.levelFailures;
+		total.checksumExpected = stats.checksumExpected;
+		total.expectedChecksum = stats.expectedChecksum;
+	}
+
+	if (outputPath) {
+		wav.seekp(0);
+		writeWavHeader(wav, audioMixer->sampleRate(), total.samples);
+	}
+
+	auto time = total.driverTime + total.mixerTime;
+	printf("samples:          %llu\n", (unsigned long long)total.samples);
+	printf("checksum:         %08x\n", total.checksum);
+	printf("driver time:      %.3f ms per run\n", total.driverTime * 1000 / repeats);
+	printf("mixer time:       %.3f ms per run\n", total.mixerTime * 1000 / repeats);
+	if (time > 0) {
+		printf("output rate:      %.0f samples/s\n", total.samples * repeats / time);
+	}
+	if (time > 0 && total.channelSamples > 0) {
+		// how many channels this host could keep playing in real time
+		auto channelRate = total.channelSamples / time;
+		printf("channel rate:     %.0f channel samples/s, or %.1f channels at %d Hz\n",
+			channelRate, channelRate / audioMixer->sampleRate(), audioMixer->sampleRate());
+	}
+	if (total.comparedSamples > 0) {
+		printf("reference:        %llu samples compared, largest difference %d\n", (unsigned long long)total.comparedSamples, total.largestDifference);
+		printf("loop timing:      %llu shifts of a sample at loop points\n", (unsigned long long)total.timingShifts);
+		if (total.largestDifference > 1) {
+			fprintf(stderr, "audio_render: output differs from the reference generator by more than 1 LSB\n");
+			return 1;
+		}
+	}
+	if (total.levelFailures > 0) {
+		fprintf(stderr, "audio_render: %d level checks failed\n", total.levelFailures);
+		return 1;
+	}
+	if (total.checksumExpected && total.checksum != total.expectedChecksum) {
+		fprintf(stderr, "audio_render: checksum %08x does not match the expected %08x\n", total.checksum, total.expectedChecksum);
+		return 1;
+	}
+	return 0;
+}
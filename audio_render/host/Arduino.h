@@ -0,0 +1,44 @@
+//
+// Title:			Host stand-in for the Arduino core
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+// Just enough of the Arduino, ESP-IDF and FreeRTOS APIs for the audio code to build on a host
+// Time comes from a virtual clock that the render harness advances as it renders audio,
+// so renders are repeatable whatever the speed of the host
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "esp_heap_caps.h"
+#include "esp32-hal-psram.h"
+
+inline uint64_t &hostClock() {
+	static uint64_t clock = 0;
+	return clock;
+}
+
+// unsigned long is 32 bits on the ESP32, so the same type is used here whatever the host's size
+inline uint32_t millis() {
+	return (uint32_t)hostClock();
+}
+
+// FreeRTOS
+// The harness runs the audio driver itself, so there is never an audio task to notify
+typedef void * TaskHandle_t;
+typedef int BaseType_t;
+#define pdPASS				1
+#define pdTRUE				1
+#define portMAX_DELAY		0xFFFFFFFF
+#define pdMS_TO_TICKS(ms)	(ms)
+
+inline void xTaskNotifyGive(TaskHandle_t task) {}
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, uint32_t ticks) { return 0; }
+inline BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char * name, uint32_t stack, void * parameters,
+	int priority, TaskHandle_t * handle, int core) {
+	return pdPASS;
+}
@@ -0,0 +1,29 @@
+//
+// Title:			Host stand-in for the Arduino Stream class
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Stream {
+	public:
+		virtual ~Stream() {}
+		virtual int available() = 0;
+		virtual int read() = 0;
+		virtual int peek() = 0;
+		virtual size_t write(uint8_t b) = 0;
+		virtual size_t readBytes(char * buffer, size_t length) {
+			size_t count = 0;
+			while (count < length && available()) {
+				buffer[count++] = read();
+			}
+			return count;
+		}
+		virtual size_t readBytes(uint8_t * buffer, size_t length) {
+			return readBytes((char *)buffer, length);
+		}
+};
@@ -0,0 +1,13 @@
+//
+// Title:			Host stand-in for ESP32 PSRAM support
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+
+#pragma once
+
+#include <cstdlib>
+
+inline bool psramInit() { return false; }
+inline void * ps_malloc(size_t size) { return malloc(size); }
+inline void * ps_calloc(size_t count, size_t size) { return calloc(count, size); }
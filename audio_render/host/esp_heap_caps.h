@@ -0,0 +1,18 @@
+//
+// Title:			Host stand-in for ESP-IDF heap capabilities
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+
+#pragma once
+
+#include <cstdlib>
+
+#define MALLOC_CAP_8BIT		(1 << 2)
+#define MALLOC_CAP_SPIRAM	(1 << 10)
+
+inline void * heap_caps_malloc(size_t size, uint32_t caps) { return malloc(size); }
+inline void * heap_caps_calloc(size_t count, size_t size, uint32_t caps) { return calloc(count, size); }
+inline void * heap_caps_realloc(void * p, size_t size, uint32_t caps) { return realloc(p, size); }
+inline void heap_caps_free(void * p) { free(p); }
+inline size_t heap_caps_get_free_size(uint32_t caps) { return 0; }
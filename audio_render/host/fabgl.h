@@ -0,0 +1,210 @@
+//
+// Title:			Host stand-in for the vdp-gl sound generator
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+// The waveform generator base class and sound generator follow vdp-gl's, so our own generators and mixer
+// behave exactly as they do on the VDP
+// The built-in waveforms are simple phase accumulator versions of vdp-gl's, so they cost and sound about the same,
+// but are not sample for sample identical to the real ones
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace fabgl {
+
+class WaveformGenerator {
+	public:
+		virtual ~WaveformGenerator() {}
+
+		virtual void setFrequency(int value) = 0;
+		virtual int getSample() = 0;
+
+		void setVolume(int value) { m_volume = value; }
+		int volume() { return m_volume; }
+
+		bool enabled() { return m_enabled; }
+		void enable(bool value) { m_enabled = value; }
+
+		virtual void setSampleRate(int value) { m_sampleRate = value; }
+		uint16_t sampleRate() { return m_sampleRate; }
+
+		void setDuration(uint32_t value) { m_duration = value; }
+		uint32_t duration() { return m_duration; }
+		void decDuration() {
+			--m_duration;
+			if (m_duration == 0) {
+				m_enabled = false;
+			}
+		}
+
+	private:
+		uint16_t	m_sampleRate = 0;
+		int			m_volume = 100;
+		bool		m_enabled = false;
+		uint32_t	m_duration = (uint32_t)-1;
+};
+
+// Shared phase accumulator for the built-in waveforms, holding the position within a cycle in 1/2^32 units
+class PhaseWaveformGenerator : public WaveformGenerator {
+	public:
+		void setFrequency(int value) {
+			m_frequency = value;
+			updateStep();
+		}
+		void setSampleRate(int value) {
+			WaveformGenerator::setSampleRate(value);
+			updateStep();
+		}
+		int getSample() {
+			if (m_frequency == 0 || duration() == 0) {
+				return 0;
+			}
+			int sample = waveform(m_phase) * volume() / 127;
+			m_phase += m_step;
+			decDuration();
+			return sample;
+		}
+
+	protected:
+		// Sample for a position within the cycle, from -128 to 127
+		virtual int waveform(uint32_t phase) = 0;
+
+	private:
+		int			m_frequency = 0;
+		uint32_t	m_phase = 0;
+		uint32_t	m_step = 0;
+
+		void updateStep() {
+			m_step = sampleRate() ? (uint32_t)((uint64_t)m_frequency * 4294967296ULL / sampleRate()) : 0;
+		}
+};
+
+class SineWaveformGenerator : public PhaseWaveformGenerator {
+	protected:
+		int waveform(uint32_t phase) {
+			static std::vector<int8_t> table;
+			if (table.empty()) {
+				for (int i = 0; i < 256; i++) {
+					table.push_back((int8_t)lround(127.0 * sin(i * 2.0 * M_PI / 256.0)));
+				}
+			}
+			return table[phase >> 24];
+		}
+};
+
+class SquareWaveformGenerator : public PhaseWaveformGenerator {
+	public:
+		void setDutyCycle(int dutyCycle) { m_dutyCycle = dutyCycle; }
+	protected:
+		int waveform(uint32_t phase) {
+			return (int)(phase >> 24) < m_dutyCycle ? 127 : -127;
+		}
+	private:
+		int			m_dutyCycle = 127;
+};
+
+class TriangleWaveformGenerator : public PhaseWaveformGenerator {
+	protected:
+		int waveform(uint32_t phase) {
+			int position = phase >> 23;		// 0 to 511
+			return position < 256 ? position - 128 : 383 - position;
+		}
+};
+
+class SawtoothWaveformGenerator : public PhaseWaveformGenerator {
+	protected:
+		int waveform(uint32_t phase) {
+			return (int)(phase >> 24) - 128;
+		}
+};
+
+class NoiseWaveformGenerator : public WaveformGenerator {
+	public:
+		void setFrequency(int value) {}
+		int getSample() {
+			if (duration() == 0) {
+				return 0;
+			}
+			// 16 bit Galois LFSR
+			m_noise = (m_noise >> 1) ^ (-(m_noise & 1) & 0xB400);
+			int sample = (int)(m_noise & 0xFF) - 128;
+			decDuration();
+			return sample * volume() / 127;
+		}
+	private:
+		uint16_t	m_noise = 0xFAEC;
+};
+
+class VICNoiseGenerator : public PhaseWaveformGenerator {
+	protected:
+		// a new random level every cycle, as the VIC's noise voice steps its shift register at the note frequency
+		int waveform(uint32_t phase) {
+			if (phase < m_lastPhase) {
+				m_noise = (m_noise >> 1) ^ (-(m_noise & 1) & 0xB400);
+			}
+			m_lastPhase = phase;
+			return (m_noise & 0x80) ? 127 : -127;
+		}
+	private:
+		uint16_t	m_noise = 0xFAEC;
+		uint32_t	m_lastPhase = 0;
+};
+
+// The sound generator mixes its attached generators, scaled by their total volume and then its own,
+// as each sample is requested by the audio output
+class SoundGenerator {
+	public:
+		SoundGenerator(int sampleRate) : m_sampleRate(sampleRate) {}
+
+		void attach(WaveformGenerator * generator) {
+			generator->setSampleRate(m_sampleRate);
+			m_generators.push_back(generator);
+		}
+		void detach(WaveformGenerator * generator) {
+			m_generators.erase(std::remove(m_generators.begin(), m_generators.end(), generator), m_generators.end());
+		}
+		void clear() { m_generators.clear(); }
+
+		bool play(bool value) {
+			auto last = m_playing;
+			m_playing = value;
+			return last;
+		}
+		bool playing() { return m_playing; }
+
+		void setVolume(int value) { m_volume = value; }
+		int volume() { return m_volume; }
+		int sampleRate() { return m_sampleRate; }
+
+		// Get the next output sample, as the audio output would
+		int getSample() {
+			int sample = 0;
+			int totalVolume = 0;
+			for (auto generator : m_generators) {
+				if (generator->enabled()) {
+					sample += generator->getSample();
+					totalVolume += generator->volume();
+				}
+			}
+			int gain = totalVolume ? std::min(127, 127 * 127 / totalVolume) : 127;
+			sample = sample * gain / 127;
+			sample = sample * m_volume / 127;
+			return std::max(-128, std::min(127, sample));
+		}
+
+	private:
+		std::vector<WaveformGenerator *>	m_generators;
+		int			m_sampleRate;
+		int			m_volume = 100;
+		bool		m_playing = false;
+};
+
+} // namespace fabgl
+
+using namespace fabgl;
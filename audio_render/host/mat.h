@@ -0,0 +1,20 @@
+//
+// Title:			Host stand-in for the esp-dsp matrix class
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+// Buffers use matrices for transforms, which audio doesn't need, so only the declarations they compile against are here
+//
+
+#pragma once
+
+namespace dspm {
+	class Mat {
+		public:
+			Mat(float * data, int rows, int cols) : data(data), rows(rows), cols(cols) {}
+			Mat inverse() { return *this; }
+			float *	data;
+			int		rows;
+			int		cols;
+	};
+}
@@ -0,0 +1,102 @@
+//
+// Title:			Reference samples generator
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+//
+// The double precision sample playback that EnhancedSamplesGenerator used before it moved to a fixed point
+// phase accumulator, kept so the harness can check the fixed point version stays within 1 LSB of it
+// It reads sample data through AudioSample::getSample, so only handles PCM samples held in memory
+//
+
+#ifndef REFERENCE_SAMPLES_GENERATOR_H
+#define REFERENCE_SAMPLES_GENERATOR_H
+
+#include <memory>
+#include <fabgl.h>
+
+#include "audio_sample.h"
+
+class ReferenceSamplesGenerator : public WaveformGenerator {
+	public:
+		ReferenceSamplesGenerator(std::shared_ptr<AudioSample> sample) : _sample(sample) {}
+
+		void setFrequency(int value) {
+			frequency = value;
+			samplesPerGet = calculateSamplerate(value);
+		}
+		void setSampleRate(int value) {
+			WaveformGenerator::setSampleRate(value);
+			samplesPerGet = calculateSamplerate(frequency);
+		}
+		int getSample();
+		void seekTo(uint32_t position);
+
+	private:
+		std::shared_ptr<AudioSample> _sample;
+		uint32_t	index = 0;
+		uint32_t	blockIndex = 0;
+		int32_t		repeatCount = 0;
+		int			frequency = 0;
+		int			previousSample = 0;
+		int			currentSample = 0;
+		double		samplesPerGet = 1.0;
+		double		fractionalSampleOffset = 0.0;
+
+		double calculateSamplerate(uint16_t frequency);
+		int8_t getNextSample();
+};
+
+int ReferenceSamplesGenerator::getSample() {
+	if (duration() == 0) {
+		return 0;
+	}
+
+	// if we've moved far enough along, read the next sample
+	while (fractionalSampleOffset >= 1.0) {
+		previousSample = currentSample;
+		currentSample = getNextSample();
+		fractionalSampleOffset = fractionalSampleOffset - 1.0;
+	}
+
+	// Interpolate between the samples to reduce aliasing
+	int sample = currentSample * fractionalSampleOffset + previousSample * (1.0 - fractionalSampleOffset);
+
+	fractionalSampleOffset = fractionalSampleOffset + samplesPerGet;
+
+	// process volume
+	sample = sample * volume() / 127;
+
+	decDuration();
+
+	return sample;
+}
+
+void ReferenceSamplesGenerator::seekTo(uint32_t position) {
+	_sample->seekTo(position, index, blockIndex, repeatCount);
+
+	// prepare our fractional sample data for playback
+	fractionalSampleOffset = 0.0;
+	previousSample = _sample->getSample(index, blockIndex);
+	currentSample = _sample->getSample(index, blockIndex);
+}
+
+double ReferenceSamplesGenerator::calculateSamplerate(uint16_t frequency) {
+	auto baseFrequency = _sample->baseFrequency;
+	auto frequencyAdjust = baseFrequency > 0 ? (double)frequency / (double)baseFrequency : 1.0;
+	return frequencyAdjust * ((double)_sample->sampleRate / (double)(sampleRate()));
+}
+
+int8_t ReferenceSamplesGenerator::getNextSample() {
+	auto sample = _sample->getSample(index, blockIndex);
+
+	// looping magic
+	repeatCount--;
+	if (repeatCount == 0) {
+		// we've reached the end of the repeat section, so loop back
+		seekTo(_sample->repeatStart);
+	}
+
+	return sample;
+}
+
+#endif // REFERENCE_SAMPLES_GENERATOR_H
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+
+// Checks that drawing into a bitmap through a render target invalidates the bitmap's cached spans.
+// A transparent RGBA2222 bitmap with spans is drawn once (so its empty spans are cached), a rectangle
+// is drawn into it as a render target, and the bitmap is then drawn to the screen again and read back.
+// Exits with status 0 if the rectangle appears, or 1 if the bitmap is still drawn as fully transparent.
+
+// --- VDP Commands ---
+#define VDU_CLEAR_GRAPHICS 16
+#define VDU_GCOL 18
+#define VDU_MODE 22
+#define VDU_PLOT 25
+#define VDU_CURSOR_OFF 23, 0, 1, 0
+#define VDU_LOGICAL_COORDS 23, 0, 0xC0
+#define VDU_READ_PIXEL 23, 0, 0x84
+#define VDU_BUFFER 23, 0, 0xA0
+#define VDU_BITMAP 23, 27
+
+#define BUFFER_CLEAR 2
+#define BUFFER_CREATE 3
+#define BITMAP_DRAW 3
+#define BITMAP_SELECT 0x20
+#define BITMAP_FROM_BUFFER 0x21
+#define BITMAP_RENDER_TARGET 0x25
+
+#define PACKET_SCRPIXEL 0x04
+
+#define BITMAP_ID 0xFA00
+#define BITMAP_SIZE 16
+#define BITMAP_X 32
+#define BITMAP_Y 32
+#define TEST_COLOUR 9
+
+
+// --- Serial Port Handling ---
+int serial_port;
+
+// Function to send a sequence of bytes to the VDP
+void vdp_send(const unsigned char* data, size_t len) {
+    if (write(serial_port, data, len) != len) {
+        perror("Failed to write to serial port");
+    }
+    tcdrain(serial_port); // Wait for all data to be written
+}
+
+// Function to send a single byte command
+void vdp_putc(unsigned char c) {
+    vdp_send(&c, 1);
+}
+
+// Function to send a 16-bit word (little-endian)
+void vdp_putw(int w) {
+    unsigned char data[2];
+    data[0] = w & 0xFF;
+    data[1] = (w >> 8) & 0xFF;
+    vdp_send(data, 2);
+}
+
+// Function to read a single byte, returning -1 on timeout
+int vdp_getc() {
+    unsigned char c;
+    if (read(serial_port, &c, 1) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+// --- VDP Command Wrappers ---
+void vdp_set_graphics_color(int color) {
+    vdp_putc(VDU_GCOL);
+    vdp_putc(0); // Mode 0: Set foreground color
+    vdp_putc(color);
+}
+
+void vdp_filled_rectangle(int x1, int y1, int x2, int y2) {
+    vdp_putc(VDU_PLOT);
+    vdp_putc(4); // Move to first corner
+    vdp_putw(x1); vdp_putw(y1);
+    vdp_putc(VDU_PLOT);
+    vdp_putc(101); // Filled rectangle to second corner
+    vdp_putw(x2); vdp_putw(y2);
+}
+
+void vdp_bitmap_command(int command, int id) {
+    unsigned char cmd[] = { VDU_BITMAP, command };
+    vdp_send(cmd, sizeof(cmd));
+    vdp_putw(id);
+}
+
+void vdp_render_target(int id, int width, int height) {
+    vdp_bitmap_command(BITMAP_RENDER_TARGET, id);
+    vdp_putw(width);
+    vdp_putw(height);
+}
+
+void vdp_draw_bitmap(int x, int y) {
+    unsigned char cmd[] = { VDU_BITMAP, BITMAP_DRAW };
+    vdp_send(cmd, sizeof(cmd));
+    vdp_putw(x);
+    vdp_putw(y);
+}
+
+// Reads back a screen pixel as RGB888, returning -1 if no pixel packet arrives
+long vdp_read_pixel(int x, int y) {
+    unsigned char cmd[] = { VDU_READ_PIXEL };
+    tcflush(serial_port, TCIFLUSH);
+    vdp_send(cmd, sizeof(cmd));
+    vdp_putw(x);
+    vdp_putw(y);
+    int c;
+    while ((c = vdp_getc()) != -1) {
+        if (c != (0x80 | PACKET_SCRPIXEL)) {
+            continue;
+        }
+        if (vdp_getc() != 4) {
+            return -1;
+        }
+        int r = vdp_getc(), g = vdp_getc(), b = vdp_getc();
+        vdp_getc(); // logical colour
+        if (r < 0 || g < 0 || b < 0) {
+            return -1;
+        }
+        return (long)r << 16 | g << 8 | b;
+    }
+    return -1;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <serial_port_device>\n", argv[0]);
+        fprintf(stderr, "Example: %s /dev/ttyUSB0\n", argv[0]);
+        return 1;
+    }
+
+    const char *portname = argv[1];
+    serial_port = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
+
+    if (serial_port < 0) {
+        perror("Error opening serial port");
+        return 1;
+    }
+
+    struct termios tty;
+    if (tcgetattr(serial_port, &tty) != 0) {
+        perror("Error from tcgetattr");
+        return 1;
+    }
+
+    cfsetospeed(&tty, B57600);
+    cfsetispeed(&tty, B57600);
+
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8; // 8-bit chars
+    tty.c_iflag &= ~IGNBRK; // disable break processing
+    tty.c_lflag = 0; // no signaling chars, no echo,
+    tty.c_oflag = 0; // no remapping, no delays
+    tty.c_cc[VMIN]  = 0; // read doesn't block
+    tty.c_cc[VTIME] = 5; // 0.5 seconds read timeout
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
+    tty.c_cflag |= (CLOCAL | CREAD); // ignore modem controls, enable reading
+    tty.c_cflag &= ~(PARENB | PARODD); // shut off parity
+    tty.c_cflag &= ~CSTOPB;
+    tty.c_cflag &= ~CRTSCTS;
+
+    if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {
+        perror("Error from tcsetattr");
+        return 1;
+    }
+
+    // Initial VDP setup, using screen pixel coordinates
+    vdp_putc(VDU_MODE); vdp_putc(8); // Mode 8: 320x240x64
+    usleep(100000); // Wait for mode change
+    unsigned char cmd_cursor_off[] = { VDU_CURSOR_OFF };
+    vdp_send(cmd_cursor_off, sizeof(cmd_cursor_off));
+    unsigned char cmd_coords[] = { VDU_LOGICAL_COORDS, 0 };
+    vdp_send(cmd_coords, sizeof(cmd_coords));
+
+    // Expected colour, from the same rectangle drawn straight to the screen
+    vdp_set_graphics_color(TEST_COLOUR);
+    vdp_filled_rectangle(0, 0, 7, 7);
+    long expected = vdp_read_pixel(4, 4);
+    vdp_putc(VDU_CLEAR_GRAPHICS);
+    if (expected <= 0) {
+        fprintf(stderr, "Could not read back the reference pixel\n");
+        return 1;
+    }
+
+    // Transparent RGBA2222 bitmap from a zeroed buffer, with opaque spans (format 0x81)
+    unsigned char cmd_clear[] = { VDU_BUFFER, BITMAP_ID & 0xFF, BITMAP_ID >> 8, BUFFER_CLEAR };
+    vdp_send(cmd_clear, sizeof(cmd_clear));
+    unsigned char cmd_create[] = { VDU_BUFFER, BITMAP_ID & 0xFF, BITMAP_ID >> 8, BUFFER_CREATE };
+    vdp_send(cmd_create, sizeof(cmd_create));
+    vdp_putw(BITMAP_SIZE * BITMAP_SIZE);
+    vdp_bitmap_command(BITMAP_SELECT, BITMAP_ID);
+    unsigned char cmd_bitmap[] = { VDU_BITMAP, BITMAP_FROM_BUFFER };
+    vdp_send(cmd_bitmap, sizeof(cmd_bitmap));
+    vdp_putw(BITMAP_SIZE);
+    vdp_putw(BITMAP_SIZE);
+    vdp_putc(0x81);
+
+    // Drawing it caches its (empty) spans
+    vdp_draw_bitmap(BITMAP_X, BITMAP_Y);
+
+    // Draw a rectangle into the middle of the bitmap
+    vdp_render_target(BITMAP_ID, 0, 0);
+    vdp_set_graphics_color(TEST_COLOUR);
+    vdp_filled_rectangle(4, 4, BITMAP_SIZE - 5, BITMAP_SIZE - 5);
+    vdp_render_target(65535, 0, 0);
+
+    // Draw the bitmap again, and check both the rectangle and the transparent border
+    vdp_putc(VDU_CLEAR_GRAPHICS);
+    vdp_draw_bitmap(BITMAP_X, BITMAP_Y);
+    long inside = vdp_read_pixel(BITMAP_X + BITMAP_SIZE / 2, BITMAP_Y + BITMAP_SIZE / 2);
+    long border = vdp_read_pixel(BITMAP_X + 1, BITMAP_Y + 1);
+
+    vdp_send(cmd_clear, sizeof(cmd_clear));
+    close(serial_port);
+
+    int failed = 0;
+    if (inside != expected) {
+        printf("FAIL: rectangle drawn into bitmap reads %06lX, expected %06lX\n", inside, expected);
+        failed = 1;
+    }
+    if (border != 0) {
+        printf("FAIL: transparent border reads %06lX, expected 000000\n", border);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("PASS: render target drawing shows up when the bitmap is drawn\n");
+    }
+    return failed;
+}
@@ -114,12 +114,18 @@
 #define PACKET_MOUSE			0x09	// Mouse data
 #define PACKET_ECHO				0x0A	// Echo
 #define PACKET_ECHO_END			0x0B	// Echo end
+#define PACKET_SPRITE_COLLISION	0x0C	// Sprite collisions
+#define PACKET_AUDIO_STREAM		0x0D	// Audio stream status
 
 #define AUDIO_CHANNELS			3		// Default number of audio channels
 #define AUDIO_DEFAULT_SAMPLE_RATE	16384	// Default sample rate
 #define MAX_AUDIO_CHANNELS		32		// Maximum number of audio channels
 #define AUDIO_CHANNEL_PRIORITY	3		// Sound driver task priority with 3 (configMAX_PRIORITIES - 1) being the highest, and 0 being the lowest
 #define AUDIO_CORE				0		// Core to run audio tasks on
+#define AUDIO_MIXER_BLOCK_SIZE	64		// Number of samples the audio mixer renders at a time
+#define AUDIO_ENVELOPE_INTERVAL	1		// Milliseconds between updates for channels with an active envelope
+#define AUDIO_NO_DEADLINE		0xFFFFFFFF	// Channel does not need updating until it receives a new command
+#define AUDIO_PHASE_STEP_CACHE_SIZE	16		// Number of frequencies each sample generator keeps the phase step for
 
 // Audio command definitions
 //
@@ -138,6 +144,8 @@
 #define AUDIO_CMD_DURATION		12		// Set the duration of a channel
 #define AUDIO_CMD_SAMPLERATE	13		// Set the samplerate for channel or underlying audio system
 #define AUDIO_CMD_SET_PARAM		14		// Set a waveform parameter
+#define AUDIO_CMD_SEQUENCER		15		// Control the pattern sequencer
+#define AUDIO_CMD_QUEUE			16		// Queue timed notes and changes
 
 #define AUDIO_WAVE_DEFAULT		0		// Default waveform (Square wave)
 #define AUDIO_WAVE_SQUARE		0		// Square wave
@@ -158,16 +166,23 @@
 #define AUDIO_SAMPLE_BUFFER_SET_REPEAT_START	6	// Set the repeat start point of a sample (using buffer ID)
 #define AUDIO_SAMPLE_SET_REPEAT_LENGTH			7	// Set the repeat length of a sample
 #define AUDIO_SAMPLE_BUFFER_SET_REPEAT_LENGTH	8	// Set the repeat length of a sample (using buffer ID)
+#define AUDIO_SAMPLE_STREAM_CREATE				9	// Create a streaming sample (using buffer ID)
+#define AUDIO_SAMPLE_STREAM_WRITE				10	// Write data to a streaming sample (using buffer ID)
 #define AUDIO_SAMPLE_DEBUG_INFO 0x10	// Get debug info about a sample
 
 #define AUDIO_DEFAULT_FREQUENCY	523		// Default sample frequency (C5, or C above middle C)
+#define AUDIO_SAMPLE_CONTIGUOUS_MAX	(256 * 1024)	// Largest sample that will be copied into a single block for playback
 
 #define AUDIO_FORMAT_8BIT_SIGNED	0	// 8-bit signed sample
 #define AUDIO_FORMAT_8BIT_UNSIGNED	1	// 8-bit unsigned sample
+#define AUDIO_FORMAT_ADPCM			2	// 4-bit IMA ADPCM sample, in blocks of AUDIO_ADPCM_BLOCK_SIZE bytes
 #define AUDIO_FORMAT_DATA_MASK		7	// data bit mask for format
 #define AUDIO_FORMAT_WITH_RATE		8	// OR this with the format to indicate a sample rate follows
 #define AUDIO_FORMAT_TUNEABLE		16	// OR this with the format to indicate sample can be tuned (frequency adjustable)
 
+#define AUDIO_ADPCM_BLOCK_SIZE			256		// Bytes per ADPCM block, including its 4 byte header
+#define AUDIO_ADPCM_SAMPLES_PER_BLOCK	(1 + (AUDIO_ADPCM_BLOCK_SIZE - 4) * 2)	// Samples held in each ADPCM block
+
 #define AUDIO_ENVELOPE_NONE			0		// No envelope
 #define AUDIO_ENVELOPE_ADSR			1		// Simple ADSR volume envelope
 #define AUDIO_ENVELOPE_MULTIPHASE_ADSR		2		// Multi-phase ADSR envelope
@@ -190,6 +205,31 @@
 #define AUDIO_STATUS_HAS_VOLUME_ENVELOPE	0x08	// Channel has a volume envelope set
 #define AUDIO_STATUS_HAS_FREQUENCY_ENVELOPE	0x10	// Channel has a frequency envelope set
 
+#define AUDIO_STREAM_LOW_WATER	0x01	// Stream has fallen below its low water level, so needs more data
+#define AUDIO_STREAM_UNDERRUN	0x02	// Stream ran out of data, and played silence
+#define AUDIO_STREAM_OVERRUN	0x04	// Data written to the stream didn't fit, so some was dropped
+
+#define AUDIO_SEQUENCER_LOAD	0		// Load a song from instrument, pattern and order list buffers
+#define AUDIO_SEQUENCER_START	1		// Start playing from the current position
+#define AUDIO_SEQUENCER_STOP	2		// Stop playing, silencing all tracks
+#define AUDIO_SEQUENCER_TEMPO	3		// Set the length of a pattern row in milliseconds
+#define AUDIO_SEQUENCER_JUMP	4		// Jump to a position in the order list and a row in its pattern
+
+#define AUDIO_SEQUENCER_CELL_SIZE		3		// Bytes per pattern cell - note, instrument, volume
+#define AUDIO_SEQUENCER_INSTRUMENT_SIZE	11		// Bytes per instrument definition
+#define AUDIO_SEQUENCER_NOTE_OFF		0xFF	// Pattern note that releases the track's current note
+#define AUDIO_SEQUENCER_NO_VOLUME		0xFF	// Pattern volume that leaves the track's volume unchanged
+#define AUDIO_SEQUENCER_ROW_LENGTH		125		// Default row length in milliseconds
+
+#define AUDIO_QUEUE_RESET_CLOCK		0		// Restart the queue's clock, which queued times are relative to
+#define AUDIO_QUEUE_CLEAR			1		// Discard all queued events
+#define AUDIO_QUEUE_PLAY			2		// Queue a note
+#define AUDIO_QUEUE_VOLUME			3		// Queue a volume change
+#define AUDIO_QUEUE_FREQUENCY		4		// Queue a frequency change
+
+#define AUDIO_QUEUE_MAX				256		// Maximum number of queued events
+#define AUDIO_QUEUE_LOOKAHEAD		10		// Milliseconds ahead of time that queued notes are set up, so they start on their exact sample
+
 // Mouse commands
 #define MOUSE_ENABLE			0		// Enable mouse
 #define MOUSE_DISABLE			1		// Disable mouse
@@ -283,6 +323,10 @@
 #define BUFFERED_REVERSE				0x18	// Reverse the order of data in a buffer
 #define BUFFERED_COPY_REF				0x19	// Copy references to blocks from multiple buffers into one buffer
 #define BUFFERED_COPY_AND_CONSOLIDATE	0x1A	// Copy blocks from multiple buffers into one buffer and consolidate them
+#define BUFFERED_REPEAT_CALL			0x1B	// Call a buffer a number of times
+#define BUFFERED_SET_COUNTER			0x1C	// Set a loop counter
+#define BUFFERED_DJNZ					0x1D	// Decrement a loop counter and jump to a buffer if not zero
+#define BUFFERED_OFFSET_DJNZ			0x1E	// Decrement a loop counter and jump to a buffer with an offset if not zero
 #define BUFFERED_AFFINE_TRANSFORM		0x20	// Create or combine a 3x3 2d affine transform matrix buffer
 #define BUFFERED_AFFINE_TRANSFORM_3D	0x21	// Create or combine a 4x4 3d affine transform matrix buffer
 #define BUFFERED_MATRIX					0x22	// Create or combine a matrix buffer of arbitrary dimensions
@@ -291,11 +335,13 @@
 #define BUFFERED_READ_VARIABLE			0x30	// Read a VDP variable value into a buffer
 #define BUFFERED_COMPRESS				0x40	// Compress blocks from multiple buffers into one buffer
 #define BUFFERED_DECOMPRESS				0x41	// Decompress blocks from multiple buffers into one buffer
+#define BUFFERED_COMPRESS_TYPE			0x42	// Compress blocks using a given compression type
+#define BUFFERED_WRITE_DECOMPRESS		0x43	// Write compressed data, decompressing it as it arrives
 #define BUFFERED_EXPAND_BITMAP			0x48	// Expand a bitmap buffer
 #define BUFFERED_ADD_CALLBACK			0x50	// Add a callback
 #define BUFFERED_REMOVE_CALLBACK		0x51	// Remove a callback
-// #define BUFFERED_ADD_TIMER_CALLBACK		0x52	// Add a timer callback
-// #define BUFFERED_REMOVE_TIMER_CALLBACK	0x53	// Remove a timer callback
+#define BUFFERED_ADD_TIMER_CALLBACK		0x52	// Add a timer callback
+#define BUFFERED_REMOVE_TIMER_CALLBACK	0x53	// Remove a timer callback
 
 #define BUFFERED_DEBUG_INFO				0x80	// Get debug info about a buffer
 
@@ -327,6 +373,7 @@
 #define COND_GREATER_EQUAL		0x07	// Conditional: greater than or equal
 #define COND_AND				0x08	// Conditional: AND
 #define COND_OR					0x09	// Conditional: OR
+#define COND_EXTENDED			0x0F	// Conditional: extended operation (operation and flags in following byte)
 
 // Conditional operation flags
 #define COND_OP_MASK			0x0F	// conditional operation code mask
@@ -335,6 +382,10 @@
 #define COND_VAR_VALUE			0x40	// condition source value is a flag
 #define COND_16BIT				0x80	// values to compare are a 16-bit
 
+// Extended conditional operation flags
+#define COND_EXT_SIGNED			0x10	// values to compare are signed
+#define COND_EXT_32BIT			0x20	// values to compare are 32-bit (overrides COND_16BIT)
+
 // Reverse operation flags
 #define REVERSE_16BIT			0x01	// 16-bit value length
 #define REVERSE_32BIT			0x02	// 32-bit value length
@@ -422,6 +473,10 @@
 // Buffered bitmap and sample info
 #define BUFFERED_BITMAP_BASEID		0xFA00	// Base ID for buffered bitmaps
 #define BUFFERED_SAMPLE_BASEID		0xFB00	// Base ID for buffered samples
+#define BUFFERED_LOOP_COUNTERS		16		// Number of loop counters for buffer programs
+#define BUFFERED_CONDITION_CACHE_SIZE	64	// Maximum number of cached compiled conditions
+#define TRANSFORMED_BITMAP_CACHE_SIZE	16	// Maximum number of cached transformed bitmaps
+#define TRANSFORMED_BITMAP_MAX_PIXELS	(320 * 240)	// Largest transformed bitmap that will be cached
 
 // Copper commands
 #define COPPER_CREATE_PALETTE		0		// Create a palette
@@ -430,6 +485,26 @@
 #define COPPER_UPDATE_SIGNALLIST	3		// Update the signal list
 #define COPPER_RESET_SIGNALLIST		4		// Reset the signal list
 
+// Sprite animation modes
+#define SPRITE_ANIMATE_NONE			0		// No frame animation
+#define SPRITE_ANIMATE_LOOP			1		// Loop from last frame back to first
+#define SPRITE_ANIMATE_PINGPONG		2		// Alternate direction at first and last frames
+#define SPRITE_ANIMATE_ONCE			3		// Stop at last frame
+#define SPRITE_ANIMATE_MODE_MASK	0x0F	// Animation mode mask
+#define SPRITE_ANIMATE_HIDE			0x80	// Hide sprite when a "once" animation completes
+
+// Sprite motion bounds modes
+#define SPRITE_BOUNDS_NONE			0		// No bounds
+#define SPRITE_BOUNDS_STOP			1		// Stop at bounds
+#define SPRITE_BOUNDS_WRAP			2		// Wrap around to opposite bound
+#define SPRITE_BOUNDS_BOUNCE		3		// Reverse direction at bounds
+
+// Sprite collision detection flags
+#define SPRITE_COLLISION_ENABLE		0x01	// Detect collisions each frame
+#define SPRITE_COLLISION_PIXEL		0x02	// Check overlapping bounding boxes pixel by pixel
+#define SPRITE_COLLISION_BUFFER		0x04	// Write collisions to a buffer rather than sending packets
+#define SPRITE_COLLISION_GROUPS		8		// Number of collision groups
+
 // Callback/event types
 #define CALLBACK_VSYNC				0		// VSync
 #define CALLBACK_MODE_CHANGE		1		// Mode changed
@@ -439,8 +514,11 @@
 #define CALLBACK_READPIXEL			5		// Read pixel event
 #define CALLBACK_SENDING_VDPP		0x0100	// Sending VDP protocol packet (OR with PACKET_* packet type value)
 #define CALLBACK_SENT_VDPP			0x0180	// Sent VDP protocol packet (OR with PACKET_* packet type value)
+// Timer callback flags
+#define TIMER_CALLBACK_FRAMES		0x01	// Interval is in frames rather than milliseconds
+#define TIMER_CALLBACK_REPEAT		0x02	// Repeat the callback, rather than firing once
+
 // Future callback types may include...
-// * timer events (which may require metadata for timer duration, etc),
 // * audio events (a singular audio status event probably won't be enough)
 // * cursor events (movement, blink?, etc.  may need metadata to control debouncing on movement, and when events are sent)
 // * paged mode events (output paused, about to resume, setting changed)
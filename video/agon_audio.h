@@ -10,6 +10,9 @@
 #ifndef AGON_AUDIO_H
 #define AGON_AUDIO_H
 
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <memory>
 #include <vector>
 #include <unordered_map>
@@ -20,37 +23,102 @@ std::mutex soundGeneratorMutex;
 
 #include "agon.h"
 #include "audio_channel.h"
+#include "audio_mixer.h"
 #include "audio_sample.h"
+#include "audio_sequencer.h"
 #include "types.h"
 
 // audio channels and their associated tasks
 AudioChannel *audioChannels[MAX_AUDIO_CHANNELS];
 TaskHandle_t audioTask;
+std::atomic<uint32_t> audioChannelsToSchedule(0);	// channels that have received commands since the driver last ran
+static_assert(MAX_AUDIO_CHANNELS <= 32, "audio channel scheduling uses a 32 bit mask");
 // Storage for our sample data
 std::unordered_map<uint16_t, std::shared_ptr<AudioSample>,
 	std::hash<uint16_t>, std::equal_to<uint16_t>,
 	psram_allocator<std::pair<const uint16_t, std::shared_ptr<AudioSample>>>> samples;
 fabgl::SoundGenerator *soundGenerator;  // audio handling sub-system
+AudioMixer *audioMixer;					// mixes all channels, and is the only generator attached to soundGenerator
+AudioSequencer *audioSequencer;			// plays songs held in buffers
+
+// Timed events, waiting for the audio clock to reach them
+struct QueuedAudioEvent {
+	uint8_t		channel;
+	uint8_t		command;		// AUDIO_QUEUE_PLAY, AUDIO_QUEUE_VOLUME or AUDIO_QUEUE_FREQUENCY
+	uint8_t		volume;
+	uint16_t	frequency;
+	uint16_t	duration;
+};
+std::multimap<uint64_t, QueuedAudioEvent> audioQueue;	// events, keyed by the audio clock sample they are due at
+std::mutex audioQueueMutex;
+uint64_t audioQueueClockBase = 0;		// audio clock sample that queued times are relative to
 
 bool channelEnabled(uint8_t channel);
+uint32_t processAudioQueue();
+
+// Ask the audio driver to update a channel as soon as possible
+// Called whenever a channel receives a command that may change its playback state
+//
+void scheduleAudioChannel(uint8_t channel) {
+	audioChannelsToSchedule.fetch_or(1UL << channel);
+	if (audioTask) {
+		xTaskNotifyGive(audioTask);
+	}
+}
+
+// Run one pass of the audio driver, updating the sequencer, the queue and any channels that are due
+// deadlines holds when each channel is next due, for the channels whose bits are set in activeChannels
+// Returns how many milliseconds until the next pass is needed, or AUDIO_NO_DEADLINE to wait for a command
+//
+uint32_t audioDriverStep(uint32_t now, uint32_t * deadlines, uint32_t & activeChannels) {
+	// the sequencer and queue go first, so the notes they play are picked up straight away
+	uint32_t wait = std::min(audioSequencer->loop(now), processAudioQueue());
+	auto scheduled = audioChannelsToSchedule.exchange(0);
+	for (int i=0; i<MAX_AUDIO_CHANNELS; i++) {
+		if (scheduled & (1UL << i)) {
+			deadlines[i] = now;
+		}
+	}
+	activeChannels |= scheduled;
+
+	for (int i=0; i<MAX_AUDIO_CHANNELS; i++) {
+		if (!(activeChannels & (1UL << i))) {
+			continue;
+		}
+		if (!audioChannels[i]) {
+			activeChannels &= ~(1UL << i);
+			continue;
+		}
+		if ((int32_t)(now - deadlines[i]) >= 0) {
+			auto next = audioChannels[i]->loop(now);
+			if (next == AUDIO_NO_DEADLINE) {
+				activeChannels &= ~(1UL << i);
+				continue;
+			}
+			deadlines[i] = now + next;
+		}
+		wait = std::min(wait, deadlines[i] - now);
+	}
+	return wait;
+}
 
 // Audio channel driver task
+// Only channels with a pending deadline are updated, and the task sleeps until the earliest
+// deadline or until a channel is scheduled by a new command, so idle channels cost nothing
 //
 void audioDriver(void * parameters) {
+	uint32_t deadlines[MAX_AUDIO_CHANNELS];
+	uint32_t activeChannels = 0;
 	while (true) {
-		auto now = millis();
-		for (int i=0; i<MAX_AUDIO_CHANNELS; i++) {
-			if (audioChannels[i]) {
-				audioChannels[i]->loop(now);
-			}
-		}
-		vTaskDelay(pdMS_TO_TICKS(1));
+		auto wait = audioDriverStep(millis(), deadlines, activeChannels);
+		// long waits are capped, so the conversion to ticks cannot overflow
+		ulTaskNotifyTake(pdTRUE, wait == AUDIO_NO_DEADLINE ? portMAX_DELAY : pdMS_TO_TICKS(std::min<uint32_t>(wait, 1000)));
 	}
 }
 
 BaseType_t initAudioTask() {
 	return xTaskCreatePinnedToCore(audioDriver, "audioDriver",
-		2048,
+		4096,						// the sequencer changes waveforms and envelopes from this task, so needs more stack
 		nullptr,
 		AUDIO_CHANNEL_PRIORITY,		// Priority, with 3 (configMAX_PRIORITIES - 1) being the highest, and 0 being the lowest.
 		&audioTask,
@@ -82,12 +150,8 @@ void setSampleRate(uint16_t sampleRate) {
 			delete soundGenerator;
 		}
 		soundGenerator = new fabgl::SoundGenerator(sampleRate);
-	}
-	for (int chan=0; chan<MAX_AUDIO_CHANNELS; chan++) {
-		if (audioChannels[chan]) {
-			auto lock = audioChannels[chan]->lock();
-			audioChannels[chan]->attachSoundGenerator();
-		}
+		// attaching the mixer passes the new sample rate on to all channels
+		soundGenerator->attach(audioMixer);
 	}
 	soundGenerator->play(true);
 }
@@ -98,6 +162,8 @@ void initAudio() {
 	for (int i=0; i<MAX_AUDIO_CHANNELS; i++) {
 		audioChannels[i] = nullptr;
 	}
+	audioMixer = new AudioMixer();
+	audioSequencer = new AudioSequencer();
 	setSampleRate(AUDIO_DEFAULT_SAMPLE_RATE);
 	for (uint8_t i = 0; i < AUDIO_CHANNELS; i++) {
 		initAudioChannel(i);
@@ -244,4 +310,88 @@ void resetSamples() {
 	samples.clear();
 }
 
+// Restart the queue's clock from now
+//
+uint8_t resetAudioQueueClock() {
+	auto lock = std::unique_lock<std::mutex>(audioQueueMutex);
+	audioQueueClockBase = audioMixer->getSampleClock();
+	return 1;
+}
+
+// Discard all queued events
+//
+uint8_t clearAudioQueue() {
+	auto lock = std::unique_lock<std::mutex>(audioQueueMutex);
+	audioQueue.clear();
+	return 1;
+}
+
+// Queue an event for a time in milliseconds relative to the queue's clock
+// Times are converted to samples now, so changing the sample rate affects events already queued
+//
+uint8_t queueAudioEvent(uint32_t time, const QueuedAudioEvent &event) {
+	auto lock = std::unique_lock<std::mutex>(audioQueueMutex);
+	if (audioQueue.size() >= AUDIO_QUEUE_MAX) {
+		debug_log("queueAudioEvent: queue full\n\r");
+		return 0;
+	}
+	auto sample = audioQueueClockBase + (uint64_t)time * audioMixer->sampleRate() / 1000;
+	audioQueue.emplace(sample, event);
+	if (audioTask) {
+		xTaskNotifyGive(audioTask);
+	}
+	return 1;
+}
+
+// Apply queued events that are due, returning how many milliseconds until the next one
+// Notes are handed to their channel a little ahead of time, and the mixer switches the channel over to them
+// on their exact sample, so the note they replace plays right up to it
+// A note isn't handed over while an earlier one on its channel is still waiting to start, as it would replace it,
+// so later events for that channel wait too, to stay in order
+// Called from the audio driver task
+//
+uint32_t processAudioQueue() {
+	auto lock = std::unique_lock<std::mutex>(audioQueueMutex);
+	if (audioQueue.empty()) {
+		return AUDIO_NO_DEADLINE;
+	}
+	auto clock = audioMixer->getSampleClock();
+	uint32_t rate = audioMixer->sampleRate();
+	uint64_t lookahead = AUDIO_QUEUE_LOOKAHEAD * rate / 1000;
+	uint32_t waitingChannels = 0;
+	uint32_t wait = AUDIO_NO_DEADLINE;
+	for (auto entry = audioQueue.begin(); entry != audioQueue.end(); ) {
+		auto time = entry->first;
+		auto &event = entry->second;
+		auto due = event.command == AUDIO_QUEUE_PLAY ? time - std::min(time, lookahead) : time;
+		if (due > clock) {
+			return std::min(wait, std::max<uint32_t>((due - clock) * 1000 / rate, 1));
+		}
+		if (channelEnabled(event.channel)) {
+			auto channel = audioChannels[event.channel];
+			auto mask = 1UL << event.channel;
+			if ((waitingChannels & mask) || (event.command == AUDIO_QUEUE_PLAY && channel->hasQueuedStart())) {
+				// check again once the earlier note has started
+				waitingChannels |= mask;
+				wait = 1;
+				++entry;
+				continue;
+			}
+			switch (event.command) {
+				case AUDIO_QUEUE_PLAY:
+					channel->queueNote(event.volume, event.frequency, event.duration, time);
+					break;
+				case AUDIO_QUEUE_VOLUME:
+					channel->setVolume(event.volume);
+					break;
+				case AUDIO_QUEUE_FREQUENCY:
+					channel->setFrequency(event.frequency);
+					break;
+			}
+		}
+		entry = audioQueue.erase(entry);
+	}
+	return wait;
+}
+
 #endif // AGON_AUDIO_H
@@ -0,0 +1,64 @@
+#ifndef AUDIO_ADPCM_H
+#define AUDIO_ADPCM_H
+
+#include <algorithm>
+#include <stdint.h>
+
+#include "agon.h"
+
+// IMA ADPCM decoding
+// Samples are held in blocks of AUDIO_ADPCM_BLOCK_SIZE bytes, laid out as in mono IMA ADPCM WAV files
+// Each block starts with a 4 byte header - the first sample as a 16-bit value, the step index, and a padding byte -
+// followed by 4-bit codes for the remaining samples, low nibble first
+// As every block carries its own decoder state, playback can start at the beginning of any block
+//
+
+const int16_t adpcmStepTable[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+const int8_t adpcmIndexTable[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// Number of samples held in a given number of bytes of ADPCM data
+inline uint32_t adpcmSampleCount(uint32_t bytes) {
+	auto samples = (bytes / AUDIO_ADPCM_BLOCK_SIZE) * AUDIO_ADPCM_SAMPLES_PER_BLOCK;
+	auto remainder = bytes % AUDIO_ADPCM_BLOCK_SIZE;
+	if (remainder >= 4) {
+		// a short final block
+		samples += 1 + (remainder - 4) * 2;
+	}
+	return samples;
+}
+
+// Start decoding a block, returning its first sample
+inline int adpcmStartBlock(const uint8_t * block, int & predictor, int & stepIndex) {
+	predictor = (int16_t)(block[0] | (block[1] << 8));
+	stepIndex = std::min<int>(block[2], 88);
+	return predictor;
+}
+
+// Decode the next 4-bit code, returning the new sample
+inline int adpcmDecode(uint8_t code, int & predictor, int & stepIndex) {
+	int step = adpcmStepTable[stepIndex];
+	int difference = step >> 3;
+	if (code & 4) difference += step;
+	if (code & 2) difference += step >> 1;
+	if (code & 1) difference += step >> 2;
+	predictor += (code & 8) ? -difference : difference;
+	predictor = std::max(-32768, std::min(32767, predictor));
+	stepIndex = std::max(0, std::min(88, stepIndex + adpcmIndexTable[code]));
+	return predictor;
+}
+
+#endif // AUDIO_ADPCM_H
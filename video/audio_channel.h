@@ -1,6 +1,7 @@
 #ifndef AUDIO_CHANNEL_H
 #define AUDIO_CHANNEL_H
 
+#include <algorithm>
 #include <memory>
 #include <unordered_map>
 #include <mutex>
@@ -10,8 +11,8 @@
 #include "types.h"
 #include "envelopes/types.h"
 
-extern fabgl::SoundGenerator *soundGenerator; 	// audio handling sub-system
-extern std::mutex soundGeneratorMutex;			// mutex for sound generator
+extern void scheduleAudioChannel(uint8_t channel);	// ask the audio driver to update a channel
+struct AudioSample;
 
 enum class AudioState : uint8_t {	// Audio channel state
 	Idle = 0,				// currently idle/silent
@@ -29,11 +30,15 @@ class AudioChannel {
 		AudioChannel(uint8_t channel);
 		~AudioChannel();
 		uint8_t		playNote(uint8_t volume, uint16_t frequency, int32_t duration);
+		uint8_t		queueNote(uint8_t volume, uint16_t frequency, int32_t duration, uint64_t startTime);
+		bool		hasQueuedStart();
 		uint8_t		getStatus();
 		uint8_t		setWaveform(int8_t waveformType, uint16_t sampleId = 0);
+		uint8_t		setSampleWaveform(std::shared_ptr<AudioSample> sample);
 		uint8_t		setVolume(uint8_t volume);
 		uint8_t		setFrequency(uint16_t frequency);
 		uint8_t		setDuration(int32_t duration);
+		uint8_t		noteOff();
 		uint8_t		setVolumeEnvelope(std::unique_ptr<VolumeEnvelope> envelope);
 		uint8_t		setFrequencyEnvelope(std::unique_ptr<FrequencyEnvelope> envelope);
 		uint8_t		setSampleRate(uint16_t sampleRate);
@@ -42,23 +47,29 @@ class AudioChannel {
 		void		attachSoundGenerator();
 		void		detachSoundGenerator();
 		uint8_t		seekTo(uint32_t position);
-		void		loop(uint64_t now);
+		uint32_t	loop(uint64_t now);
 		uint8_t		channel() { return _channel; }
 		void		goIdle();
 		std::unique_lock<std::mutex> lock() { return std::unique_lock<std::mutex>(_channelMutex); }
 	private:
 		uint8_t		_seekTo(uint32_t position);
 		void		_goIdle();
+		void		_setNote(uint8_t volume, uint16_t frequency, int32_t duration);
 		WaveformGenerator *getSampleWaveform(uint16_t sampleId, AudioChannel *channelRef);
+		uint8_t		_setWaveform(WaveformGenerator *newWaveform, int8_t waveformType);
 		uint8_t		_getVolume(uint32_t elapsed);
 		uint16_t	_getFrequency(uint32_t elapsed);
 		bool		_isReleasing(uint32_t elapsed);
 		bool		_isFinished(uint32_t elapsed);
+		uint32_t	_getNextChange(uint32_t elapsed);
 		uint8_t		_channel;
 		uint8_t		_volume;
 		uint16_t	_frequency;
 		int32_t		_duration;
 		uint64_t	_startTime;
+		uint32_t	_startDelay = 0;		// milliseconds after being picked up that a queued note starts
+		uint64_t	_queuedStart = 0;		// audio clock sample a queued note starts at
+		bool		_queued = false;		// the pending note is queued, so the mixer starts it at _queuedStart
 		uint8_t		_waveformType;
 		AudioState	_state;
 		std::unique_ptr<WaveformGenerator>	_waveform;
@@ -69,6 +80,8 @@ class AudioChannel {
 
 #include "audio_sample.h"
 #include "enhanced_samples_generator.h"
+#include "audio_mixer.h"
+extern AudioMixer *audioMixer;					// mixer for all audio channels
 extern std::unordered_map<uint16_t, std::shared_ptr<AudioSample>, std::hash<uint16_t>, std::equal_to<uint16_t>, psram_allocator<std::pair<const uint16_t, std::shared_ptr<AudioSample>>>> samples;
 
 AudioChannel::AudioChannel(uint8_t channel) : _waveform(nullptr), _channel(channel), _state(AudioState::Idle), _volume(64), _frequency(750), _duration(-1) {
@@ -99,11 +112,14 @@ void AudioChannel::_goIdle() {
 	if (this->_waveform) {
 		this->_waveform->enable(false);
 	}
+	// a queued note that hasn't started yet is abandoned too
+	audioMixer->cancelStart(channel());
 	this->_state = AudioState::Idle;
 }
 
 uint8_t AudioChannel::playNote(uint8_t volume, uint16_t frequency, int32_t duration) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	if (!this->_waveform) {
 		debug_log("AudioChannel: no waveform on channel %d\n\r", channel());
 		return 0;
@@ -115,22 +131,8 @@ uint8_t AudioChannel::playNote(uint8_t volume, uint16_t frequency, int32_t durat
 	switch (this->_state) {
 		case AudioState::Idle:
 		case AudioState::Release:
-			this->_volume = volume;
-			this->_frequency = frequency;
-			this->_duration = duration == 65535 ? -1 : duration;
-			if (this->_duration == 0 && this->_waveformType == AUDIO_WAVE_SAMPLE) {
-				// zero duration means play whole sample
-				// NB this can only work out sample duration based on sample provided
-				// so if sample data is streaming in an explicit length should be used instead
-				this->_duration = ((EnhancedSamplesGenerator *)&*_waveform)->getDuration(frequency);
-				if (this->_volumeEnvelope) {
-					// subtract the "release" time from the duration
-					this->_duration -= this->_volumeEnvelope->getRelease();
-				}
-				if (this->_duration < 0) {
-					this->_duration = 1;
-				}
-			}
+			_setNote(volume, frequency, duration);
+			this->_queued = false;
 			this->_state = AudioState::Pending;
 			debug_log("AudioChannel: playNote %d,%d,%d,%d\n\r", channel(), volume, frequency, this->_duration);
 			return 1;
@@ -138,6 +140,68 @@ uint8_t AudioChannel::playNote(uint8_t volume, uint16_t frequency, int32_t durat
 	return 0;
 }
 
+// Play a note queued to start at an exact sample of the audio clock, replacing whatever the channel is playing
+// The note being replaced carries on until then, as the mixer switches the generator over to the new note
+// on that sample, or stops at its own end if that is sooner
+// NB a note being replaced that has a volume envelope holds its current level until the switch
+//
+uint8_t AudioChannel::queueNote(uint8_t volume, uint16_t frequency, int32_t duration, uint64_t startTime) {
+	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
+	if (!this->_waveform) {
+		debug_log("AudioChannel: no waveform on channel %d\n\r", channel());
+		return 0;
+	}
+	auto clock = audioMixer->getSampleClock();
+	uint64_t rate = audioMixer->sampleRate();
+	if ((this->_state == AudioState::Playing || this->_state == AudioState::PlayLoop)
+		&& !this->_volumeEnvelope && this->_duration >= 0 && this->_waveform->enabled()) {
+		// the current note ends by itself, which may be before the queued note starts
+		uint64_t now = millis();
+		uint64_t end = this->_startTime + this->_duration;
+		auto stopTime = clock + (end > now ? (end - now) * rate / 1000 : 0);
+		if (stopTime < startTime) {
+			audioMixer->stopAt(channel(), stopTime);
+		}
+	}
+	_setNote(volume, frequency, duration);
+	this->_startDelay = startTime > clock ? (startTime - clock) * 1000 / rate : 0;
+	this->_queuedStart = startTime;
+	this->_queued = true;
+	this->_state = AudioState::Pending;
+	debug_log("AudioChannel: queueNote %d,%d,%d,%d\n\r", channel(), volume, frequency, this->_duration);
+	return 1;
+}
+
+// Whether a queued note is still waiting to start, so another queued note mustn't replace it yet
+bool AudioChannel::hasQueuedStart() {
+	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	return (this->_state == AudioState::Pending && this->_queued) || audioMixer->isHeld(channel());
+}
+
+// Set up the volume, frequency and duration of a new note
+// caller must hold channel lock
+void AudioChannel::_setNote(uint8_t volume, uint16_t frequency, int32_t duration) {
+	this->_volume = volume;
+	this->_frequency = frequency;
+	this->_duration = duration == 65535 ? -1 : duration;
+	if (this->_duration == 0 && this->_waveformType == AUDIO_WAVE_SAMPLE) {
+		// zero duration means play whole sample
+		// NB this can only work out sample duration based on sample provided
+		// streamed samples have no known length, so they play until stopped
+		this->_duration = ((EnhancedSamplesGenerator *)&*_waveform)->getDuration(frequency);
+		if (this->_duration >= 0) {
+			if (this->_volumeEnvelope) {
+				// subtract the "release" time from the duration
+				this->_duration -= this->_volumeEnvelope->getRelease();
+			}
+			if (this->_duration < 0) {
+				this->_duration = 1;
+			}
+		}
+	}
+}
+
 uint8_t AudioChannel::getStatus() {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
 	uint8_t status = 0;
@@ -191,6 +255,7 @@ WaveformGenerator *AudioChannel::getSampleWaveform(uint16_t sampleId, AudioChann
 
 uint8_t AudioChannel::setWaveform(int8_t waveformType, uint16_t sampleId) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	WaveformGenerator *newWaveform = nullptr;
 
 	switch (waveformType) {
@@ -231,6 +296,26 @@ uint8_t AudioChannel::setWaveform(int8_t waveformType, uint16_t sampleId) {
 			break;
 	}
 
+	return _setWaveform(newWaveform, waveformType);
+}
+
+// Play a sample that the caller has already looked up
+// Unlike setWaveform this doesn't touch the samples map, which belongs to the VDU task,
+// so it is safe to call from the audio driver task
+//
+uint8_t AudioChannel::setSampleWaveform(std::shared_ptr<AudioSample> sample) {
+	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
+	if (!sample) {
+		debug_log("AudioChannel: no sample for waveform on channel %d\n\r", channel());
+		return 0;
+	}
+	return _setWaveform(new EnhancedSamplesGenerator(sample), AUDIO_WAVE_SAMPLE);
+}
+
+// Replace our waveform generator, taking ownership of the new one
+// caller must hold channel lock
+uint8_t AudioChannel::_setWaveform(WaveformGenerator *newWaveform, int8_t waveformType) {
 	if (newWaveform != nullptr) {
 		debug_log("AudioChannel: setWaveform %d on channel %d\n\r", waveformType, channel());
 		if (this->_state != AudioState::Idle) {
@@ -254,6 +339,7 @@ uint8_t AudioChannel::setWaveform(int8_t waveformType, uint16_t sampleId) {
 
 uint8_t AudioChannel::setVolume(uint8_t volume) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	debug_log("AudioChannel: setVolume %d on channel %d\n\r", volume, channel());
 	if (volume == 255) {
 		return this->_volume;
@@ -276,7 +362,7 @@ uint8_t AudioChannel::setVolume(uint8_t volume) {
 				// we are looping, so an envelope may be active
 				if (volume == 0) {
 					// silence whilst looping always stops playback - curtail duration
-					this->_duration = millis() - this->_startTime;
+					this->_duration = std::max<int64_t>((int64_t)(millis() - this->_startTime), 0);
 					// if there's a volume envelope, just allow release to happen, otherwise...
 					if (!this->_volumeEnvelope) {
 						this->_volume = 0;
@@ -315,6 +401,7 @@ uint8_t AudioChannel::setVolume(uint8_t volume) {
 
 uint8_t AudioChannel::setFrequency(uint16_t frequency) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	debug_log("AudioChannel: setFrequency %d on channel %d\n\r", frequency, channel());
 	this->_frequency = frequency;
 
@@ -339,6 +426,7 @@ uint8_t AudioChannel::setFrequency(uint16_t frequency) {
 
 uint8_t AudioChannel::setDuration(int32_t duration) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	debug_log("AudioChannel: setDuration %d on channel %d\n\r", duration, channel());
 	if (duration == 0xFFFFFF) {
 		duration = -1;
@@ -363,8 +451,27 @@ uint8_t AudioChannel::setDuration(int32_t duration) {
 	return 0;
 }
 
+// Stop the current note, letting any volume envelope play its release phase
+uint8_t AudioChannel::noteOff() {
+	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
+	switch (this->_state) {
+		case AudioState::Pending:
+		case AudioState::Playing:
+			this->_goIdle();
+			return 1;
+		case AudioState::PlayLoop:
+			// curtail duration to now, so release starts once any attack and decay have completed
+			this->_duration = std::max<int64_t>((int64_t)(millis() - this->_startTime), 0);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
 uint8_t AudioChannel::setVolumeEnvelope(std::unique_ptr<VolumeEnvelope> envelope) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	this->_volumeEnvelope = std::move(envelope);
 	if (envelope && this->_state == AudioState::Playing) {
 		// swap to looping
@@ -376,6 +483,7 @@ uint8_t AudioChannel::setVolumeEnvelope(std::unique_ptr<VolumeEnvelope> envelope
 
 uint8_t AudioChannel::setFrequencyEnvelope(std::unique_ptr<FrequencyEnvelope> envelope) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
+	scheduleAudioChannel(channel());
 	this->_frequencyEnvelope = std::move(envelope);
 	if (envelope && this->_state == AudioState::Playing) {
 		// swap to looping
@@ -429,16 +537,14 @@ uint8_t AudioChannel::setParameter(uint8_t parameter, uint16_t value) {
 // caller must hold channel lock
 void AudioChannel::attachSoundGenerator() {
 	if (this->_waveform) {
-		auto lock = std::unique_lock<std::mutex>(soundGeneratorMutex);
-		soundGenerator->attach(&*_waveform);
+		audioMixer->attach(channel(), &*_waveform, this->_waveformType == AUDIO_WAVE_SAMPLE);
 	}
 }
 
 // caller must hold channel lock
 void AudioChannel::detachSoundGenerator() {
 	if (this->_waveform) {
-		auto lock = std::unique_lock<std::mutex>(soundGeneratorMutex);
-		soundGenerator->detach(&*_waveform);
+		audioMixer->detach(channel());
 	}
 	this->_state = AudioState::Idle;
 }
@@ -495,13 +601,39 @@ bool AudioChannel::_isFinished(uint32_t elapsed) {
 	return (elapsed >= this->_duration);
 }
 
-void AudioChannel::loop(uint64_t now) {
+// Milliseconds until the envelopes will next change our volume or frequency, or our state
+uint32_t AudioChannel::_getNextChange(uint32_t elapsed) {
+	uint32_t next = AUDIO_NO_DEADLINE;
+	if (this->_volumeEnvelope) {
+		next = this->_volumeEnvelope->getNextChange(elapsed, this->_duration);
+	} else if (this->_duration >= 0) {
+		next = elapsed < (uint32_t)this->_duration ? this->_duration - elapsed : 1;
+	}
+	if (this->_frequencyEnvelope) {
+		next = std::min(next, this->_frequencyEnvelope->getNextChange(elapsed, this->_duration));
+	}
+	return std::max<uint32_t>(next, 1);
+}
+
+// Update the channel, returning how many milliseconds until it next needs updating,
+// or AUDIO_NO_DEADLINE if it doesn't need updating again until a new command arrives
+//
+uint32_t AudioChannel::loop(uint64_t now) {
 	auto lock = std::unique_lock<std::mutex>(_channelMutex);
 
 	switch (this->_state) {
 		case AudioState::Pending:
 			debug_log("AudioChannel: play %d,%d,%d,%d\n\r", channel(), this->_volume, this->_frequency, this->_duration);
 			// we have a new note to play
+			if (this->_queued) {
+				// the mixer sets the generator going on the note's exact sample, so whatever is playing
+				// carries on until then
+				this->_queued = false;
+				this->_startTime = now + this->_startDelay;
+				audioMixer->startAt(channel(), this->_queuedStart, this->_getVolume(0), this->_getFrequency(0));
+				this->_state = (this->_volumeEnvelope || this->_frequencyEnvelope) ? AudioState::PlayLoop : AudioState::Playing;
+				return std::max<uint32_t>(this->_startDelay, 1);
+			}
 			this->_startTime = now;
 			// set our initial volume and frequency
 			this->_waveform->setVolume(this->_getVolume(0));
@@ -511,12 +643,17 @@ void AudioChannel::loop(uint64_t now) {
 			// if we have an envelope then we loop, otherwise just delay for duration
 			if (this->_volumeEnvelope || this->_frequencyEnvelope) {
 				this->_state = AudioState::PlayLoop;
-			} else {
-				this->_state = AudioState::Playing;
+				return AUDIO_ENVELOPE_INTERVAL;
 			}
-			break;
+			this->_state = AudioState::Playing;
+			// our duration may be indefinite, in which case there's nothing to wait for
+			return this->_duration >= 0 ? std::max<int32_t>(this->_duration, 1) : AUDIO_NO_DEADLINE;
 
 		case AudioState::Playing:
+			if (now < this->_startTime) {
+				// queued note that the mixer hasn't started yet
+				return this->_startTime - now;
+			}
 			if (this->_duration >= 0) {
 				// simple playback - delay until we have reached our duration
 				uint32_t elapsed = now - this->_startTime;
@@ -525,17 +662,19 @@ void AudioChannel::loop(uint64_t now) {
 					this->_waveform->enable(false);
 					//debug_log("AudioChannel: %d end\n\r", channel());
 					this->_state = AudioState::Idle;
-				} else {
-					//debug_log("AudioChannel: %d loop (%d)\n\r", channel(), this->_duration - elapsed);
+					return AUDIO_NO_DEADLINE;
 				}
-			} else {
-				// our duration is indefinite, so delay for a long time
-				//debug_log("AudioChannel: %d loop (indefinite playback)\n\r", channel());
+				return this->_duration - elapsed;
 			}
-			break;
+			// our duration is indefinite, so wait until we're told something has changed
+			return AUDIO_NO_DEADLINE;
 
 		// loop and release states used for envelopes
 		case AudioState::PlayLoop: {
+			if (now < this->_startTime) {
+				// queued note that the mixer hasn't started yet
+				return this->_startTime - now;
+			}
 			uint32_t elapsed = now - this->_startTime;
 			if (_isReleasing(elapsed)) {
 				debug_log("AudioChannel: releasing %d...\n\r", channel());
@@ -546,7 +685,7 @@ void AudioChannel::loop(uint64_t now) {
 				this->_waveform->setVolume(this->_getVolume(elapsed));
 			if (this->_frequencyEnvelope)
 				this->_waveform->setFrequency(this->_getFrequency(elapsed));
-			break;
+			return _getNextChange(elapsed);
 		}
 
 		case AudioState::Release: {
@@ -561,8 +700,9 @@ void AudioChannel::loop(uint64_t now) {
 				this->_waveform->enable(false);
 				debug_log("AudioChannel: end (released %d)\n\r", channel());
 				this->_state = AudioState::Idle;
+				return AUDIO_NO_DEADLINE;
 			}
-			break;
+			return _getNextChange(elapsed);
 		}
 
 		case AudioState::Abort:
@@ -574,6 +714,7 @@ void AudioChannel::loop(uint64_t now) {
 		case AudioState::Idle:
 			break;
 	}
+	return AUDIO_NO_DEADLINE;
 }
 
 #endif // AUDIO_CHANNEL_H
@@ -0,0 +1,197 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <fabgl.h>
+
+#include "agon.h"
+#include "enhanced_samples_generator.h"
+
+// Audio mixer
+// A single waveform generator attached to the sound generator, which renders each active channel
+// a block of samples at a time and mixes them together, rather than having the sound generator
+// call every channel's generator for every output sample
+//
+class AudioMixer : public WaveformGenerator {
+	public:
+		AudioMixer();
+
+		void setFrequency(int value) {}
+		void setSampleRate(int value);
+		int getSample();
+
+		void attach(uint8_t channel, WaveformGenerator * generator, bool isSample);
+		void detach(uint8_t channel);
+		void startAt(uint8_t channel, uint64_t time, int volume, int frequency);
+		void stopAt(uint8_t channel, uint64_t time);
+		void cancelStart(uint8_t channel);
+		bool isHeld(uint8_t channel);
+		uint64_t getSampleClock();
+	private:
+		struct MixerSource {
+			WaveformGenerator *	generator = nullptr;
+			bool				isSample = false;	// generator is an EnhancedSamplesGenerator, so can render blocks directly
+			bool				held = false;		// a queued note takes over the generator at startTime
+			uint64_t			startTime = 0;
+			int					startVolume = 0;	// volume and frequency the queued note starts with
+			int					startFrequency = 0;
+			bool				stopping = false;	// the note playing until then ends at stopTime
+			uint64_t			stopTime = 0;
+		};
+
+		MixerSource	sources[MAX_AUDIO_CHANNELS];
+		int32_t		mix[AUDIO_MIXER_BLOCK_SIZE];
+		int8_t		block[AUDIO_MIXER_BLOCK_SIZE];
+		int			blockPosition = AUDIO_MIXER_BLOCK_SIZE;
+		uint64_t	sampleClock = 0;		// samples rendered since the mixer was created, which is our audio clock
+		std::mutex	mixerMutex;
+
+		void renderBlock();
+		int renderSource(MixerSource & source, int from, int to);
+};
+
+AudioMixer::AudioMixer() {
+	// mixer output level is set by the sound generator's volume
+	setVolume(127);
+	enable(true);
+}
+
+void AudioMixer::setSampleRate(int value) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	WaveformGenerator::setSampleRate(value);
+	for (auto &source : sources) {
+		if (source.generator) {
+			source.generator->setSampleRate(value);
+		}
+	}
+}
+
+int AudioMixer::getSample() {
+	if (blockPosition >= AUDIO_MIXER_BLOCK_SIZE) {
+		renderBlock();
+		blockPosition = 0;
+	}
+	return block[blockPosition++];
+}
+
+void AudioMixer::attach(uint8_t channel, WaveformGenerator * generator, bool isSample) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	generator->setSampleRate(sampleRate());
+	sources[channel].generator = generator;
+	sources[channel].isSample = isSample;
+}
+
+// Once this returns the generator will no longer be used by the mixer, so can be deleted
+void AudioMixer::detach(uint8_t channel) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	sources[channel].generator = nullptr;
+	sources[channel].isSample = false;
+	sources[channel].held = false;
+	sources[channel].stopping = false;
+}
+
+// Start a queued note on a channel when the audio clock reaches the given sample, so it starts exactly on time
+// Whatever the channel is playing carries on until then, when the mixer restarts the generator for the new note
+void AudioMixer::startAt(uint8_t channel, uint64_t time, int volume, int frequency) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	auto &source = sources[channel];
+	source.held = true;
+	source.startTime = time;
+	source.startVolume = volume;
+	source.startFrequency = frequency;
+}
+
+// Stop the note a channel is playing at the given sample, for a note that ends before a queued note starts
+void AudioMixer::stopAt(uint8_t channel, uint64_t time) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	sources[channel].stopping = true;
+	sources[channel].stopTime = time;
+}
+
+// Forget any queued note start or stop on a channel, as its playback has been stopped
+void AudioMixer::cancelStart(uint8_t channel) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	sources[channel].held = false;
+	sources[channel].stopping = false;
+}
+
+// Whether a channel has a queued note that hasn't started yet
+bool AudioMixer::isHeld(uint8_t channel) {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	return sources[channel].held;
+}
+
+// Number of samples rendered so far
+uint64_t AudioMixer::getSampleClock() {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	return sampleClock;
+}
+
+// Render the next block of mixed output
+// Idle channels are skipped entirely, and the mix is scaled by the total volume of the active channels,
+// as the sound generator does when it mixes channels itself, before being saturated to 8 bits
+// A queued note takes over its channel's generator part way through the block if need be, with the note
+// it replaces playing up to that sample, or up to its own end if that is sooner
+//
+void AudioMixer::renderBlock() {
+	auto lock = std::unique_lock<std::mutex>(mixerMutex);
+	memset(mix, 0, sizeof(mix));
+	int totalVolume = 0;
+	for (auto &source : sources) {
+		auto generator = source.generator;
+		if (!generator) {
+			continue;
+		}
+		int start = AUDIO_MIXER_BLOCK_SIZE;
+		if (source.held && source.startTime < sampleClock + AUDIO_MIXER_BLOCK_SIZE) {
+			start = source.startTime > sampleClock ? source.startTime - sampleClock : 0;
+		}
+		int end = start;
+		if (source.stopping && source.stopTime < sampleClock + end) {
+			end = source.stopTime > sampleClock ? source.stopTime - sampleClock : 0;
+		}
+		int volume = renderSource(source, 0, end);
+		if (end < start) {
+			generator->enable(false);
+			source.stopping = false;
+		}
+		if (start < AUDIO_MIXER_BLOCK_SIZE) {
+			source.held = false;
+			source.stopping = false;
+			generator->setVolume(source.startVolume);
+			if (source.isSample) {
+				static_cast<EnhancedSamplesGenerator *>(generator)->seekTo(0);
+			}
+			generator->setFrequency(source.startFrequency);
+			generator->enable(true);
+			volume = std::max(volume, renderSource(source, start, AUDIO_MIXER_BLOCK_SIZE));
+		}
+		totalVolume += volume;
+	}
+	sampleClock += AUDIO_MIXER_BLOCK_SIZE;
+	int gain = totalVolume ? std::min(127, 127 * 127 / totalVolume) : 127;
+	for (int i = 0; i < AUDIO_MIXER_BLOCK_SIZE; i++) {
+		block[i] = std::max(-128, std::min(127, (int)(mix[i] * gain / 127)));
+	}
+}
+
+// Add part of a block from one source into the mix, returning the volume it played at, or 0 if it is silent
+int AudioMixer::renderSource(MixerSource & source, int from, int to) {
+	auto generator = source.generator;
+	if (from >= to || !generator->enabled()) {
+		return 0;
+	}
+	auto volume = generator->volume();
+	if (source.isSample) {
+		static_cast<EnhancedSamplesGenerator *>(generator)->renderBlock(mix + from, to - from);
+	} else {
+		for (int i = from; i < to && generator->enabled(); i++) {
+			mix[i] += generator->getSample();
+		}
+	}
+	return volume;
+}
+
+#endif // AUDIO_MIXER_H
@@ -1,17 +1,22 @@
 #ifndef AUDIO_SAMPLE_H
 #define AUDIO_SAMPLE_H
 
+#include <cstring>
 #include <memory>
 #include <unordered_map>
 
 #include "types.h"
 #include "buffers.h"
+#include "audio_adpcm.h"
 #include "audio_channel.h"
+#include "audio_stream.h"
 #include "buffer_stream.h"
 
 struct AudioSample {
 	AudioSample(BufferVector streams, uint8_t format, uint32_t sampleRate = AUDIO_DEFAULT_SAMPLE_RATE, uint16_t frequency = 0) :
-		blocks(streams), format(format), sampleRate(sampleRate), baseFrequency(frequency) {}
+		blocks(streams), format(format), sampleRate(sampleRate), baseFrequency(frequency) {
+		makeContiguous();
+	}
 	~AudioSample();
 
 	int8_t getSample(uint32_t & index, uint32_t & blockIndex);
@@ -20,13 +25,75 @@ struct AudioSample {
 
 	BufferVector	blocks;
 	uint8_t			format;				// Format of the sample data
+	const int8_t *	data = nullptr;		// Signed sample data, when the sample is held in a single block
+	const uint8_t *	adpcmData = nullptr;	// ADPCM blocks, for ADPCM samples
+	uint32_t		length = 0;			// Length of data, in samples
 	uint32_t		sampleRate;			// Sample rate of the sample
 	uint16_t		baseFrequency = 0;	// Base frequency of the sample
 	int32_t			repeatStart = 0;	// Start offset for repeat, in samples
 	int32_t			repeatLength = -1;	// Length of the repeat section in samples, -1 means to end of sample
+	std::shared_ptr<AudioStream>	stream;	// Ring buffer of streamed data, for samples that are played as they arrive
 	// std::unordered_map<uint8_t, std::weak_ptr<AudioChannel>> channels;	// Channels playing this sample
+
+	private:
+		void makeContiguous();
+		uint32_t getDataSize();
 };
 
+// Arrange for the sample to be held as signed data in a single block, so it can be played from a plain pointer
+// Signed single block samples are used as-is, otherwise the data is copied and converted,
+// as long as the sample isn't too large and memory is available
+// NB the copy is held alongside the original blocks, so signed and ADPCM samples created from buffers have their buffer
+// consolidated first, leaving only unsigned samples to be copied
+// Samples that cannot be made contiguous keep their original blocks, and are played block by block
+//
+void AudioSample::makeContiguous() {
+	if (format == AUDIO_FORMAT_ADPCM) {
+		// ADPCM is decoded as it plays, which needs the blocks held together whatever their size
+		// Its buffer is consolidated before the sample is created, so more than one block means there wasn't memory to do that
+		if (blocks.size() != 1) {
+			blocks.clear();
+			debug_log("AudioSample: not enough memory for ADPCM sample\n\r");
+			return;
+		}
+		auto block = blocks[0];
+		adpcmData = block->getBuffer();
+		length = adpcmSampleCount(block->size());
+		return;
+	}
+	if (blocks.size() == 1 && format != AUDIO_FORMAT_8BIT_UNSIGNED) {
+		data = (const int8_t *)blocks[0]->getBuffer();
+		length = blocks[0]->size();
+		return;
+	}
+	auto size = getDataSize();
+	if (size == 0 || size > AUDIO_SAMPLE_CONTIGUOUS_MAX) {
+		return;
+	}
+	auto block = make_shared_psram<BufferStream>(size);
+	if (!block || !block->getBuffer()) {
+		debug_log("AudioSample: not enough memory to make sample contiguous\n\r");
+		return;
+	}
+	auto destination = block->getBuffer();
+	for (auto &source : blocks) {
+		if (format == AUDIO_FORMAT_8BIT_UNSIGNED) {
+			auto sourceData = source->getBuffer();
+			for (uint32_t i = 0; i < source->size(); i++) {
+				destination[i] = sourceData[i] - 128;
+			}
+		} else {
+			memcpy(destination, source->getBuffer(), source->size());
+		}
+		destination += source->size();
+	}
+	blocks.clear();
+	blocks.push_back(block);
+	format = AUDIO_FORMAT_8BIT_SIGNED;
+	data = (const int8_t *)block->getBuffer();
+	length = size;
+}
+
 AudioSample::~AudioSample() {
 	// iterate over channels
 	// for (auto &channelPair : this->channels) {
@@ -86,11 +153,19 @@ void AudioSample::seekTo(uint32_t position, uint32_t & index, uint32_t & blockIn
 }
 
 uint32_t AudioSample::getSize() {
-	uint32_t samples = 0;
+	if (format == AUDIO_FORMAT_ADPCM) {
+		return length;
+	}
+	return getDataSize();
+}
+
+// Size of the sample data, in bytes
+uint32_t AudioSample::getDataSize() {
+	uint32_t size = 0;
 	for (auto block : blocks) {
-		samples += block->size();
+		size += block->size();
 	}
-	return samples;
+	return size;
 }
 
 #endif // AUDIO_SAMPLE_H
@@ -0,0 +1,306 @@
+#ifndef AUDIO_SEQUENCER_H
+#define AUDIO_SEQUENCER_H
+
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "agon.h"
+#include "audio_channel.h"
+#include "audio_sample.h"
+#include "buffer_stream.h"
+#include "envelopes/adsr.h"
+#include "types.h"
+
+extern AudioChannel *audioChannels[MAX_AUDIO_CHANNELS];
+extern TaskHandle_t audioTask;
+
+// Pattern sequencer
+// Plays a tracker style song held in buffers from inside the audio driver task,
+// so notes are timed to the millisecond without any traffic from the host
+//
+// A song is made up of:
+//   instruments - AUDIO_SEQUENCER_INSTRUMENT_SIZE bytes each:
+//     waveform (as for AUDIO_CMD_WAVEFORM), sample buffer ID (word, for AUDIO_WAVE_SAMPLE),
+//     envelope type (AUDIO_ENVELOPE_NONE or AUDIO_ENVELOPE_ADSR), attack (word), decay (word), sustain, release (word)
+//   patterns - each a number of rows, with a cell per track on each row, of AUDIO_SEQUENCER_CELL_SIZE bytes:
+//     note (0 for none, 1-127 for a MIDI note number, or AUDIO_SEQUENCER_NOTE_OFF),
+//     instrument (0 to leave unchanged, otherwise instrument number plus one),
+//     volume (0-127, or AUDIO_SEQUENCER_NO_VOLUME)
+//   order list - a byte per entry, giving the pattern to play, looping back to the start at the end
+// Track n plays on channel firstChannel + n
+// Instrument samples are looked up when the song is loaded, as the samples map may only be used from the VDU task,
+// so a song must be loaded again to pick up a replaced sample
+//
+class AudioSequencer {
+	public:
+		AudioSequencer();
+
+		uint8_t load(uint8_t firstChannel, uint8_t tracks, uint8_t rows, uint16_t rowLength,
+			std::shared_ptr<BufferStream> instruments, std::shared_ptr<BufferStream> patterns, std::shared_ptr<BufferStream> order);
+		uint8_t start();
+		uint8_t stop();
+		uint8_t setRowLength(uint16_t rowLength);
+		uint8_t jump(uint16_t position, uint8_t row);
+
+		uint32_t loop(uint32_t now);
+	private:
+		std::mutex		sequencerMutex;
+		std::shared_ptr<BufferStream>	instruments;
+		std::shared_ptr<BufferStream>	patterns;
+		std::shared_ptr<BufferStream>	order;
+		std::vector<std::shared_ptr<AudioSample>>	instrumentSamples;	// sample for each instrument, or nullptr
+		uint8_t			firstChannel = 0;
+		uint8_t			tracks = 0;
+		uint8_t			rows = 0;
+		uint16_t		rowLength = AUDIO_SEQUENCER_ROW_LENGTH;
+		uint16_t		position = 0;				// position in the order list
+		uint8_t			row = 0;					// row within the current pattern
+		bool			playing = false;
+		bool			starting = false;			// start at the next loop call
+		uint32_t		nextRow = 0;				// time the next row is due
+		uint8_t			trackInstrument[MAX_AUDIO_CHANNELS];	// instrument number plus one, or zero for none
+		uint8_t			trackVolume[MAX_AUDIO_CHANNELS];
+		uint16_t		noteFrequencies[128];
+
+		void playRow();
+		void setInstrument(AudioChannel * channel, uint8_t instrument);
+		void silence();
+		inline void wake() {
+			if (audioTask) {
+				xTaskNotifyGive(audioTask);
+			}
+		}
+};
+
+AudioSequencer::AudioSequencer() {
+	// equal temperament, with note 69 being A above middle C
+	for (int note = 0; note < 128; note++) {
+		noteFrequencies[note] = (uint16_t)lroundf(440.0f * powf(2.0f, (note - 69) / 12.0f));
+	}
+}
+
+// Load a song, stopping any song that's playing
+//
+uint8_t AudioSequencer::load(uint8_t firstChannel, uint8_t tracks, uint8_t rows, uint16_t rowLength,
+	std::shared_ptr<BufferStream> instruments, std::shared_ptr<BufferStream> patterns, std::shared_ptr<BufferStream> order)
+{
+	if (tracks == 0 || rows == 0 || firstChannel + tracks > MAX_AUDIO_CHANNELS) {
+		debug_log("AudioSequencer: invalid layout, %d tracks of %d rows from channel %d\n\r", tracks, rows, firstChannel);
+		return 0;
+	}
+	uint32_t patternSize = rows * tracks * AUDIO_SEQUENCER_CELL_SIZE;
+	if (!patterns || patterns->size() == 0 || patterns->size() % patternSize != 0) {
+		debug_log("AudioSequencer: pattern data is not a whole number of patterns\n\r");
+		return 0;
+	}
+	if (instruments && instruments->size() % AUDIO_SEQUENCER_INSTRUMENT_SIZE != 0) {
+		debug_log("AudioSequencer: instrument data is not a whole number of instruments\n\r");
+		return 0;
+	}
+	if (!order || order->size() == 0) {
+		debug_log("AudioSequencer: order list is empty\n\r");
+		return 0;
+	}
+	auto patternCount = patterns->size() / patternSize;
+	for (uint32_t n = 0; n < order->size(); n++) {
+		if (order->getBuffer()[n] >= patternCount) {
+			debug_log("AudioSequencer: order list entry %d refers to missing pattern %d\n\r", n, order->getBuffer()[n]);
+			return 0;
+		}
+	}
+
+	// resolve instrument samples here on the VDU task, so playback never needs the samples map
+	std::vector<std::shared_ptr<AudioSample>> instrumentSamples;
+	auto instrumentCount = instruments ? instruments->size() / AUDIO_SEQUENCER_INSTRUMENT_SIZE : 0;
+	for (uint32_t instrument = 0; instrument < instrumentCount; instrument++) {
+		auto data = instruments->getBuffer() + instrument * AUDIO_SEQUENCER_INSTRUMENT_SIZE;
+		auto waveform = (int8_t)data[0];
+		std::shared_ptr<AudioSample> sample = nullptr;
+		if (waveform == AUDIO_WAVE_SAMPLE || waveform < 0) {
+			// negative waveforms are sample numbers, as for AUDIO_CMD_WAVEFORM
+			uint16_t sampleId = waveform < 0 ? BUFFERED_SAMPLE_BASEID + (-waveform - 1) : data[1] | (data[2] << 8);
+			auto sampleIter = samples.find(sampleId);
+			if (sampleIter == samples.end() || !sampleIter->second) {
+				debug_log("AudioSequencer: sample %d for instrument %d not found\n\r", sampleId, instrument);
+			} else {
+				sample = sampleIter->second;
+			}
+		}
+		instrumentSamples.push_back(sample);
+	}
+
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	silence();
+	this->firstChannel = firstChannel;
+	this->tracks = tracks;
+	this->rows = rows;
+	this->rowLength = rowLength ? rowLength : AUDIO_SEQUENCER_ROW_LENGTH;
+	this->instruments = instruments;
+	this->patterns = patterns;
+	this->order = order;
+	this->instrumentSamples = std::move(instrumentSamples);
+	position = 0;
+	row = 0;
+	for (int track = 0; track < MAX_AUDIO_CHANNELS; track++) {
+		trackInstrument[track] = 0;
+		trackVolume[track] = 127;
+	}
+	debug_log("AudioSequencer: loaded %d patterns, %d order entries\n\r", patternCount, order->size());
+	return 1;
+}
+
+uint8_t AudioSequencer::start() {
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	if (!patterns) {
+		return 0;
+	}
+	playing = true;
+	starting = true;
+	wake();
+	return 1;
+}
+
+uint8_t AudioSequencer::stop() {
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	silence();
+	return 1;
+}
+
+uint8_t AudioSequencer::setRowLength(uint16_t rowLength) {
+	if (rowLength == 0) {
+		return 0;
+	}
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	this->rowLength = rowLength;
+	return 1;
+}
+
+uint8_t AudioSequencer::jump(uint16_t position, uint8_t row) {
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	if (!order || position >= order->size() || row >= rows) {
+		return 0;
+	}
+	this->position = position;
+	this->row = row;
+	if (playing) {
+		// play the new row straight away
+		starting = true;
+		wake();
+	}
+	return 1;
+}
+
+// Play any row that is due, returning how many milliseconds until the next one
+// Called from the audio driver task
+//
+uint32_t AudioSequencer::loop(uint32_t now) {
+	auto lock = std::unique_lock<std::mutex>(sequencerMutex);
+	if (!playing) {
+		return AUDIO_NO_DEADLINE;
+	}
+	if (starting) {
+		starting = false;
+		nextRow = now;
+	}
+	if ((int32_t)(now - nextRow) >= 0) {
+		playRow();
+		if (++row >= rows) {
+			row = 0;
+			if (++position >= order->size()) {
+				position = 0;
+			}
+		}
+		// rows are timed from when the previous one was due, so timing doesn't drift,
+		// unless we've fallen so far behind that we'd need to play rows back to back
+		nextRow += rowLength;
+		if ((int32_t)(now - nextRow) >= 0) {
+			nextRow = now + rowLength;
+		}
+	}
+	return nextRow - now;
+}
+
+// Apply the current row's cells to each track's channel
+//
+void AudioSequencer::playRow() {
+	uint32_t patternSize = rows * tracks * AUDIO_SEQUENCER_CELL_SIZE;
+	auto pattern = order->getBuffer()[position];
+	if ((pattern + 1) * patternSize > patterns->size()) {
+		// song buffers are shared, so the order list may have been changed since it was loaded
+		debug_log("AudioSequencer: pattern %d not found\n\r", pattern);
+		return;
+	}
+	auto cell = patterns->getBuffer() + pattern * patternSize + row * tracks * AUDIO_SEQUENCER_CELL_SIZE;
+	for (int track = 0; track < tracks; track++, cell += AUDIO_SEQUENCER_CELL_SIZE) {
+		auto channel = audioChannels[firstChannel + track];
+		if (!channel) {
+			continue;
+		}
+		auto note = cell[0];
+		auto instrument = cell[1];
+		auto volume = cell[2];
+		if (instrument && instrument != trackInstrument[track]) {
+			trackInstrument[track] = instrument;
+			setInstrument(channel, instrument - 1);
+		}
+		if (volume != AUDIO_SEQUENCER_NO_VOLUME) {
+			trackVolume[track] = volume;
+			if (!note) {
+				channel->setVolume(volume);
+			}
+		}
+		if (note == AUDIO_SEQUENCER_NOTE_OFF) {
+			channel->noteOff();
+		} else if (note) {
+			// retrigger, cutting off any note that's still playing
+			channel->goIdle();
+			channel->playNote(trackVolume[track], noteFrequencies[note & 0x7F], 65535);
+		}
+	}
+}
+
+// Set up a channel's waveform and envelopes from an instrument definition
+//
+void AudioSequencer::setInstrument(AudioChannel * channel, uint8_t instrument) {
+	if (!instruments || (uint32_t)(instrument + 1) * AUDIO_SEQUENCER_INSTRUMENT_SIZE > instruments->size()) {
+		debug_log("AudioSequencer: instrument %d not found\n\r", instrument);
+		return;
+	}
+	auto data = instruments->getBuffer() + instrument * AUDIO_SEQUENCER_INSTRUMENT_SIZE;
+	auto word = [data](int offset) -> uint16_t {
+		return data[offset] | (data[offset + 1] << 8);
+	};
+	auto waveform = (int8_t)data[0];
+	if (waveform == AUDIO_WAVE_SAMPLE || waveform < 0) {
+		// use the sample looked up when the song was loaded, as the samples map belongs to the VDU task
+		channel->setSampleWaveform(instrument < instrumentSamples.size() ? instrumentSamples[instrument] : nullptr);
+	} else {
+		channel->setWaveform(waveform);
+	}
+	if (data[3] == AUDIO_ENVELOPE_ADSR) {
+		channel->setVolumeEnvelope(make_unique_psram<ADSRVolumeEnvelope>(word(4), word(6), data[8], word(9)));
+	} else {
+		channel->setVolumeEnvelope(nullptr);
+	}
+	channel->setFrequencyEnvelope(nullptr);
+}
+
+// Stop playback, cutting off all tracks
+// Caller must hold the sequencer lock
+//
+void AudioSequencer::silence() {
+	if (playing) {
+		for (int track = 0; track < tracks; track++) {
+			auto channel = audioChannels[firstChannel + track];
+			if (channel) {
+				channel->goIdle();
+			}
+		}
+	}
+	playing = false;
+	starting = false;
+}
+
+#endif // AUDIO_SEQUENCER_H
@@ -0,0 +1,102 @@
+#ifndef AUDIO_STREAM_H
+#define AUDIO_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "agon.h"
+#include "buffer_stream.h"
+#include "types.h"
+
+std::atomic<bool> audioStreamsNeedReport(false);	// a stream has status to report to the host
+
+// Streaming sample data
+// A ring buffer that the VDU task fills with sample data as a channel plays it
+// There is only ever one writer and one reader, each owning its own position in the ring,
+// so only the level of data in the ring is shared, and no lock is needed
+//
+class AudioStream {
+	public:
+		AudioStream(std::shared_ptr<BufferStream> ring, uint32_t lowWater) :
+			ring(ring), data((int8_t *)ring->getBuffer()), capacity(ring->size()),
+			lowWater(lowWater ? std::min(lowWater, capacity) : capacity / 2) {}
+
+		// Number of samples waiting to be played
+		inline uint32_t getLevel() {
+			return level.load();
+		}
+		inline uint32_t getFree() {
+			return capacity - getLevel();
+		}
+
+		uint32_t write(const uint8_t * source, uint32_t length, bool isUnsigned);
+		int8_t read();
+		uint8_t takeStatus();
+
+	private:
+		std::shared_ptr<BufferStream>	ring;
+		int8_t *				data;
+		uint32_t				capacity;
+		uint32_t				lowWater;				// report to the host when the level falls below this
+		uint32_t				writePosition = 0;		// owned by the writer
+		uint32_t				readPosition = 0;		// owned by the reader
+		std::atomic<uint32_t>	level { 0 };			// samples written and not yet read
+		std::atomic<uint8_t>	status { 0 };			// AUDIO_STREAM_* flags waiting to be reported
+		std::atomic<bool>		lowWaterArmed { true };	// cleared once low water is reported, until the stream is refilled
+		bool					starved = false;		// reader has run out of data, and underrun has been reported
+};
+
+// Add data to the stream, dropping anything that doesn't fit, and returning how much was accepted
+// Called from the VDU task only
+//
+uint32_t AudioStream::write(const uint8_t * source, uint32_t length, bool isUnsigned) {
+	auto count = std::min(length, getFree());
+	if (count < length) {
+		debug_log("AudioStream: overrun, dropped %d samples\n\r", length - count);
+		status.fetch_or(AUDIO_STREAM_OVERRUN);
+		audioStreamsNeedReport = true;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		data[writePosition] = isUnsigned ? source[i] - 128 : source[i];
+		if (++writePosition == capacity) {
+			writePosition = 0;
+		}
+	}
+	if (level.fetch_add(count) + count >= lowWater) {
+		lowWaterArmed = true;
+	}
+	return count;
+}
+
+// Get the next sample, or silence if the host hasn't kept up
+// Called from the audio mixer only
+//
+int8_t AudioStream::read() {
+	if (level.load() == 0) {
+		if (!starved) {
+			starved = true;
+			status.fetch_or(AUDIO_STREAM_UNDERRUN);
+			audioStreamsNeedReport = true;
+		}
+		return 0;
+	}
+	starved = false;
+	auto sample = data[readPosition];
+	if (++readPosition == capacity) {
+		readPosition = 0;
+	}
+	if (level.fetch_sub(1) - 1 < lowWater && lowWaterArmed) {
+		lowWaterArmed = false;
+		status.fetch_or(AUDIO_STREAM_LOW_WATER);
+		audioStreamsNeedReport = true;
+	}
+	return sample;
+}
+
+// Collect any status flags waiting to be reported to the host
+uint8_t AudioStream::takeStatus() {
+	return status.exchange(0);
+}
+
+#endif // AUDIO_STREAM_H
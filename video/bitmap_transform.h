@@ -0,0 +1,308 @@
+#ifndef BITMAP_TRANSFORM_H
+#define BITMAP_TRANSFORM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <fabgl.h>
+
+#include "types.h"
+
+// Bitmap transformation helpers
+//
+
+// Opaque span encoding for bitmaps with transparency
+// Each row is a list of alternating skip and copy counts, ending when the row's pixels are used up
+// Spans are recomputed when they are next used after the bitmap's data generation changes
+struct BitmapSpans {
+	Bitmap *				bitmap;			// Bitmap the spans were computed for
+	uint32_t				generation;		// Data generation of the bitmap's pixels when computed
+	std::vector<uint16_t, psram_allocator<uint16_t>>	rowStart;	// Index of each row's runs, plus end marker
+	std::vector<uint16_t, psram_allocator<uint16_t>>	runs;
+	uint16_t				firstRow;		// Range of rows with opaque pixels
+	uint16_t				lastRow;
+	std::unique_ptr<Bitmap>	trimmed;		// View of only the rows with opaque pixels, if smaller
+};
+
+// Check whether a row of a bitmap with spans has no opaque pixels
+static inline bool isSpanRowEmpty(const BitmapSpans * spans, int32_t y) {
+	return spans->rowStart[y] == spans->rowStart[y + 1];
+}
+
+// Integer division rounding down or up, for any sign of divisor
+static inline int64_t floorDiv(int64_t a, int64_t b) {
+	int64_t q = a / b;
+	if ((a % b != 0) && ((a < 0) != (b < 0))) {
+		q--;
+	}
+	return q;
+}
+
+static inline int64_t ceilDiv(int64_t a, int64_t b) {
+	int64_t q = a / b;
+	if ((a % b != 0) && ((a < 0) == (b < 0))) {
+		q++;
+	}
+	return q;
+}
+
+// Clip a run of destination pixels against one source axis
+// Source coordinate for destination pixel x is (start + step * x) in 16.16 fixed point,
+// and is inside the source if its whole part is in the range 0 to limit - 1
+// Narrows first and last to the destination pixels that are inside the source
+//
+static inline void clipAffineSpan(int64_t start, int64_t step, int32_t limit, int32_t &first, int32_t &last) {
+	int64_t max = ((int64_t)limit << 16) - 1;
+	int64_t lo, hi;
+	if (step == 0) {
+		if (start >= 0 && start <= max) {
+			return;
+		}
+		lo = 1;
+		hi = 0;
+	} else if (step > 0) {
+		lo = ceilDiv(-start, step);
+		hi = floorDiv(max - start, step);
+	} else {
+		lo = ceilDiv(max - start, step);
+		hi = floorDiv(-start, step);
+	}
+	first = std::max<int64_t>(first, lo);
+	last = std::min<int64_t>(last, hi);
+}
+
+// Render a bitmap through an inverse 2d affine transform into an RGBA2222 destination
+// inverse is a 3x3 matrix mapping destination coordinates (offset by xOffset, yOffset) to source coordinates
+// Each destination row is clipped to the pixels that map inside the source bitmap,
+// and then walked using 16.16 fixed point steps, so no per-pixel matrix multiplication or bounds checks are needed
+// Pixels that fall outside of the source are transparent
+// If spans are given, rows that only sample one fully transparent source row are cleared without sampling
+//
+void transformBitmapAffine(Bitmap * bitmap, const float * inverse, RGBA2222 * destination, int width, int height, int xOffset, int yOffset, const BitmapSpans * spans = nullptr) {
+	const int32_t srcWidth = bitmap->width;
+	const int32_t srcHeight = bitmap->height;
+	const int64_t stepX = llround((double)inverse[0] * 65536.0);
+	const int64_t stepY = llround((double)inverse[3] * 65536.0);
+	const bool direct = bitmap->format == PixelFormat::RGBA2222;
+	auto source = (const RGBA2222 *)bitmap->data;
+
+	for (int y = 0; y < height; y++) {
+		auto row = destination + y * width;
+		double rowX = xOffset;
+		double rowY = y + yOffset;
+		int64_t startX = llround((inverse[0] * rowX + inverse[1] * rowY + inverse[2]) * 65536.0);
+		int64_t startY = llround((inverse[3] * rowX + inverse[4] * rowY + inverse[5]) * 65536.0);
+
+		int32_t first = 0;
+		int32_t last = width - 1;
+		clipAffineSpan(startX, stepX, srcWidth, first, last);
+		clipAffineSpan(startY, stepY, srcHeight, first, last);
+		if (first > last) {
+			memset(row, 0, width);
+			continue;
+		}
+		memset(row, 0, first);
+		memset(row + last + 1, 0, width - 1 - last);
+
+		// positions inside the clipped span are always within the source, so are never negative
+		uint32_t fx = startX + stepX * first;
+		uint32_t fy = startY + stepY * first;
+		const uint32_t dx = stepX;
+		const uint32_t dy = stepY;
+		if (spans && dy == 0 && isSpanRowEmpty(spans, fy >> 16)) {
+			memset(row + first, 0, last - first + 1);
+			continue;
+		}
+		if (direct) {
+			for (int x = first; x <= last; x++) {
+				row[x] = source[(fy >> 16) * srcWidth + (fx >> 16)];
+				fx += dx;
+				fy += dy;
+			}
+		} else {
+			for (int x = first; x <= last; x++) {
+				row[x] = bitmap->getPixel2222(fx >> 16, fy >> 16);
+				fx += dx;
+				fy += dy;
+			}
+		}
+	}
+}
+
+// Describes one axis of an orthogonal transform
+// The source coordinate for destination coordinate d is floor((d + base) / scale), where scale is a non-zero integer,
+// and d is along the destination x axis unless swapped is set
+struct OrthogonalAxis {
+	int32_t		base;
+	int32_t		scale;
+	bool		swapped;
+};
+
+// Get the integer nearest to a matrix value, if the value is close enough to be treated as exact
+static inline bool nearInteger(float value, int32_t &result) {
+	auto rounded = roundf(value);
+	if (fabsf(value - rounded) > 0.0001f || fabsf(rounded) > 65535.0f) {
+		return false;
+	}
+	result = (int32_t)rounded;
+	return true;
+}
+
+// Check whether a forward 2d transform is orthogonal, i.e. only flips, quarter turns, integer scales and integer translations
+// If so fill in the axis descriptions for the source x and y axes
+//
+bool getOrthogonalTransform(const float * transform, OrthogonalAxis &xAxis, OrthogonalAxis &yAxis) {
+	int32_t m[6];
+	for (int i = 0; i < 6; i++) {
+		if (!nearInteger(transform[i], m[i])) {
+			return false;
+		}
+	}
+	if (transform[6] != 0.0f || transform[7] != 0.0f || transform[8] != 1.0f) {
+		return false;
+	}
+	if (m[0] != 0 && m[4] != 0 && m[1] == 0 && m[3] == 0) {
+		// x' = m0 * x + m2, y' = m4 * y + m5
+		xAxis = { -m[2], m[0], false };
+		yAxis = { -m[5], m[4], false };
+		return true;
+	}
+	if (m[1] != 0 && m[3] != 0 && m[0] == 0 && m[4] == 0) {
+		// x' = m1 * y + m2, y' = m3 * x + m5
+		xAxis = { -m[5], m[3], true };
+		yAxis = { -m[2], m[1], true };
+		return true;
+	}
+	return false;
+}
+
+// Work out the destination range that maps inside 0 to limit - 1 for an axis, narrowing first and last
+static inline void clipOrthogonalSpan(const OrthogonalAxis &axis, int32_t limit, int32_t &first, int32_t &last) {
+	int32_t lo, hi;
+	if (axis.scale > 0) {
+		lo = -axis.base;
+		hi = limit * axis.scale - axis.base - 1;
+	} else {
+		lo = limit * axis.scale - axis.base + 1;
+		hi = -axis.base;
+	}
+	first = std::max(first, lo);
+	last = std::min(last, hi);
+}
+
+// Render an RGBA2222 bitmap through an orthogonal transform, using integer index remapping only
+// Runs of destination pixels are copied directly when the source is unscaled and unflipped,
+// and destination rows that map to the same source line as the previous row are copied whole
+// If spans are given and source rows are not swapped, fully transparent source rows are cleared,
+// and unscaled rows copy only their opaque runs, leaving the rest of the row clear
+//
+void transformBitmapOrthogonal(Bitmap * bitmap, const OrthogonalAxis &xAxis, const OrthogonalAxis &yAxis, RGBA2222 * destination, int width, int height, int xOffset, int yOffset, const BitmapSpans * spans = nullptr) {
+	const int32_t srcWidth = bitmap->width;
+	const int32_t srcHeight = bitmap->height;
+	auto source = (const RGBA2222 *)bitmap->data;
+	// axis walked along a destination row, and the axis that is fixed for a row
+	const bool swapped = xAxis.swapped;
+	const auto &rowAxis = swapped ? yAxis : xAxis;
+	const auto &lineAxis = swapped ? xAxis : yAxis;
+	const int32_t rowLimit = swapped ? srcHeight : srcWidth;
+	const int32_t lineLimit = swapped ? srcWidth : srcHeight;
+	const int32_t rowStride = swapped ? srcWidth : 1;
+	const int32_t lineStride = swapped ? 1 : srcWidth;
+	// spans describe source rows, so only help when a destination row walks along one
+	const BitmapSpans * lineSpans = swapped ? nullptr : spans;
+
+	// the destination run within a row is the same for every row
+	int32_t rowLo = std::numeric_limits<int32_t>::min();
+	int32_t rowHi = std::numeric_limits<int32_t>::max();
+	clipOrthogonalSpan(rowAxis, rowLimit, rowLo, rowHi);
+	int32_t firstX = std::max<int64_t>(0, (int64_t)rowLo - xOffset);
+	int32_t lastX = std::min<int64_t>(width - 1, (int64_t)rowHi - xOffset);
+	int32_t lineLo = std::numeric_limits<int32_t>::min();
+	int32_t lineHi = std::numeric_limits<int32_t>::max();
+	clipOrthogonalSpan(lineAxis, lineLimit, lineLo, lineHi);
+
+	// source position and sub-step counter at the start of the run
+	const int32_t rowScale = abs(rowAxis.scale);
+	const int32_t rowStep = (rowAxis.scale > 0) ? rowStride : -rowStride;
+	int32_t startIndex = 0;
+	int32_t startCount = 0;
+	if (firstX <= lastX) {
+		int64_t position = (int64_t)firstX + xOffset + rowAxis.base;
+		int64_t coord = floorDiv(position, rowAxis.scale);
+		// count of destination pixels remaining before the source coordinate changes
+		startCount = (rowAxis.scale > 0) ? (int32_t)(rowScale - (position - coord * rowAxis.scale)) : (int32_t)(coord * rowAxis.scale - position + 1);
+		startIndex = coord * rowStride;
+	}
+
+	int64_t previousLine = -1;
+	for (int y = 0; y < height; y++) {
+		auto row = destination + y * width;
+		int64_t linePosition = (int64_t)y + yOffset;
+		if (firstX > lastX || linePosition < lineLo || linePosition > lineHi) {
+			memset(row, 0, width);
+			previousLine = -1;
+			continue;
+		}
+		int64_t line = floorDiv(linePosition + lineAxis.base, lineAxis.scale);
+		if (line == previousLine) {
+			memcpy(row, row - width, width);
+			continue;
+		}
+		previousLine = line;
+
+		if (lineSpans && isSpanRowEmpty(lineSpans, line)) {
+			memset(row, 0, width);
+			continue;
+		}
+		memset(row, 0, firstX);
+		memset(row + lastX + 1, 0, width - 1 - lastX);
+		auto src = source + line * lineStride + startIndex;
+		if (rowScale == 1 && rowStep == 1) {
+			if (!lineSpans) {
+				memcpy(row + firstX, src, lastX - firstX + 1);
+				continue;
+			}
+			// destination x maps to source x + origin
+			const int32_t origin = xOffset + rowAxis.base;
+			memset(row + firstX, 0, lastX - firstX + 1);
+			int32_t sx = 0;
+			for (auto run = lineSpans->rowStart[line]; run < lineSpans->rowStart[line + 1]; run += 2) {
+				sx += lineSpans->runs[run];
+				int32_t first = std::max<int32_t>(sx - origin, firstX);
+				int32_t last = std::min<int32_t>(sx + lineSpans->runs[run + 1] - 1 - origin, lastX);
+				sx += lineSpans->runs[run + 1];
+				if (first <= last) {
+					memcpy(row + first, source + line * lineStride + first + origin, last - first + 1);
+				}
+			}
+			continue;
+		}
+		int32_t count = startCount;
+		for (int x = firstX; x <= lastX; x++) {
+			row[x] = *src;
+			if (--count == 0) {
+				src += rowStep;
+				count = rowScale;
+			}
+		}
+	}
+}
+
+// Render a bitmap through a 2d transform into an RGBA2222 destination,
+// using an orthogonal kernel when possible, and the general affine sampler otherwise
+// Spans let the kernels skip transparent source pixels, which are then written as zero rather than copied,
+// so should only be given when the exact bytes of transparent pixels do not matter
+//
+void transformBitmap(Bitmap * bitmap, const float * transform, const float * inverse, RGBA2222 * destination, int width, int height, int xOffset, int yOffset, const BitmapSpans * spans = nullptr) {
+	OrthogonalAxis xAxis, yAxis;
+	if (bitmap->format == PixelFormat::RGBA2222 && getOrthogonalTransform(transform, xAxis, yAxis)) {
+		transformBitmapOrthogonal(bitmap, xAxis, yAxis, destination, width, height, xOffset, yOffset, spans);
+		return;
+	}
+	transformBitmapAffine(bitmap, inverse, destination, width, height, xOffset, yOffset, spans);
+}
+
+#endif // BITMAP_TRANSFORM_H
@@ -9,12 +9,52 @@
 
 #include "agon.h"
 #include "buffer_stream.h"
+#include "compression.h"
 #include "span.h"
 #include "types.h"
 
 using BufferVector = std::vector<std::shared_ptr<BufferStream>, psram_allocator<std::shared_ptr<BufferStream>>>;
 std::unordered_map<uint16_t, BufferVector, std::hash<uint16_t>, std::equal_to<uint16_t>, psram_allocator<std::pair<const uint16_t, BufferVector>>> buffers;
 std::unordered_map<uint16_t, std::unordered_set<uint16_t>> callbackBuffers;
+uint32_t bufferGeneration = 0;		// Incremented whenever blocks are added to or removed from buffers
+uint32_t bufferChangeCount = 0;		// Incremented on every buffer change, so each change has its own generation
+uint32_t bufferDataGenerationBase = 0;	// Generation of buffers with no change recorded since all buffers changed
+std::unordered_map<uint16_t, uint32_t> bufferDataGenerations;	// Generation of each buffer's last change
+
+// Note that a buffer's blocks or contents may have changed
+// A buffer ID of 65535 means all buffers
+inline void bufferDataChanged(uint16_t bufferId) {
+	bufferChangeCount++;
+	if (bufferId == 65535) {
+		bufferDataGenerations.clear();
+		bufferDataGenerationBase = bufferChangeCount;
+		return;
+	}
+	bufferDataGenerations[bufferId] = bufferChangeCount;
+}
+
+// Note that blocks have been added to or removed from a buffer, or all buffers for 65535
+inline void bufferBlocksChanged(uint16_t bufferId) {
+	bufferGeneration++;
+	bufferDataChanged(bufferId);
+}
+
+// Get a buffer's data generation, which changes whenever its blocks or contents may have changed
+inline uint32_t getBufferDataGeneration(uint16_t bufferId) {
+	auto generation = bufferDataGenerations.find(bufferId);
+	return generation == bufferDataGenerations.end() ? bufferDataGenerationBase : generation->second;
+}
+
+// Decompression state for compressed writes that are still in progress
+struct StreamingDecompression {
+	CompressionFileHeader			header;
+	uint8_t							headerCount = 0;
+	std::shared_ptr<BufferStream>	bufferStream;	// Destination for the decompressed data
+	uint8_t *						output = nullptr;	// Output pointer used by the TurboVega decoder
+	DecompressionData				turbo;
+	LzDecompressionData				lz;
+};
+std::unordered_map<uint16_t, std::shared_ptr<StreamingDecompression>> pendingDecompressions;
 
 struct AdvancedOffset {
 	uint32_t blockOffset = 0;
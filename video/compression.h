@@ -25,6 +25,7 @@ extern void debug_log(const char * format, ...);		// Debug log function
 #define COMPRESSION_WINDOW_SIZE 256     // power of 2
 #define COMPRESSION_STRING_SIZE 16      // power of 2
 #define COMPRESSION_TYPE_TURBO  'T'     // TurboVega-style compression
+#define COMPRESSION_TYPE_LZ     'L'     // Byte-aligned LZ compression
 #define TEMP_BUFFER_SIZE        256
 
 #define COMPRESSION_OUTPUT_CHUNK_SIZE	1024 // used to extend temporary buffer
@@ -305,4 +306,328 @@ void agon_decompress_byte(DecompressionData* dd, uint8_t comp_byte) {
     }
 }
 
+// Byte-aligned LZ compression (type 'L')
+//
+// The data is split into blocks of up to COMPRESSION_LZ_BLOCK_SIZE original bytes.
+// Each block starts with a 16-bit little-endian header:
+//   bit 15     1 = stored (uncompressed) block, 0 = compressed block
+//   bits 0-14  number of payload bytes that follow
+//
+// A compressed block payload is a sequence of LZ4-style sequences:
+//   token      high nibble = literal count, low nibble = match length - 4
+//              (a nibble of 15 means further length bytes follow, each adding
+//              to the count, until a byte other than 255 is read)
+//   literals   the literal bytes, copied as-is
+//   offset     16-bit little-endian distance back into the output (1..65535)
+//   [length]   extra match length bytes, as above
+// The final sequence of a block may stop after its literals, as the block
+// payload length tells the decoder where the block ends.
+// Matches may refer back into earlier blocks, so the window is 64KB.
+//
+// Blocks that don't compress are stored, so worst case the output is only
+// 2 bytes per block larger than the input.
+
+#define COMPRESSION_LZ_BLOCK_SIZE   16384   // maximum original bytes per block
+#define COMPRESSION_LZ_WINDOW_SIZE  65535   // maximum match offset
+#define COMPRESSION_LZ_MIN_MATCH    4       // minimum match length
+#define COMPRESSION_LZ_HASH_BITS    12      // compressor hash table size (in bits)
+#define COMPRESSION_LZ_STORED       0x8000  // block header flag for a stored block
+
+enum LzDecompressionState : uint8_t {
+    LZ_STATE_BLOCK_HEADER = 0,
+    LZ_STATE_BLOCK_HEADER_HIGH,
+    LZ_STATE_STORED,
+    LZ_STATE_TOKEN,
+    LZ_STATE_LITERAL_LENGTH,
+    LZ_STATE_LITERALS,
+    LZ_STATE_OFFSET,
+    LZ_STATE_OFFSET_HIGH,
+    LZ_STATE_MATCH_LENGTH,
+    LZ_STATE_ERROR,
+};
+
+typedef struct {
+    uint8_t*            output;
+    uint32_t            orig_size;
+    uint32_t            input_count;
+    uint32_t            output_count;
+    uint32_t            block_remaining;
+    uint32_t            length;
+    uint32_t            offset;
+    uint8_t             token;
+    uint8_t             state;
+} LzDecompressionData;
+
+// Worst case size of LZ compressed output (excluding the file header)
+//
+uint32_t agon_lz_compress_bound(uint32_t size) {
+    return size + ((size + COMPRESSION_LZ_BLOCK_SIZE - 1) / COMPRESSION_LZ_BLOCK_SIZE) * 2;
+}
+
+static inline uint32_t agon_lz_hash(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761u) >> (32 - COMPRESSION_LZ_HASH_BITS);
+}
+
+static inline uint8_t* agon_lz_write_length(uint8_t* out, const uint8_t* limit, uint32_t length) {
+    while (length >= 255) {
+        if (out >= limit) return nullptr;
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out >= limit) return nullptr;
+    *out++ = (uint8_t) length;
+    return out;
+}
+
+// Write a sequence of literals, followed by a match if matchLength is non-zero
+// Returns nullptr if the sequence would not fit before limit
+//
+static uint8_t* agon_lz_write_sequence(uint8_t* out, const uint8_t* limit, const uint8_t* literals, uint32_t literalLength, uint32_t offset, uint32_t matchLength) {
+    if (out >= limit) return nullptr;
+    uint32_t matchCode = matchLength ? matchLength - COMPRESSION_LZ_MIN_MATCH : 0;
+    uint8_t* token = out++;
+    *token = ((literalLength >= 15 ? 15 : literalLength) << 4) | (matchCode >= 15 ? 15 : matchCode);
+    if (literalLength >= 15) {
+        out = agon_lz_write_length(out, limit, literalLength - 15);
+        if (!out) return nullptr;
+    }
+    if ((uint32_t)(limit - out) < literalLength) return nullptr;
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength) {
+        if (limit - out < 2) return nullptr;
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        if (matchCode >= 15) {
+            out = agon_lz_write_length(out, limit, matchCode - 15);
+        }
+    }
+    return out;
+}
+
+// Compress size bytes from src into dst, which must hold agon_lz_compress_bound(size) bytes
+// Returns the number of bytes written, or 0 on failure
+//
+uint32_t agon_lz_compress(const uint8_t* src, uint32_t size, uint8_t* dst) {
+    auto table = (uint32_t*) heap_caps_calloc(1 << COMPRESSION_LZ_HASH_BITS, sizeof(uint32_t), MALLOC_CAP_8BIT);
+    if (!table) {
+        debug_log("agon_lz_compress: cannot allocate hash table\n\r");
+        return 0;
+    }
+
+    uint8_t* out = dst;
+    for (uint32_t blockStart = 0; blockStart < size; blockStart += COMPRESSION_LZ_BLOCK_SIZE) {
+        uint32_t blockLength = size - blockStart;
+        if (blockLength > COMPRESSION_LZ_BLOCK_SIZE) {
+            blockLength = COMPRESSION_LZ_BLOCK_SIZE;
+        }
+        uint32_t blockEnd = blockStart + blockLength;
+        uint8_t* header = out;
+        uint8_t* payload = out + 2;
+        // compressed payload must be smaller than the original to be worth keeping
+        const uint8_t* limit = payload + blockLength - 1;
+        uint8_t* p = payload;
+        uint32_t anchor = blockStart;
+        uint32_t pos = blockStart;
+
+        while (p && pos + COMPRESSION_LZ_MIN_MATCH <= blockEnd) {
+            auto hash = agon_lz_hash(src + pos);
+            uint32_t candidate = table[hash];      // position + 1, or 0 if unused
+            table[hash] = pos + 1;
+            if (candidate && (pos - (candidate - 1)) <= COMPRESSION_LZ_WINDOW_SIZE &&
+                memcmp(src + candidate - 1, src + pos, COMPRESSION_LZ_MIN_MATCH) == 0) {
+                uint32_t matchStart = candidate - 1;
+                uint32_t matchLength = COMPRESSION_LZ_MIN_MATCH;
+                while (pos + matchLength < blockEnd && src[matchStart + matchLength] == src[pos + matchLength]) {
+                    matchLength++;
+                }
+                p = agon_lz_write_sequence(p, limit, src + anchor, pos - anchor, pos - matchStart, matchLength);
+                pos += matchLength;
+                anchor = pos;
+            } else {
+                pos++;
+            }
+        }
+        if (p && anchor < blockEnd) {
+            p = agon_lz_write_sequence(p, limit, src + anchor, blockEnd - anchor, 0, 0);
+        }
+
+        uint32_t blockHeader;
+        if (p) {
+            blockHeader = p - payload;
+            out = p;
+        } else {
+            // incompressible, so store the block
+            memcpy(payload, src + blockStart, blockLength);
+            blockHeader = COMPRESSION_LZ_STORED | blockLength;
+            out = payload + blockLength;
+        }
+        header[0] = blockHeader & 0xFF;
+        header[1] = blockHeader >> 8;
+    }
+
+    heap_caps_free(table);
+    return out - dst;
+}
+
+void agon_init_lz_decompression(LzDecompressionData* dd, uint8_t* output, uint32_t orig_size) {
+    memset(dd, 0, sizeof(LzDecompressionData));
+    dd->output = output;
+    dd->orig_size = orig_size;
+    dd->state = LZ_STATE_BLOCK_HEADER;
+}
+
+static inline bool agon_lz_copy_match(LzDecompressionData* dd) {
+    auto length = dd->length + COMPRESSION_LZ_MIN_MATCH;
+    if (length > dd->orig_size - dd->output_count) {
+        debug_log("Decompression overflow\n\r");
+        return false;
+    }
+    auto dest = dd->output + dd->output_count;
+    auto source = dest - dd->offset;
+    if (dd->offset >= length) {
+        memcpy(dest, source, length);
+    } else {
+        // overlapping match repeats the last offset bytes
+        for (uint32_t i = 0; i < length; i++) {
+            dest[i] = source[i];
+        }
+    }
+    dd->output_count += length;
+    dd->state = dd->block_remaining ? LZ_STATE_TOKEN : LZ_STATE_BLOCK_HEADER;
+    return true;
+}
+
+static inline void agon_lz_end_literals(LzDecompressionData* dd) {
+    dd->state = dd->block_remaining ? LZ_STATE_OFFSET : LZ_STATE_BLOCK_HEADER;
+}
+
+// Decompress a chunk of LZ compressed data
+// Chunks may be split at any byte, so data can be fed in as it arrives
+// Returns false if the data is corrupt or would overflow the output
+//
+bool agon_lz_decompress(LzDecompressionData* dd, const uint8_t* src, uint32_t len) {
+    dd->input_count += len;
+    while (len) {
+        switch (dd->state) {
+            case LZ_STATE_BLOCK_HEADER: {
+                dd->block_remaining = *src++;
+                len--;
+                dd->state = LZ_STATE_BLOCK_HEADER_HIGH;
+            } break;
+            case LZ_STATE_BLOCK_HEADER_HIGH: {
+                dd->block_remaining |= (*src++) << 8;
+                len--;
+                if (dd->block_remaining & COMPRESSION_LZ_STORED) {
+                    dd->block_remaining &= ~COMPRESSION_LZ_STORED;
+                    dd->state = LZ_STATE_STORED;
+                } else {
+                    dd->state = LZ_STATE_TOKEN;
+                }
+                if (dd->block_remaining == 0) {
+                    dd->state = LZ_STATE_ERROR;
+                }
+            } break;
+            case LZ_STATE_STORED:
+            case LZ_STATE_LITERALS: {
+                uint32_t remaining = dd->state == LZ_STATE_STORED ? dd->block_remaining : dd->length;
+                uint32_t count = len < remaining ? len : remaining;
+                if (count > dd->orig_size - dd->output_count) {
+                    debug_log("Decompression overflow\n\r");
+                    dd->state = LZ_STATE_ERROR;
+                    break;
+                }
+                memcpy(dd->output + dd->output_count, src, count);
+                dd->output_count += count;
+                dd->block_remaining -= count;
+                src += count;
+                len -= count;
+                if (dd->state == LZ_STATE_STORED) {
+                    if (dd->block_remaining == 0) {
+                        dd->state = LZ_STATE_BLOCK_HEADER;
+                    }
+                } else {
+                    dd->length -= count;
+                    if (dd->length == 0) {
+                        agon_lz_end_literals(dd);
+                    }
+                }
+            } break;
+            case LZ_STATE_TOKEN: {
+                dd->token = *src++;
+                len--;
+                dd->block_remaining--;
+                dd->length = dd->token >> 4;
+                if (dd->length == 15) {
+                    dd->state = LZ_STATE_LITERAL_LENGTH;
+                } else if (dd->length > dd->block_remaining) {
+                    dd->state = LZ_STATE_ERROR;
+                } else if (dd->length) {
+                    dd->state = LZ_STATE_LITERALS;
+                } else {
+                    agon_lz_end_literals(dd);
+                }
+            } break;
+            case LZ_STATE_LITERAL_LENGTH: {
+                uint8_t value = *src++;
+                len--;
+                if (dd->block_remaining-- == 0) {
+                    dd->state = LZ_STATE_ERROR;
+                    break;
+                }
+                dd->length += value;
+                if (value != 255) {
+                    dd->state = dd->length > dd->block_remaining ? LZ_STATE_ERROR : LZ_STATE_LITERALS;
+                }
+            } break;
+            case LZ_STATE_OFFSET: {
+                dd->offset = *src++;
+                len--;
+                dd->block_remaining--;
+                dd->state = dd->block_remaining ? LZ_STATE_OFFSET_HIGH : LZ_STATE_ERROR;
+            } break;
+            case LZ_STATE_OFFSET_HIGH: {
+                dd->offset |= (*src++) << 8;
+                len--;
+                dd->block_remaining--;
+                if (dd->offset == 0 || dd->offset > dd->output_count) {
+                    dd->state = LZ_STATE_ERROR;
+                    break;
+                }
+                dd->length = dd->token & 0x0F;
+                if (dd->length == 15) {
+                    dd->state = LZ_STATE_MATCH_LENGTH;
+                } else if (!agon_lz_copy_match(dd)) {
+                    dd->state = LZ_STATE_ERROR;
+                }
+            } break;
+            case LZ_STATE_MATCH_LENGTH: {
+                uint8_t value = *src++;
+                len--;
+                if (dd->block_remaining-- == 0) {
+                    dd->state = LZ_STATE_ERROR;
+                    break;
+                }
+                dd->length += value;
+                if (value != 255 && !agon_lz_copy_match(dd)) {
+                    dd->state = LZ_STATE_ERROR;
+                }
+            } break;
+            default: {
+                debug_log("Decompression error: invalid data\n\r");
+                return false;
+            }
+        }
+    }
+    return dd->state != LZ_STATE_ERROR;
+}
+
+// Check that an LZ decompression finished cleanly with all of the original data
+//
+bool agon_lz_decompression_complete(LzDecompressionData* dd) {
+    return dd->state == LZ_STATE_BLOCK_HEADER && dd->output_count == dd->orig_size;
+}
+
 #endif // COMPRESSION_H
@@ -11,6 +11,7 @@
 #include <fabgl.h>
 
 #include "agon.h"
+#include "render_target.h"
 #include "sprites.h"
 
 extern bool isVDPVariableSet(uint16_t flag);
@@ -108,6 +109,7 @@ class Context {
 		uint8_t			lineThickness = 1;				// Line thickness
 		uint16_t		currentBitmap = BUFFERED_BITMAP_BASEID;	// Current bitmap ID
 		uint16_t		bitmapTransform = -1;			// Bitmap transform buffer ID
+		std::shared_ptr<RenderTarget>	renderTarget;	// Bitmap that graphics are drawn into, if not the screen
 		fabgl::LinePattern	linePattern = fabgl::LinePattern();				// Dotted line pattern
 		uint8_t			linePatternLength = 8;			// Dotted line pattern length
 		std::vector<uint16_t>	charToBitmap = std::vector<uint16_t>(256, 65535);	// character to bitmap mapping
@@ -315,6 +317,14 @@ class Context {
 		inline uint16_t getCurrentBitmapId() {
 			return currentBitmap;
 		}
+		inline void setRenderTarget(std::shared_ptr<RenderTarget> target) {
+			renderTarget = target;
+			plottingText = false;
+			pathPoints.clear();
+		}
+		inline uint16_t getRenderTargetId() {
+			return renderTarget ? renderTarget->getBitmapId() : 65535;
+		}
 
 		void setLineThickness(uint8_t thickness);
 		void setDottedLinePattern(uint8_t pattern[8]);
@@ -431,6 +441,7 @@ Context::Context(const Context &c) {
 	gbgc = c.gbgc;
 	lineThickness = c.lineThickness;
 	currentBitmap = c.currentBitmap;
+	renderTarget = c.renderTarget;
 	linePattern.setPattern(c.linePattern.pattern);
 	linePatternLength = c.linePatternLength;
 
@@ -922,6 +933,11 @@ bool Context::readVariable(uint16_t var, uint16_t * value) {
 				*value = bitmapTransform;
 			}
 			break;
+		case 0x403:	// Render target bitmap ID (65535 when drawing to the screen)
+			if (value) {
+				*value = getRenderTargetId();
+			}
+			break;
 
 		case 0x410:	// Current sprite ID
 			if (value) {
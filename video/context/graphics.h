@@ -37,6 +37,15 @@ fabgl::PaintOptions Context::getPaintOptions(fabgl::PaintMode mode, fabgl::Paint
 //
 void Context::setGraphicsOptions(uint8_t mode) {
 	auto colourMode = mode & 0x03;
+	if (renderTarget) {
+		renderTarget->setClippingRect(graphicsViewport);
+		switch (colourMode) {
+			case 1: renderTarget->setPaint(gfg, gpofg.mode); break;
+			case 2: renderTarget->setPaint(gfg, fabgl::PaintMode::Invert); break;
+			case 3: renderTarget->setPaint(gbg, gpobg.mode); break;
+		}
+		return;
+	}
 	setClippingRect(graphicsViewport);
 	switch (colourMode) {
 		case 0: break;	// move command
@@ -131,6 +140,10 @@ void Context::moveTo() {
 // Line plot
 //
 void Context::plotLine(bool omitFirstPoint, bool omitLastPoint, bool usePattern, bool resetPattern) {
+	if (renderTarget) {
+		renderTarget->drawLine(p2.X, p2.Y, p1.X, p1.Y, omitFirstPoint, omitLastPoint);
+		return;
+	}
 	if (!textCursorActive()) {
 		// if we're in graphics mode, we need to move the cursor to the last point
 		// TODO think about this - why do we _not_ do this when the text cursor is active??
@@ -152,6 +165,10 @@ void Context::plotLine(bool omitFirstPoint, bool omitLastPoint, bool usePattern,
 // Point point
 //
 void Context::plotPoint() {
+	if (renderTarget) {
+		renderTarget->setPixel(p1.X, p1.Y);
+		return;
+	}
 	canvas->setPixel(p1.X, p1.Y);
 }
 
@@ -189,12 +206,20 @@ void Context::plotTriangle() {
 	// if (gpo.mode == fabgl::PaintMode::Set) {
 	// 	canvas->drawPath(p, 3);
 	// }
+	if (renderTarget) {
+		renderTarget->fillPolygon(p, 3);
+		return;
+	}
 	canvas->fillPath(p, 3);
 }
 
 // Rectangle plot
 //
 void Context::plotRectangle() {
+	if (renderTarget) {
+		renderTarget->fillRectangle(p2.X, p2.Y, p1.X, p1.Y);
+		return;
+	}
 	canvas->fillRectangle(p2.X, p2.Y, p1.X, p1.Y);
 }
 
@@ -210,6 +235,10 @@ void Context::plotParallelogram() {
 	// if (gpo.mode == fabgl::PaintMode::Set) {
 	// 	canvas->drawPath(p, 4);
 	// }
+	if (renderTarget) {
+		renderTarget->fillPolygon(p, 4);
+		return;
+	}
 	canvas->fillPath(p, 4);
 }
 
@@ -217,6 +246,10 @@ void Context::plotParallelogram() {
 //
 void Context::plotCircle(bool filled) {
 	auto size = 2 * sqrt(rp1.X * rp1.X + (rp1.Y * rp1.Y * (rectangularPixels ? 4 : 1)));
+	if (renderTarget) {
+		renderTarget->drawEllipse(p2.X, p2.Y, size, rectangularPixels ? size / 2 : size, filled);
+		return;
+	}
 	if (filled) {
 		canvas->fillEllipse(p2.X, p2.Y, size, rectangularPixels ? size / 2 : size);
 	} else {
@@ -625,6 +658,22 @@ Rect Context::getGraphicsRect() {
 }
 
 
+// Check whether a plot operation can be drawn into a render target bitmap
+//
+inline bool renderTargetSupports(uint8_t operation) {
+	switch (operation) {
+		case 0x50:	// triangle fill
+		case 0x60:	// rectangle fill
+		case 0x70:	// parallelogram fill
+		case 0x90:	// circle outline
+		case 0x98:	// circle fill
+		case 0xE8:	// bitmap plot
+			return true;
+	}
+	// lines and points
+	return operation <= 0x40;
+}
+
 // Plot command handler
 //
 bool IRAM_ATTR Context::plot(int16_t x, int16_t y, uint8_t command) {
@@ -649,6 +698,12 @@ bool IRAM_ATTR Context::plot(int16_t x, int16_t y, uint8_t command) {
 
 	setGraphicsOptions(mode);
 
+	if ((mode & 0x03) && renderTarget && !renderTargetSupports(operation)) {
+		debug_log("vdu_plot: operation %X not supported when drawing to a bitmap\n\r", operation);
+		lastPlotCommand = command;
+		return pending;
+	}
+
 	// if (mode != 0 && mode != 4) {
 	if (mode & 0x03) {
 		switch (operation) {
@@ -770,7 +825,10 @@ void Context::plotPending(int16_t peeked) {
 //
 void Context::plotString(const std::string& s) {
 	if (!ttxtMode && !plottingText) {
-		if (textCursorActive()) {
+		if (renderTarget && !textCursorActive()) {
+			renderTarget->setClippingRect(graphicsViewport);
+			renderTarget->setPaint(gfg, gpofg.mode);
+		} else if (textCursorActive()) {
 			setClippingRect(textViewport);
 			canvas->setPenColor(tfg);
 			canvas->setBrushColor(tbg);
@@ -794,7 +852,13 @@ void Context::plotString(const std::string& s) {
 			ttxt_instance.draw_char(activeCursor->X, activeCursor->Y, c);
 		} else {
 			auto bitmap = getBitmapFromChar(c);
-			if (bitmap) {
+			if (renderTarget && !textCursorActive()) {
+				if (bitmap) {
+					renderTarget->drawBitmap(activeCursor->X, activeCursor->Y + font->height - bitmap->height, bitmap.get());
+				} else {
+					renderTarget->drawChar(activeCursor->X, activeCursor->Y, font, c);
+				}
+			} else if (bitmap) {
 				canvas->drawBitmap(activeCursor->X, activeCursor->Y + font->height - bitmap->height, bitmap.get());
 			} else {
 				canvas->drawChar(activeCursor->X, activeCursor->Y, c);
@@ -838,6 +902,12 @@ void Context::drawBitmap(uint16_t x, uint16_t y, bool compensateHeight, bool for
 			canvas->setPaintOptions(options);
 		}
 		auto yPos = (compensateHeight && logicalCoords) ? (y + 1 - bitmap->height) : y;
+		auto spans = getBitmapSpans(currentBitmap, bitmap.get());
+		if (renderTarget) {
+			// transforms are not applied when drawing into a bitmap
+			renderTarget->drawBitmap(x, yPos, bitmap.get(), spans);
+			return;
+		}
 		if (bitmapTransform != 65535) {
 			auto transformBufferIter = buffers.find(bitmapTransform);
 			if (transformBufferIter != buffers.end()) {
@@ -854,11 +924,29 @@ void Context::drawBitmap(uint16_t x, uint16_t y, bool compensateHeight, bool for
 				// which would mean they could not be cached
 
 				// we should have a valid transform buffer now, which includes an inverse chunk
-				canvas->drawTransformedBitmap(x, yPos, bitmap.get(), (float *)transformBuffer[0]->getBuffer(), (float *)transformBuffer[1]->getBuffer());
+				auto transform = (float *)transformBuffer[0]->getBuffer();
+				auto inverse = (float *)transformBuffer[1]->getBuffer();
+				// use a cached rendering if we can, so repeated draws are a plain blit
+				auto transformed = getTransformedBitmap(currentBitmap, bitmap, bitmapTransform, transform, inverse);
+				if (transformed) {
+					canvas->drawBitmap(x + transformed->xOffset, yPos + transformed->yOffset, transformed->bitmap.get());
+					return;
+				}
+				canvas->drawTransformedBitmap(x, yPos, bitmap.get(), transform, inverse);
 				return;
 			}
 			// if buffer not found, we should fall back to normal drawing
 		}
+		if (spans) {
+			// skip transparent rows at the top and bottom, or the whole bitmap if it has no opaque pixels
+			if (spans->firstRow > spans->lastRow) {
+				return;
+			}
+			if (spans->trimmed) {
+				canvas->drawBitmap(x, yPos + spans->firstRow, spans->trimmed.get());
+				return;
+			}
+		}
 		canvas->drawBitmap(x, yPos, bitmap.get());
 	} else {
 		debug_log("drawBitmap: bitmap %d not found\n\r", currentBitmap);
@@ -894,7 +982,11 @@ void Context::cls() {
 // Clear the graphics area
 //
 void Context::clg() {
-	if (canvas) {
+	if (renderTarget) {
+		// clearing a bitmap makes it transparent
+		renderTarget->clear(graphicsViewport);
+		plottingText = false;
+	} else if (canvas) {
 		canvas->setPenColor(gfg);
 		canvas->setBrushColor(gbg);
 		canvas->setPaintOptions(gpobg);
@@ -1,11 +1,13 @@
 #ifndef ENHANCED_SAMPLES_GENERATOR_H
 #define ENHANCED_SAMPLES_GENERATOR_H
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <unordered_map>
 #include <fabgl.h>
 
+#include "audio_adpcm.h"
 #include "audio_sample.h"
 #include "types.h"
 
@@ -18,12 +20,21 @@ class EnhancedSamplesGenerator : public WaveformGenerator {
 		void setFrequency(int value);
 		void setSampleRate(int value);
 		int getSample();
+		void renderBlock(int32_t * mix, int count);
 
 		int getDuration(uint16_t frequency);
 
 		void seekTo(uint32_t position);
 	private:
 		std::shared_ptr<AudioSample> _sample;
+		const int8_t *	sampleData;		// Contiguous sample data, or nullptr if the sample is held in multiple blocks
+		uint32_t	sampleLength;		// Length of contiguous sample data
+		AudioStream *	sampleStream;	// Streamed sample data, or nullptr if the sample is held in memory
+		const uint8_t *	adpcmData;		// ADPCM sample data, or nullptr if the sample isn't ADPCM
+		const uint8_t *	adpcmBlock = nullptr;	// ADPCM block being decoded
+		uint32_t	adpcmOffset = 0;	// Position of the next sample within its ADPCM block
+		int			adpcmPredictor = 0;	// ADPCM decoder state
+		int			adpcmStepIndex = 0;
 
 		uint32_t	index;				// Current index inside the current sample block
 		uint32_t	blockIndex;			// Current index into the sample data blocks
@@ -34,25 +45,52 @@ class EnhancedSamplesGenerator : public WaveformGenerator {
 		int			frequency;
 		int			previousSample;
 		int			currentSample;
-		double		samplesPerGet;
-		double		fractionalSampleOffset;
+		uint32_t	stepWhole;			// Whole source samples to advance per output sample
+		uint32_t	stepFraction;		// Fractional source samples to advance per output sample, in units of 1/2^32
+		uint32_t	phase;				// Position between previousSample and currentSample, in units of 1/2^32
+		int32_t		pendingSamples;		// Whole part of the playback position, which is the number of source samples to read
+										// before the next output sample, or -1 just after looping
+		int			stepBaseFrequency;	// Sample base frequency the phase step was calculated for
+		struct PhaseStep {
+			int			frequency;
+			int			baseFrequency;
+			uint32_t	whole;
+			uint32_t	fraction;
+		}			phaseSteps[AUDIO_PHASE_STEP_CACHE_SIZE];	// Phase steps already calculated, indexed by frequency
+		int			volumeLevel;		// Volume that volumeMultiplier was calculated for
+		int32_t		volumeMultiplier;	// Volume / 127 in 16.16 fixed point
 
 		double calculateSamplerate(uint16_t frequency);
+		void calculatePhaseStep(uint16_t frequency);
+		int8_t readSample();
+		int8_t readAdpcmSample();
 		int8_t getNextSample();
 };
 
 EnhancedSamplesGenerator::EnhancedSamplesGenerator(std::shared_ptr<AudioSample> sample)
-	: _sample(sample), repeatCount(0), index(0), blockIndex(0), frequency(0), previousSample(0), currentSample(0), samplesPerGet(1.0), fractionalSampleOffset(0.0)
-{}
+	: _sample(sample), sampleData(sample->data), sampleLength(sample->length), sampleStream(sample->stream.get()), adpcmData(sample->adpcmData), repeatCount(0), index(0), blockIndex(0), frequency(0), previousSample(0), currentSample(0), stepWhole(1), stepFraction(0), phase(0), pendingSamples(0), stepBaseFrequency(-1), volumeLevel(-1), volumeMultiplier(0)
+{
+	for (auto & step : phaseSteps) {
+		step.frequency = -1;
+	}
+}
 
 void EnhancedSamplesGenerator::setFrequency(int value) {
+	// envelopes set the frequency every time they update, which is usually unchanged
+	if (value == frequency && _sample->baseFrequency == stepBaseFrequency) {
+		return;
+	}
 	frequency = value;
-	samplesPerGet = calculateSamplerate(value);
+	calculatePhaseStep(value);
 }
 
 void EnhancedSamplesGenerator::setSampleRate(int value) {
 	WaveformGenerator::setSampleRate(value);
-	samplesPerGet = calculateSamplerate(frequency);
+	// cached phase steps were for the old rate
+	for (auto & step : phaseSteps) {
+		step.frequency = -1;
+	}
+	calculatePhaseStep(frequency);
 }
 
 int EnhancedSamplesGenerator::getSample() {
@@ -61,26 +99,48 @@ int EnhancedSamplesGenerator::getSample() {
 	}
 
 	// if we've moved far enough along, read the next sample
-	while (fractionalSampleOffset >= 1.0) {
+	// NB looping back to the repeat start resets the position to zero, so the decrement afterwards leaves it at -1,
+	// ending the loop, exactly as the floating point version did
+	while (pendingSamples > 0) {
 		previousSample = currentSample;
 		currentSample = getNextSample();
-		fractionalSampleOffset = fractionalSampleOffset - 1.0;
+		pendingSamples--;
 	}
 
-	 // Interpolate between the samples to reduce aliasing
-	int sample = currentSample * fractionalSampleOffset + previousSample * (1.0-fractionalSampleOffset);
+	// Interpolate between the samples to reduce aliasing, using the top 16 bits of the phase
+	// Just after looping the position is between -1 and 0, so this extrapolates, as the floating point version did
+	// NB divides by a power of two round towards zero, as the floating point version did
+	int32_t fraction = (int32_t)(phase >> 16) + pendingSamples * 65536;
+	int sample = (previousSample * 65536 + (currentSample - previousSample) * fraction) / 65536;
 
-	fractionalSampleOffset = fractionalSampleOffset + samplesPerGet;
+	uint32_t nextPhase = phase + stepFraction;
+	pendingSamples += stepWhole + (nextPhase < phase ? 1 : 0);
+	phase = nextPhase;
 
-	// process volume
-	sample = sample * volume() / 127;
+	// process volume, avoiding a divide per sample
+	if (volume() != volumeLevel) {
+		volumeLevel = volume();
+		volumeMultiplier = ((volumeLevel << 16) + 126) / 127;
+	}
+	sample = (sample * volumeMultiplier) / 65536;
 
 	decDuration();
 
 	return sample;
 }
 
+// Add a block of samples into a mix, stopping early if playback ends
+void EnhancedSamplesGenerator::renderBlock(int32_t * mix, int count) {
+	for (int i = 0; i < count && enabled(); i++) {
+		mix[i] += EnhancedSamplesGenerator::getSample();
+	}
+}
+
 int EnhancedSamplesGenerator::getDuration(uint16_t frequency) {
+	if (sampleStream) {
+		// streams play until they are stopped
+		return -1;
+	}
 	// TODO this will produce an incorrect duration if the sample rate for the channel has been
 	// adjusted to differ from the underlying audio system sample rate
 	// At this point it's not clear how to resolve this, so we'll assume it hasn't been adjusted
@@ -88,12 +148,34 @@ int EnhancedSamplesGenerator::getDuration(uint16_t frequency) {
 }
 
 void EnhancedSamplesGenerator::seekTo(uint32_t position) {
+	if (sampleStream) {
+		// streams can't seek, so just restart interpolation from silence
+		phase = 0;
+		pendingSamples = 0;
+		previousSample = 0;
+		currentSample = 0;
+		return;
+	}
 	_sample->seekTo(position, index, blockIndex, repeatCount);
+	if (sampleData) {
+		// contiguous samples are indexed directly from the start
+		index = std::min(position, sampleLength);
+	} else if (adpcmData) {
+		// decoding can only start at the beginning of a block, so decode up to our position from there
+		position = std::min(position, sampleLength);
+		auto offset = position % AUDIO_ADPCM_SAMPLES_PER_BLOCK;
+		index = position - offset;
+		adpcmOffset = 0;
+		while (offset--) {
+			readAdpcmSample();
+		}
+	}
 
 	// prepare our fractional sample data for playback
-	fractionalSampleOffset = 0.0;
-	previousSample = _sample->getSample(index, blockIndex);
-	currentSample = _sample->getSample(index, blockIndex);
+	phase = 0;
+	pendingSamples = 0;
+	previousSample = readSample();
+	currentSample = readSample();
 }
 
 double EnhancedSamplesGenerator::calculateSamplerate(uint16_t frequency) {
@@ -102,8 +184,60 @@ double EnhancedSamplesGenerator::calculateSamplerate(uint16_t frequency) {
 	return frequencyAdjust * ((double)_sample->sampleRate / (double)(sampleRate()));
 }
 
+// Work out the fixed point phase step, so that playback needs no floating point
+// Steps are cached by frequency, so a stepped frequency envelope only does the floating point maths
+// the first time it reaches each frequency, rather than on every step
+void EnhancedSamplesGenerator::calculatePhaseStep(uint16_t frequency) {
+	int baseFrequency = _sample->baseFrequency;
+	auto & cached = phaseSteps[frequency % AUDIO_PHASE_STEP_CACHE_SIZE];
+	if (cached.frequency != frequency || cached.baseFrequency != baseFrequency) {
+		auto step = (uint64_t)(calculateSamplerate(frequency) * 4294967296.0 + 0.5);
+		cached.frequency = frequency;
+		cached.baseFrequency = baseFrequency;
+		cached.whole = step >> 32;
+		cached.fraction = (uint32_t)step;
+	}
+	stepWhole = cached.whole;
+	stepFraction = cached.fraction;
+	stepBaseFrequency = baseFrequency;
+}
+
+inline int8_t EnhancedSamplesGenerator::readSample() {
+	if (sampleData) {
+		return index < sampleLength ? sampleData[index++] : 0;
+	}
+	if (sampleStream) {
+		return sampleStream->read();
+	}
+	if (adpcmData) {
+		return readAdpcmSample();
+	}
+	return _sample->getSample(index, blockIndex);
+}
+
+// Decode the next ADPCM sample
+// The block header gives the decoder state, so only the start of each block needs a divide
+int8_t EnhancedSamplesGenerator::readAdpcmSample() {
+	if (index >= sampleLength) {
+		return 0;
+	}
+	int sample;
+	if (adpcmOffset == 0) {
+		adpcmBlock = adpcmData + (index / AUDIO_ADPCM_SAMPLES_PER_BLOCK) * AUDIO_ADPCM_BLOCK_SIZE;
+		sample = adpcmStartBlock(adpcmBlock, adpcmPredictor, adpcmStepIndex);
+	} else {
+		auto codes = adpcmBlock[4 + ((adpcmOffset - 1) >> 1)];
+		sample = adpcmDecode((adpcmOffset & 1) ? codes & 0x0F : codes >> 4, adpcmPredictor, adpcmStepIndex);
+	}
+	index++;
+	if (++adpcmOffset == AUDIO_ADPCM_SAMPLES_PER_BLOCK) {
+		adpcmOffset = 0;
+	}
+	return sample >> 8;
+}
+
 int8_t EnhancedSamplesGenerator::getNextSample() {
-	auto sample = _sample->getSample(index, blockIndex);
+	auto sample = readSample();
 
 	// looping magic
 	repeatCount--;
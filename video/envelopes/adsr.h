@@ -7,6 +7,9 @@
 #ifndef ENVELOPE_ADSR_H
 #define ENVELOPE_ADSR_H
 
+#include <algorithm>
+
+#include "./table.h"
 #include "./types.h"
 
 class ADSRVolumeEnvelope : public VolumeEnvelope {
@@ -18,47 +21,67 @@ class ADSRVolumeEnvelope : public VolumeEnvelope {
 		uint32_t getRelease() {
 			return this->_release;
 		}
+		uint32_t getNextChange(uint32_t elapsed, int32_t duration);
 	private:
+		uint32_t getSustainEnd(int32_t duration);
 		uint16_t _attack;
 		uint16_t _decay;
 		uint8_t _sustain;
 		uint16_t _release;
+		EnvelopeTable _attackDecay;		// levels are relative to the note's volume, which is 127
+		EnvelopeTable _releaseTable;
 };
 
 ADSRVolumeEnvelope::ADSRVolumeEnvelope(uint16_t attack, uint16_t decay, uint8_t sustain, uint16_t release)
-	: _attack(attack), _decay(decay), _sustain(sustain), _release(release)
+	: _attack(attack), _decay(decay), _sustain(sustain), _release(release), _attackDecay(0), _releaseTable(sustain)
 {
 	// attack, decay, release are time values in milliseconds
 	// sustain is 0-255, centered on 127, and is the relative sustain level
+	_attackDecay.addSegment(attack, 127);
+	_attackDecay.addSegment(decay, sustain);
+	_releaseTable.addSegment(release, 0);
 	debug_log("audioDriver: ADSRVolumeEnvelope: attack=%d, decay=%d, sustain=%d, release=%d\n\r", this->_attack, this->_decay, this->_sustain, this->_release);
 }
 
+// Time at which sustain ends and release starts
+uint32_t ADSRVolumeEnvelope::getSustainEnd(int32_t duration) {
+	if (duration < 0) {
+		// playing forever, so we sustain forever
+		return AUDIO_NO_DEADLINE;
+	}
+	return std::max<int32_t>(duration, this->_attack + this->_decay);
+}
+
 uint8_t ADSRVolumeEnvelope::getVolume(uint8_t baseVolume, uint32_t elapsed, int32_t duration) {
 	// returns volume for the given elapsed time
 	// baseVolume is the level the attack phase should reach
 	// sustain volume level is calculated relative to baseVolume
 	// volume for fab-gl is 0-127 but accepts higher values, so we're not clamping
 	// a duration of -1 means we're playing forever
-	auto phaseTime = elapsed;
-	if (phaseTime < this->_attack) {
-		return (phaseTime * baseVolume) / this->_attack;
+	int32_t level;
+	if (elapsed < _attackDecay.getLength()) {
+		level = _attackDecay.getLevel(elapsed);
+	} else {
+		auto sustainEnd = getSustainEnd(duration);
+		level = elapsed < sustainEnd ? this->_sustain : _releaseTable.getLevel(elapsed - sustainEnd);
 	}
-	phaseTime -= this->_attack;
-	uint8_t sustainVolume = baseVolume * this->_sustain / 127;
-	if (phaseTime < this->_decay) {
-		return map(phaseTime, 0, this->_decay, baseVolume, sustainVolume);
-	}
-	phaseTime -= this->_decay;
-	int32_t sustainDuration = duration < 0 ? elapsed : duration - (this->_attack + this->_decay);
-	if (sustainDuration < 0) sustainDuration = 0;
-	if (phaseTime < sustainDuration) {
-		return sustainVolume;
+	return baseVolume * level / 127;
+}
+
+uint32_t ADSRVolumeEnvelope::getNextChange(uint32_t elapsed, int32_t duration) {
+	uint32_t untilChange;
+	if (elapsed < _attackDecay.getLength()) {
+		_attackDecay.getLevel(elapsed, &untilChange);
+		return untilChange;
 	}
-	phaseTime -= sustainDuration;
-	if (phaseTime < this->_release) {
-		return map(phaseTime, 0, this->_release, sustainVolume, 0);
+	auto sustainEnd = getSustainEnd(duration);
+	if (elapsed < sustainEnd) {
+		return sustainEnd == AUDIO_NO_DEADLINE ? AUDIO_NO_DEADLINE : sustainEnd - elapsed;
 	}
-	return 0;
+	_releaseTable.getLevel(elapsed - sustainEnd, &untilChange);
+	// make sure the channel notices when release has finished
+	auto releaseEnd = sustainEnd + this->_release;
+	return elapsed < releaseEnd ? std::min(untilChange, releaseEnd - elapsed) : 1;
 }
 
 bool ADSRVolumeEnvelope::isReleasing(uint32_t elapsed, int32_t duration) {
@@ -10,6 +10,7 @@
 #include <memory>
 #include <vector>
 
+#include "../agon.h"
 #include "./types.h"
 
 struct FrequencyStepPhase {
@@ -22,8 +23,12 @@ class SteppedFrequencyEnvelope : public FrequencyEnvelope {
 		SteppedFrequencyEnvelope(std::shared_ptr<std::vector<FrequencyStepPhase>> phases, uint16_t stepLength, bool repeats, bool cumulative, bool restrict);
 		uint16_t getFrequency(uint16_t baseFrequency, uint32_t elapsed, int32_t duration);
 		bool isFinished(uint32_t elapsed, int32_t duration);
+		uint32_t getNextChange(uint32_t elapsed, int32_t duration);
 	private:
 		std::shared_ptr<std::vector<FrequencyStepPhase>> _phases;
+		std::vector<uint32_t> _phaseStarts;		// first step of each phase
+		std::vector<int32_t> _phaseOffsets;		// frequency adjustment at the start of each phase
+		size_t _phaseCursor = 0;				// phase used by the last lookup
 		uint16_t _stepLength;
 		uint32_t _totalSteps;
 		uint32_t _totalAdjustment;
@@ -41,6 +46,8 @@ SteppedFrequencyEnvelope::SteppedFrequencyEnvelope(std::shared_ptr<std::vector<F
 	_totalAdjustment = 0;
 
 	for (auto phase : *this->_phases) {
+		_phaseStarts.push_back(_totalSteps);
+		_phaseOffsets.push_back(_totalAdjustment);
 		_totalSteps += phase.number;
 		_totalLength += phase.number * _stepLength;
 		_totalAdjustment += (phase.number * phase.adjustment);
@@ -53,6 +60,9 @@ SteppedFrequencyEnvelope::SteppedFrequencyEnvelope(std::shared_ptr<std::vector<F
 uint16_t SteppedFrequencyEnvelope::getFrequency(uint16_t baseFrequency, uint32_t elapsed, int32_t duration) {
 	// returns frequency for the given elapsed time
 	// a duration of -1 means we're playing forever
+	if (this->_totalSteps == 0 || this->_stepLength == 0) {
+		return baseFrequency;
+	}
 	auto currentStep = (elapsed / this->_stepLength) % this->_totalSteps;
 	auto loopCount = elapsed / this->_totalLength;
 
@@ -68,16 +78,16 @@ uint16_t SteppedFrequencyEnvelope::getFrequency(uint16_t baseFrequency, uint32_t
 		frequency += (loopCount * _totalAdjustment);
 	}
 
-	for (auto phase : *this->_phases) {
-		if (currentStep < phase.number) {
-			frequency += (currentStep * phase.adjustment);
-			break;
-		} else {
-			frequency += (phase.number * phase.adjustment);
-		}
-
-		currentStep -= phase.number;
+	// find the phase for this step, starting from the one used last time
+	// as steps only go backwards when the envelope loops or a new note starts
+	if (_phaseCursor >= _phaseStarts.size() || currentStep < _phaseStarts[_phaseCursor]) {
+		_phaseCursor = 0;
 	}
+	while (_phaseCursor + 1 < _phaseStarts.size() && currentStep >= _phaseStarts[_phaseCursor + 1]) {
+		_phaseCursor++;
+	}
+	auto &phase = (*this->_phases)[_phaseCursor];
+	frequency += _phaseOffsets[_phaseCursor] + (int32_t)(currentStep - _phaseStarts[_phaseCursor]) * phase.adjustment;
 
 	if (_restrict) {
 		if (frequency < 0) {
@@ -99,4 +109,13 @@ bool SteppedFrequencyEnvelope::isFinished(uint32_t elapsed, int32_t duration) {
 	return elapsed >= _totalLength;
 }
 
+uint32_t SteppedFrequencyEnvelope::getNextChange(uint32_t elapsed, int32_t duration) {
+	if (this->_stepLength == 0 || (!_repeats && elapsed >= _totalLength)) {
+		// frequency will no longer change
+		return AUDIO_NO_DEADLINE;
+	}
+	// frequency only changes at the start of a step
+	return this->_stepLength - (elapsed % this->_stepLength);
+}
+
 #endif // ENVELOPE_FREQUENCY_H
@@ -7,10 +7,12 @@
 #ifndef ENVELOPE_MULTIPHASE_ADSR_H
 #define ENVELOPE_MULTIPHASE_ADSR_H
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <Arduino.h>
 
+#include "./table.h"
 #include "./types.h"
 
 struct VolumeSubPhase {
@@ -27,8 +29,12 @@ class MultiphaseADSREnvelope : public VolumeEnvelope {
 		uint32_t	getRelease() {
 			return _releaseDuration;
 		};
+		uint32_t	getNextChange(uint32_t elapsed, int32_t duration);
 	private:
 		uint8_t		getTargetVolume(uint8_t baseVolume, uint8_t level);
+		uint32_t	getReleaseStart(int32_t duration);
+		uint32_t	getFinishTime(int32_t duration);
+		EnvelopeTable &	getReleaseTable(uint32_t releaseStart);
 		std::shared_ptr<std::vector<VolumeSubPhase>> _attack;
 		std::shared_ptr<std::vector<VolumeSubPhase>> _sustain;
 		std::shared_ptr<std::vector<VolumeSubPhase>> _release;
@@ -40,6 +46,12 @@ class MultiphaseADSREnvelope : public VolumeEnvelope {
 		uint8_t		_sustainLevel;
 		uint8_t		_releaseLevel;
 		bool		_sustainLoops;
+		// levels in tables are relative to the note's volume, which is 127
+		EnvelopeTable	_attackTable;
+		EnvelopeTable	_sustainFirstTable;			// first time through sustain, starting from the attack level
+		EnvelopeTable	_sustainLoopTable;			// subsequent loops, starting from the sustain level
+		EnvelopeTable	_releaseFromAttackTable;
+		EnvelopeTable	_releaseFromSustainTable;
 };
 
 MultiphaseADSREnvelope::MultiphaseADSREnvelope(std::shared_ptr<std::vector<VolumeSubPhase>> attack, std::shared_ptr<std::vector<VolumeSubPhase>> sustain, std::shared_ptr<std::vector<VolumeSubPhase>> release)
@@ -80,6 +92,22 @@ MultiphaseADSREnvelope::MultiphaseADSREnvelope(std::shared_ptr<std::vector<Volum
 			break;
 		}
 	}
+	_attackTable = EnvelopeTable(0);
+	for (const auto& subPhase : *_attack) {
+		_attackTable.addSegment(subPhase.duration, subPhase.level);
+	}
+	_sustainFirstTable = EnvelopeTable(_attackLevel);
+	_sustainLoopTable = EnvelopeTable(_sustainLevel);
+	for (const auto& subPhase : *_sustain) {
+		_sustainFirstTable.addSegment(subPhase.duration, subPhase.level);
+		_sustainLoopTable.addSegment(subPhase.duration, subPhase.level);
+	}
+	_releaseFromAttackTable = EnvelopeTable(_attackLevel);
+	_releaseFromSustainTable = EnvelopeTable(_sustainLevel);
+	for (const auto& subPhase : *_release) {
+		_releaseFromAttackTable.addSegment(subPhase.duration, subPhase.level);
+		_releaseFromSustainTable.addSegment(subPhase.duration, subPhase.level);
+	}
 	debug_log("MultiphaseADSREnvelope created with %d attack, %d sustain, %d release phases\n\r", _attack->size(), _sustain->size(), _release->size());
 	debug_log("  attackDuration %d, sustainDuration %d, releaseDuration %d\n\r", _attackDuration, _sustainDuration, _releaseDuration);
 	debug_log("  attackLevel %d, sustainLevel %d, releaseLevel %d\n\r", _attackLevel, _sustainLevel, _releaseLevel);
@@ -89,48 +117,32 @@ MultiphaseADSREnvelope::MultiphaseADSREnvelope(std::shared_ptr<std::vector<Volum
 }
 
 uint8_t MultiphaseADSREnvelope::getVolume(uint8_t baseVolume, uint32_t elapsed, int32_t duration) {
-	auto subPhasePos = elapsed;
-	uint32_t pos = 0;
-	uint8_t startVolume = 0;
-	// work out what sub-phase we're on, based on our elapsed time
-	if (subPhasePos < _attackDuration) {
+	if (elapsed < _attackDuration) {
 		// we're in an attack sub-phase
-		for (const auto& subPhase : *this->_attack) {
-			if (subPhasePos < subPhase.duration) {
-				// we're inside this sub-phase
-				return map(subPhasePos, 0, subPhase.duration, startVolume, getTargetVolume(baseVolume, subPhase.level));
-			}
-			subPhasePos -= subPhase.duration;
-			startVolume = getTargetVolume(baseVolume, subPhase.level);
-		}
-	} else {
-		startVolume = getTargetVolume(baseVolume, _attackLevel);
+		return baseVolume * _attackTable.getLevel(elapsed) / 127;
 	}
-	subPhasePos -= _attackDuration;
-	pos += _attackDuration;
+	auto subPhasePos = elapsed - _attackDuration;
+	auto startVolume = getTargetVolume(baseVolume, _attackLevel);
 
-	auto sustainVolume = getTargetVolume(baseVolume, _sustainLevel);
 	if (_sustainLoops) {
 		// if we have sustain data, and it's not just zero duration, then loop around it
-		while (pos < duration) {
-			// short-cut looping sub-phases if we can for complete loops
-			if (subPhasePos > _sustainDuration) {
-				subPhasePos -= _sustainDuration;
-				pos += _sustainDuration;
-				startVolume = sustainVolume;
-			} else {
-				for (auto subPhase : *this->_sustain) {
-					if (subPhasePos < subPhase.duration) {
-						// we're in this sub-phase
-						return map(subPhasePos, 0, subPhase.duration, startVolume, getTargetVolume(baseVolume, subPhase.level));
-					}
-					subPhasePos -= subPhase.duration;
-					pos += subPhase.duration;
-					startVolume = getTargetVolume(baseVolume, subPhase.level);
-				}
+		// until the loop that reaches our duration has completed
+		auto releaseStart = getReleaseStart(duration);
+		if (elapsed < releaseStart) {
+			if (subPhasePos < _sustainDuration) {
+				return baseVolume * _sustainFirstTable.getLevel(subPhasePos) / 127;
 			}
+			return baseVolume * _sustainLoopTable.getLevel(subPhasePos % _sustainDuration) / 127;
+		}
+		subPhasePos = elapsed - releaseStart;
+		if (subPhasePos >= _releaseDuration) {
+			return 0;
 		}
-	} else if (elapsed < duration) {
+		return baseVolume * getReleaseTable(releaseStart).getLevel(subPhasePos) / 127;
+	}
+
+	auto sustainVolume = getTargetVolume(baseVolume, _sustainLevel);
+	if (elapsed < duration) {
 		// non-looping sustain - so we're spreading time between the phases, if there are any
 		if (_sustainSubphases <= 1) {
 			return map(subPhasePos, 0, duration - _attackDuration, startVolume, sustainVolume);
@@ -145,22 +157,47 @@ uint8_t MultiphaseADSREnvelope::getVolume(uint8_t baseVolume, uint32_t elapsed,
 			startVolume = getTargetVolume(baseVolume, subPhase.level);
 		}
 		return startVolume;
-	} else {
-		// end of sustain reached for non-looping sustain, so adjust our subPhasePos to our time within release
-		subPhasePos = elapsed - duration;
-		startVolume = sustainVolume;
 	}
 
-	// work out our release phase volume
-	for (auto subPhase : *this->_release) {
-		if (subPhasePos < subPhase.duration) {
-			return map(subPhasePos, 0, subPhase.duration, startVolume, getTargetVolume(baseVolume, subPhase.level));
+	// end of sustain reached for non-looping sustain, so work out our release phase volume
+	subPhasePos = elapsed - duration;
+	if (subPhasePos >= _releaseDuration) {
+		return 0;
+	}
+	return baseVolume * _releaseFromSustainTable.getLevel(subPhasePos) / 127;
+}
+
+uint32_t MultiphaseADSREnvelope::getNextChange(uint32_t elapsed, int32_t duration) {
+	uint32_t untilChange = 1;
+	if (elapsed < _attackDuration) {
+		_attackTable.getLevel(elapsed, &untilChange);
+	} else if (_sustainLoops) {
+		auto releaseStart = getReleaseStart(duration);
+		auto subPhasePos = elapsed - _attackDuration;
+		if (elapsed < releaseStart) {
+			if (subPhasePos < _sustainDuration) {
+				_sustainFirstTable.getLevel(subPhasePos, &untilChange);
+			} else {
+				_sustainLoopTable.getLevel(subPhasePos % _sustainDuration, &untilChange);
+			}
+		} else {
+			getReleaseTable(releaseStart).getLevel(elapsed - releaseStart, &untilChange);
 		}
-		subPhasePos -= subPhase.duration;
-		startVolume = getTargetVolume(baseVolume, subPhase.level);
+	} else if (duration >= 0 && elapsed >= duration) {
+		_releaseFromSustainTable.getLevel(elapsed - duration, &untilChange);
 	}
+	// otherwise we're spreading a non-looping sustain over the note, so may change at any time
 
-	return 0;
+	if (duration < 0) {
+		return untilChange;
+	}
+	// make sure the channel notices when we start releasing, and when we finish
+	auto releasing = std::max<uint32_t>(duration, _attackDuration);
+	if (elapsed < releasing) {
+		untilChange = std::min(untilChange, releasing - elapsed);
+	}
+	auto finish = getFinishTime(duration);
+	return elapsed < finish ? std::min(untilChange, finish - elapsed) : 1;
 }
 
 bool MultiphaseADSREnvelope::isReleasing(uint32_t elapsed, int32_t duration) {
@@ -177,21 +214,42 @@ bool MultiphaseADSREnvelope::isReleasing(uint32_t elapsed, int32_t duration) {
 bool MultiphaseADSREnvelope::isFinished(uint32_t elapsed, int32_t duration) {
 	if (duration < 0) return false;
 
-	// we're finished if we have reached the end of sustain and then end of release
-	auto minDuration = _attackDuration + _sustainDuration;
-	if (_sustainDuration != 0) {
-		while ((minDuration + _sustainDuration) <= duration) {
-			minDuration += _sustainDuration;
-		}
+	return (elapsed >= getFinishTime(duration));
+}
+
+uint8_t MultiphaseADSREnvelope::getTargetVolume(uint8_t baseVolume, uint8_t level) {
+	return baseVolume * level / 127;
+}
+
+// Time at which a looping sustain's release starts, which is at the end of the sustain loop
+// that reaches the note's duration, or at the end of attack if the note is shorter than that
+uint32_t MultiphaseADSREnvelope::getReleaseStart(int32_t duration) {
+	if (duration < 0) {
+		// playing forever, so we sustain forever
+		return AUDIO_NO_DEADLINE;
+	}
+	if (duration <= _attackDuration) {
+		return _attackDuration;
 	}
+	auto loops = (duration - _attackDuration + _sustainDuration - 1) / _sustainDuration;
+	return _attackDuration + loops * _sustainDuration;
+}
 
-	if (duration < minDuration) duration = minDuration;
+// Time at which the envelope has finished, for a note of a known duration
+uint32_t MultiphaseADSREnvelope::getFinishTime(int32_t duration) {
+	// we're finished if we have reached the end of sustain and then end of release
+	uint32_t minDuration = _attackDuration + _sustainDuration;
+	if (_sustainDuration != 0 && duration >= minDuration + _sustainDuration) {
+		// extend to the last complete sustain loop within our duration
+		minDuration += ((duration - minDuration) / _sustainDuration) * _sustainDuration;
+	}
 
-	return (elapsed >= duration + this->_releaseDuration);
+	return std::max<uint32_t>(duration, minDuration) + this->_releaseDuration;
 }
 
-uint8_t MultiphaseADSREnvelope::getTargetVolume(uint8_t baseVolume, uint8_t level) {
-	return baseVolume * level / 127;
+// Release levels start from wherever sustain left off
+EnvelopeTable & MultiphaseADSREnvelope::getReleaseTable(uint32_t releaseStart) {
+	return releaseStart == _attackDuration ? _releaseFromAttackTable : _releaseFromSustainTable;
 }
 
 #endif // ENVELOPE_MULTIPHASE_ADSR_H
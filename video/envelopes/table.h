@@ -0,0 +1,72 @@
+//
+// Title:			Precomputed envelope tables
+// Created:			18/10/2026
+// Last Updated:	18/10/2026
+
+#ifndef ENVELOPE_TABLE_H
+#define ENVELOPE_TABLE_H
+
+#include <vector>
+
+#include "../agon.h"
+
+// A straight line section of an envelope
+struct EnvelopeSegment {
+	uint32_t	start;		// time at start of segment, in ms from start of table
+	uint32_t	end;		// time at end of segment
+	int32_t		level;		// level at start of segment, in 16.16 fixed point
+	int32_t		slope;		// change in level per ms, in 16.16 fixed point
+};
+
+// A table of envelope segments, built when an envelope is defined
+// Lookups walk forward from the segment used last time, so as a note plays
+// each lookup is a comparison and a multiply rather than a search
+//
+class EnvelopeTable {
+	public:
+		EnvelopeTable(int32_t startLevel = 0) : _endLevel(startLevel) {}
+
+		// Add a segment ramping from the current end level to a new level
+		void addSegment(uint32_t length, int32_t level) {
+			if (length > 0) {
+				_segments.push_back({ _length, _length + length, _endLevel * 65536, (level - _endLevel) * 65536 / (int32_t)length });
+				_length += length;
+			}
+			_endLevel = level;
+		}
+
+		uint32_t getLength() {
+			return _length;
+		}
+
+		// Get the level at a time within the table, optionally reporting how long until the level may change
+		// Times beyond the end of the table give the final level, which never changes
+		int32_t getLevel(uint32_t time, uint32_t * untilChange = nullptr) {
+			if (time >= _length) {
+				if (untilChange) {
+					*untilChange = AUDIO_NO_DEADLINE;
+				}
+				return _endLevel;
+			}
+			if (_cursor >= _segments.size() || time < _segments[_cursor].start) {
+				// time has gone backwards, as a new note has started
+				_cursor = 0;
+			}
+			while (time >= _segments[_cursor].end) {
+				_cursor++;
+			}
+			auto &segment = _segments[_cursor];
+			if (untilChange) {
+				*untilChange = segment.slope == 0 ? segment.end - time : 1;
+			}
+			return (segment.level + segment.slope * (int32_t)(time - segment.start)) >> 16;
+		}
+
+	private:
+		std::vector<EnvelopeSegment>	_segments;
+		uint32_t	_length = 0;
+		int32_t		_endLevel;
+		size_t		_cursor = 0;		// segment used by the last lookup
+};
+
+#endif // ENVELOPE_TABLE_H
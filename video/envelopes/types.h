@@ -15,12 +15,16 @@ class VolumeEnvelope {
 		virtual bool isReleasing(uint32_t elapsed, int32_t duration) = 0;
 		virtual bool isFinished(uint32_t elapsed, int32_t duration) = 0;
 		virtual uint32_t getRelease() = 0;
+		// milliseconds until the volume may next change, or the envelope changes phase
+		virtual uint32_t getNextChange(uint32_t elapsed, int32_t duration) = 0;
 };
 
 class FrequencyEnvelope {
 	public:
 		virtual uint16_t getFrequency(uint16_t baseFrequency, uint32_t elapsed, int32_t duration) = 0;
 		virtual bool isFinished(uint32_t elapsed, int32_t duration) = 0;
+		// milliseconds until the frequency may next change
+		virtual uint32_t getNextChange(uint32_t elapsed, int32_t duration) = 0;
 };
 
 #endif // ENVELOPE_TYPES_H
@@ -0,0 +1,312 @@
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <fabgl.h>
+
+#include "agon.h"
+#include "buffers.h"
+#include "sprites.h"
+
+// Software renderer used when a context's drawing is redirected into an RGBA2222 bitmap
+// Supports the core set of graphics primitives, using the GCOL paint modes
+// Coordinates are screen coordinates, with the bitmap's top left at the screen's top left
+//
+class RenderTarget {
+	public:
+		RenderTarget(uint16_t bitmapId, std::shared_ptr<Bitmap> bitmap, std::shared_ptr<void> owner) :
+			bitmapId(bitmapId), bitmap(bitmap), owner(owner), clip(0, 0, bitmap->width - 1, bitmap->height - 1) {}
+
+		inline uint16_t getBitmapId() const {
+			return bitmapId;
+		}
+		inline Bitmap * getBitmap() const {
+			return bitmap.get();
+		}
+
+		void setClippingRect(const Rect &rect) {
+			clip = rect.intersection(Rect(0, 0, bitmap->width - 1, bitmap->height - 1));
+		}
+
+		void setPaint(RGB888 colour, fabgl::PaintMode mode) {
+			pen = packRGBA2222(colour.R, colour.G, colour.B, 0xFF);
+			paintMode = static_cast<uint8_t>(mode);
+		}
+
+		void setPixel(int x, int y) {
+			if (inClip(x, y)) {
+				paint(row(y) + x);
+			}
+			changed();
+		}
+
+		void drawLine(int x1, int y1, int x2, int y2, bool omitFirst, bool omitLast) {
+			// Bresenham's line algorithm
+			int dx = abs(x2 - x1);
+			int dy = -abs(y2 - y1);
+			int sx = x1 < x2 ? 1 : -1;
+			int sy = y1 < y2 ? 1 : -1;
+			int error = dx + dy;
+			bool first = true;
+			while (true) {
+				bool last = (x1 == x2 && y1 == y2);
+				if (!(first && omitFirst) && !(last && omitLast) && inClip(x1, y1)) {
+					paint(row(y1) + x1);
+				}
+				if (last) {
+					break;
+				}
+				first = false;
+				int e2 = 2 * error;
+				if (e2 >= dy) {
+					error += dy;
+					x1 += sx;
+				}
+				if (e2 <= dx) {
+					error += dx;
+					y1 += sy;
+				}
+			}
+			changed();
+		}
+
+		void fillRectangle(int x1, int y1, int x2, int y2) {
+			for (int y = std::max(std::min(y1, y2), (int)clip.Y1); y <= std::min(std::max(y1, y2), (int)clip.Y2); y++) {
+				hline(std::min(x1, x2), std::max(x1, x2), y);
+			}
+			changed();
+		}
+
+		// Fill a convex polygon, such as a triangle or parallelogram, including its edges
+		void fillPolygon(const Point * points, int count) {
+			int minY = points[0].Y;
+			int maxY = points[0].Y;
+			for (int n = 1; n < count; n++) {
+				minY = std::min<int>(minY, points[n].Y);
+				maxY = std::max<int>(maxY, points[n].Y);
+			}
+			for (int y = std::max(minY, (int)clip.Y1); y <= std::min(maxY, (int)clip.Y2); y++) {
+				int left = INT_MAX;
+				int right = INT_MIN;
+				for (int n = 0; n < count; n++) {
+					auto &a = points[n];
+					auto &b = points[(n + 1) % count];
+					if (y < std::min(a.Y, b.Y) || y > std::max(a.Y, b.Y)) {
+						continue;
+					}
+					if (a.Y == b.Y) {
+						left = std::min<int>(left, std::min(a.X, b.X));
+						right = std::max<int>(right, std::max(a.X, b.X));
+						continue;
+					}
+					int x = a.X + (int)lroundf((float)(y - a.Y) * (b.X - a.X) / (b.Y - a.Y));
+					left = std::min(left, x);
+					right = std::max(right, x);
+				}
+				if (left <= right) {
+					hline(left, right, y);
+				}
+			}
+			changed();
+		}
+
+		// Draw an ellipse centred on x, y, with the given overall width and height
+		void drawEllipse(int x, int y, int width, int height, bool filled) {
+			float rx = width / 2.0f;
+			float ry = height / 2.0f;
+			if (rx < 0.5f || ry < 0.5f) {
+				setPixel(x, y);
+				return;
+			}
+			int rows = (int)ry;
+			int previous = 0;
+			for (int dy = rows; dy >= 0; dy--) {
+				float t = (float)dy / ry;
+				int dx = (int)lroundf(rx * sqrtf(std::max(0.0f, 1.0f - t * t)));
+				if (filled) {
+					hline(x - dx, x + dx, y - dy);
+					if (dy) {
+						hline(x - dx, x + dx, y + dy);
+					}
+				} else {
+					// join up with the previous row, so steep parts of the outline have no gaps
+					int from = (dy == rows) ? 0 : previous + 1;
+					from = std::min(from, dx);
+					hline(x - dx, x - from, y - dy);
+					hline(x + from, x + dx, y - dy);
+					if (dy) {
+						hline(x - dx, x - from, y + dy);
+						hline(x + from, x + dx, y + dy);
+					}
+				}
+				previous = dx;
+			}
+			changed();
+		}
+
+		// Draw a bitmap with its top left at x, y, skipping transparent pixels
+		// If the bitmap has an opaque span encoding only its opaque runs are visited
+		void drawBitmap(int x, int y, Bitmap * source, const BitmapSpans * spans = nullptr) {
+			if (source == bitmap.get()) {
+				debug_log("RenderTarget: cannot draw bitmap into itself\n\r");
+				return;
+			}
+			int x1 = std::max(x, (int)clip.X1);
+			int x2 = std::min(x + source->width - 1, (int)clip.X2);
+			int y1 = std::max(y, (int)clip.Y1);
+			int y2 = std::min(y + source->height - 1, (int)clip.Y2);
+			if (spans) {
+				drawBitmapSpans(x, y, source, spans, x1, x2, std::max(y1, y + spans->firstRow), std::min(y2, y + spans->lastRow));
+				changed();
+				return;
+			}
+			for (int py = y1; py <= y2; py++) {
+				auto destination = row(py);
+				for (int px = x1; px <= x2; px++) {
+					int sx = px - x;
+					int sy = py - y;
+					if (!isBitmapPixelSolid(source, sx, sy)) {
+						continue;
+					}
+					switch (source->format) {
+						case PixelFormat::RGBA2222:
+							destination[px] = source->data[sy * source->width + sx];
+							break;
+						case PixelFormat::RGBA8888: {
+							auto pixel = source->data + (sy * source->width + sx) * 4;
+							destination[px] = packRGBA2222(pixel[0], pixel[1], pixel[2], pixel[3]);
+						} break;
+						case PixelFormat::Mask:
+							paint(destination + px);
+							break;
+						default:
+							break;
+					}
+				}
+			}
+			changed();
+		}
+
+		// Draw a character from a fixed width font, with a transparent background
+		void drawChar(int x, int y, const fabgl::FontInfo * font, uint8_t c) {
+			if (font->chptr) {
+				debug_log("RenderTarget: variable width fonts are not supported\n\r");
+				return;
+			}
+			auto bytesPerRow = (font->width + 7) / 8;
+			auto glyph = font->data + c * font->height * bytesPerRow;
+			for (int gy = 0; gy < font->height; gy++) {
+				auto py = y + gy;
+				if (py < clip.Y1 || py > clip.Y2) {
+					continue;
+				}
+				auto destination = row(py);
+				auto glyphRow = glyph + gy * bytesPerRow;
+				for (int gx = 0; gx < font->width; gx++) {
+					auto px = x + gx;
+					if (px >= clip.X1 && px <= clip.X2 && (glyphRow[gx / 8] & (0x80 >> (gx & 7)))) {
+						paint(destination + px);
+					}
+				}
+			}
+			changed();
+		}
+
+		// Clear a rectangle to transparent
+		void clear(const Rect &rect) {
+			auto area = rect.intersection(clip);
+			for (int y = area.Y1; y <= area.Y2; y++) {
+				memset(row(y) + area.X1, 0, area.X2 - area.X1 + 1);
+			}
+			changed();
+		}
+
+	private:
+		uint16_t				bitmapId;
+		std::shared_ptr<Bitmap>	bitmap;
+		std::shared_ptr<void>	owner;			// Keeps the bitmap's pixel data alive
+		Rect					clip;
+		uint8_t					pen = 0xFF;		// Pen colour, in RGBA2222
+		uint8_t					paintMode = 0;	// GCOL paint mode
+
+		inline uint8_t * row(int y) {
+			return bitmap->data + y * bitmap->width;
+		}
+
+		inline bool inClip(int x, int y) {
+			return x >= clip.X1 && x <= clip.X2 && y >= clip.Y1 && y <= clip.Y2;
+		}
+
+		// Apply the pen colour to a pixel using the current GCOL paint mode
+		inline void paint(uint8_t * pixel) {
+			auto colour = *pixel & 0x3F;
+			auto penColour = pen & 0x3F;
+			switch (paintMode) {
+				case 0: colour = penColour; break;				// Set
+				case 1: colour |= penColour; break;				// OR
+				case 2: colour &= penColour; break;				// AND
+				case 3: colour ^= penColour; break;				// XOR
+				case 4: colour ^= 0x3F; break;					// Invert
+				case 5: return;									// No-op
+				case 6: colour &= ~penColour; break;			// AND NOT
+				case 7: colour |= ~penColour & 0x3F; break;		// OR NOT
+			}
+			*pixel = 0xC0 | colour;
+		}
+
+		// Copy the opaque runs of a bitmap's rows within the given destination area
+		void drawBitmapSpans(int x, int y, Bitmap * source, const BitmapSpans * spans, int x1, int x2, int y1, int y2) {
+			for (int py = y1; py <= y2; py++) {
+				auto destination = row(py);
+				int sy = py - y;
+				int sx = 0;
+				for (auto run = spans->rowStart[sy]; run < spans->rowStart[sy + 1]; run += 2) {
+					sx += spans->runs[run];
+					int first = std::max(x + sx, x1);
+					int last = std::min(x + sx + spans->runs[run + 1] - 1, x2);
+					sx += spans->runs[run + 1];
+					if (first > last) {
+						continue;
+					}
+					if (source->format == PixelFormat::RGBA2222) {
+						memcpy(destination + first, source->data + sy * source->width + (first - x), last - first + 1);
+						continue;
+					}
+					auto pixel = source->data + (sy * source->width + (first - x)) * 4;
+					for (int px = first; px <= last; px++, pixel += 4) {
+						destination[px] = packRGBA2222(pixel[0], pixel[1], pixel[2], pixel[3]);
+					}
+				}
+			}
+		}
+
+		inline void hline(int x1, int x2, int y) {
+			if (y < clip.Y1 || y > clip.Y2) {
+				return;
+			}
+			x1 = std::max(x1, (int)clip.X1);
+			x2 = std::min(x2, (int)clip.X2);
+			auto destination = row(y);
+			if (paintMode == 0) {
+				if (x1 <= x2) {
+					memset(destination + x1, pen, x2 - x1 + 1);
+				}
+				return;
+			}
+			for (int x = x1; x <= x2; x++) {
+				paint(destination + x);
+			}
+		}
+
+		// Note that bitmap contents have changed, so cached renderings and spans of it are invalidated
+		// The generation is bumped on the buffer holding the data, which covers views that share it
+		inline void changed() {
+			bufferDataChanged(getBitmapDataId(bitmapId));
+		}
+};
+
+#endif // RENDER_TARGET_H
@@ -2,7 +2,10 @@
 #define SPRITES_H
 
 #include <algorithm>
+#include <bitset>
+#include <cmath>
 #include <limits>
+#include <list>
 #include <memory>
 #include <type_traits>
 #include <unordered_map>
@@ -11,17 +14,69 @@
 
 #include "agon.h"
 #include "agon_screen.h"
+#include "bitmap_transform.h"
+#include "buffers.h"
 #include "types.h"
 
 std::unordered_map<uint16_t, std::shared_ptr<Bitmap>,
 	std::hash<uint16_t>, std::equal_to<uint16_t>,
 	psram_allocator<std::pair<const uint16_t, std::shared_ptr<Bitmap>>>> bitmaps;	// Storage for our bitmaps
+// Views that share another bitmap's pixel data, mapped to the ID whose buffer data generation covers that data
+std::unordered_map<uint16_t, uint16_t> bitmapDataSources;
 uint8_t			numsprites = 0;					// Number of sprites on stage
 uint8_t			current_sprite = 0;				// Current sprite number
 Sprite			sprites[MAX_SPRITES];			// Sprite object storage
 
-// track which sprites may be using a bitmap
-std::unordered_map<uint16_t, std::vector<uint8_t, psram_allocator<uint8_t>>> bitmapUsers;
+// Autonomous sprite animation and motion, advanced once per frame
+struct SpriteAnimation {
+	uint8_t		mode = SPRITE_ANIMATE_NONE;		// Animation mode and flags
+	uint8_t		firstFrame = 0;					// Frame range to animate through
+	uint8_t		lastFrame = 0;
+	uint8_t		frameDelay = 0;					// Frames per animation step
+	uint8_t		frameCount = 0;					// Frames since last step
+	int8_t		direction = 1;					// Step direction, for ping-pong
+	int16_t		dx = 0;							// Velocity, in 1/256ths of a pixel per frame
+	int16_t		dy = 0;
+	uint8_t		fractionX = 0;					// Sub-pixel position
+	uint8_t		fractionY = 0;
+	uint8_t		boundsMode = SPRITE_BOUNDS_NONE;
+	int16_t		boundsX1 = 0;					// Bounds for sprite movement
+	int16_t		boundsY1 = 0;
+	int16_t		boundsX2 = 0;
+	int16_t		boundsY2 = 0;
+};
+SpriteAnimation	spriteAnimations[MAX_SPRITES];
+std::bitset<MAX_SPRITES> animatedSprites;		// Sprites with active animation or motion
+uint32_t		spriteAnimationFrame = 0;		// Frame counter when sprites were last animated
+
+// Sprite collision detection
+uint8_t			spriteCollisionGroups[MAX_SPRITES];				// Collision groups each sprite belongs to
+uint8_t			collisionGroupTargets[SPRITE_COLLISION_GROUPS];	// Groups each collision group collides with
+uint8_t			spriteCollisionFlags = 0;
+uint16_t		spriteCollisionBufferId = 65535;
+std::weak_ptr<BufferStream>	spriteCollisionBlock;		// Block created to hold collision data, which may be rewritten in place
+
+// bitmap IDs used for each sprite's frames, in frame order
+std::vector<uint16_t, psram_allocator<uint16_t>> spriteFrameBitmaps[MAX_SPRITES];
+// track which sprites are using a bitmap
+std::unordered_map<uint16_t, std::bitset<MAX_SPRITES>> bitmapUsers;
+
+// Cached renderings of bitmaps with an affine transform applied
+struct TransformedBitmap {
+	uint16_t				bitmapId;
+	uint16_t				transformId;
+	uint32_t				bitmapGeneration;		// Data generations of the bitmap and transform buffers when rendered
+	uint32_t				transformGeneration;
+	std::weak_ptr<Bitmap>	source;			// Source bitmap, to detect replacement
+	const void *			matrix;			// Transform matrix data, to detect replacement
+	int						xOffset;		// Position of rendering relative to bitmap origin
+	int						yOffset;
+	std::unique_ptr<uint8_t[]>	data;
+	std::unique_ptr<Bitmap>		bitmap;
+};
+std::list<TransformedBitmap> transformedBitmaps;		// Most recently used first
+
+std::unordered_map<uint16_t, BitmapSpans> bitmapSpans;
 
 extern bool isVDPVariableSet(uint16_t flag);
 
@@ -32,8 +87,176 @@ std::shared_ptr<Bitmap> getBitmap(uint16_t id) {
 	return nullptr;
 }
 
+// Get the ID whose buffer data generation changes when a bitmap's pixels do
+// Views that share another bitmap's pixels use the ID of the bitmap that owns the data
+inline uint16_t getBitmapDataId(uint16_t bitmapId) {
+	auto sourceIter = bitmapDataSources.find(bitmapId);
+	return sourceIter != bitmapDataSources.end() ? sourceIter->second : bitmapId;
+}
+
+// Reduce a colour to RGBA2222 the same way the display does, but keep partially transparent pixels visible
+inline uint8_t packRGBA2222(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+	uint8_t alpha = a ? std::max(a >> 6, 1) : 0;
+	return (r >> 6) | ((g >> 6) << 2) | ((b >> 6) << 4) | (alpha << 6);
+}
+
+// Check whether a bitmap pixel is opaque
+inline bool isBitmapPixelSolid(Bitmap * bitmap, int x, int y) {
+	switch (bitmap->format) {
+		case PixelFormat::RGBA2222:
+			return bitmap->data[y * bitmap->width + x] & 0xC0;
+		case PixelFormat::RGBA8888:
+			return bitmap->data[(y * bitmap->width + x) * 4 + 3];
+		case PixelFormat::Mask:
+			return bitmap->data[y * ((bitmap->width + 7) / 8) + x / 8] & (0x80 >> (x & 7));
+		default:
+			return true;
+	}
+}
+
+void clearBitmapSpans(uint16_t bitmapId) {
+	auto spansIter = bitmapSpans.find(bitmapId);
+	if (spansIter != bitmapSpans.end()) {
+		if (spansIter->second.trimmed) {
+			// ensure no pending drawing operations are using the trimmed view
+			waitPlotCompletion();
+		}
+		bitmapSpans.erase(spansIter);
+	}
+}
+
+// Compute the opaque span encoding for a bitmap
+// Only formats with an alpha channel are encoded
+//
+void computeBitmapSpans(uint16_t bitmapId, Bitmap * bitmap) {
+	if (bitmap->format != PixelFormat::RGBA2222 && bitmap->format != PixelFormat::RGBA8888) {
+		return;
+	}
+	// any previous encoding may have a trimmed view that pending drawing is still using
+	clearBitmapSpans(bitmapId);
+	auto &spans = bitmapSpans[bitmapId];
+	spans.bitmap = bitmap;
+	spans.generation = getBufferDataGeneration(getBitmapDataId(bitmapId));
+	spans.firstRow = bitmap->height;
+	spans.lastRow = 0;
+	for (int y = 0; y < bitmap->height; y++) {
+		spans.rowStart.push_back(spans.runs.size());
+		int x = 0;
+		while (x < bitmap->width) {
+			int start = x;
+			while (x < bitmap->width && !isBitmapPixelSolid(bitmap, x, y)) {
+				x++;
+			}
+			if (x == bitmap->width) {
+				break;
+			}
+			spans.runs.push_back(x - start);
+			start = x;
+			while (x < bitmap->width && isBitmapPixelSolid(bitmap, x, y)) {
+				x++;
+			}
+			spans.runs.push_back(x - start);
+			spans.firstRow = std::min<int>(spans.firstRow, y);
+			spans.lastRow = y;
+		}
+	}
+	spans.rowStart.push_back(spans.runs.size());
+
+	// transparent rows at the top and bottom can be skipped with a view of the remaining rows
+	if (spans.firstRow <= spans.lastRow && (spans.firstRow > 0 || spans.lastRow < bitmap->height - 1)) {
+		auto bytesPerPixel = bitmap->format == PixelFormat::RGBA8888 ? 4 : 1;
+		spans.trimmed = make_unique_psram<Bitmap>(bitmap->width, spans.lastRow - spans.firstRow + 1, bitmap->data + spans.firstRow * bitmap->width * bytesPerPixel, bitmap->format);
+	}
+}
+
+// Get the opaque span encoding for a bitmap, if it has one
+// The encoding is recomputed first if the bitmap's pixels have changed since it was computed
+const BitmapSpans * getBitmapSpans(uint16_t bitmapId, Bitmap * bitmap) {
+	auto spansIter = bitmapSpans.find(bitmapId);
+	if (spansIter == bitmapSpans.end() || spansIter->second.bitmap != bitmap) {
+		return nullptr;
+	}
+	if (spansIter->second.generation != getBufferDataGeneration(getBitmapDataId(bitmapId))) {
+		computeBitmapSpans(bitmapId, bitmap);
+		spansIter = bitmapSpans.find(bitmapId);
+	}
+	return &spansIter->second;
+}
+
+void resetTransformedBitmaps() {
+	if (!transformedBitmaps.empty()) {
+		// ensure no pending drawing operations are using our renderings
+		waitPlotCompletion();
+		transformedBitmaps.clear();
+	}
+}
+
+// Get a rendering of a bitmap with a transform applied, from the cache if possible
+// Renderings are discarded when the data generation of their bitmap or transform buffer changes,
+// using the generation of the owning bitmap for views that share its pixels
+// Returns nullptr if the rendering is too large to cache, or could not be created
+//
+const TransformedBitmap * getTransformedBitmap(uint16_t bitmapId, const std::shared_ptr<Bitmap> &bitmap, uint16_t transformId, const float * transform, const float * inverse) {
+	auto bitmapGeneration = getBufferDataGeneration(getBitmapDataId(bitmapId));
+	auto transformGeneration = getBufferDataGeneration(transformId);
+	for (auto it = transformedBitmaps.begin(); it != transformedBitmaps.end(); ++it) {
+		if (it->bitmapId == bitmapId && it->transformId == transformId) {
+			if (it->bitmapGeneration == bitmapGeneration && it->transformGeneration == transformGeneration
+				&& it->matrix == transform && it->source.lock() == bitmap) {
+				// move to front, as most recently used
+				transformedBitmaps.splice(transformedBitmaps.begin(), transformedBitmaps, it);
+				return &transformedBitmaps.front();
+			}
+			// stale, so discard it
+			waitPlotCompletion();
+			transformedBitmaps.erase(it);
+			break;
+		}
+	}
+
+	// work out the bounding box of the transformed bitmap
+	float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+	const float corners[4][2] = { { 0.0f, 0.0f }, { (float)bitmap->width, 0.0f }, { (float)bitmap->width, (float)bitmap->height }, { 0.0f, (float)bitmap->height } };
+	for (auto &corner : corners) {
+		auto x = transform[0] * corner[0] + transform[1] * corner[1] + transform[2];
+		auto y = transform[3] * corner[0] + transform[4] * corner[1] + transform[5];
+		minX = std::min(minX, x);
+		minY = std::min(minY, y);
+		maxX = std::max(maxX, x);
+		maxY = std::max(maxY, y);
+	}
+	int xOffset = (int)floorf(minX);
+	int yOffset = (int)floorf(minY);
+	int width = (int)ceilf(maxX) - xOffset;
+	int height = (int)ceilf(maxY) - yOffset;
+	if (width <= 0 || height <= 0 || width * height > TRANSFORMED_BITMAP_MAX_PIXELS) {
+		return nullptr;
+	}
+
+	auto data = make_unique_psram_array<uint8_t>(width * height);
+	if (!data) {
+		return nullptr;
+	}
+	// renderings are only drawn, so transparent pixels can be skipped using the source's spans
+	transformBitmap(bitmap.get(), transform, inverse, (RGBA2222 *)data.get(), width, height, xOffset, yOffset, getBitmapSpans(bitmapId, bitmap.get()));
+	auto rendering = make_unique_psram<Bitmap>(width, height, data.get(), PixelFormat::RGBA2222);
+
+	if (transformedBitmaps.size() >= TRANSFORMED_BITMAP_CACHE_SIZE) {
+		waitPlotCompletion();
+		transformedBitmaps.pop_back();
+	}
+	transformedBitmaps.push_front({ bitmapId, transformId, bitmapGeneration, transformGeneration, bitmap, transform, xOffset, yOffset, std::move(data), std::move(rendering) });
+	return &transformedBitmaps.front();
+}
+
 void resetBitmaps() {
+	resetTransformedBitmaps();
+	if (!bitmapSpans.empty()) {
+		waitPlotCompletion();
+		bitmapSpans.clear();
+	}
 	bitmaps.clear();
+	bitmapDataSources.clear();
 	// this will only be used after resetting sprites, so we can clear the bitmapUsers list
 	bitmapUsers.clear();
 }
@@ -50,35 +273,46 @@ inline uint8_t getCurrentSprite() {
 	return current_sprite;
 }
 
+void removeBitmapUser(uint16_t bitmapId, uint8_t s) {
+	auto usersIter = bitmapUsers.find(bitmapId);
+	if (usersIter != bitmapUsers.end()) {
+		usersIter->second.reset(s);
+		if (usersIter->second.none()) {
+			bitmapUsers.erase(usersIter);
+		}
+	}
+}
+
 void clearSpriteFrames(uint8_t s = current_sprite) {
 	auto sprite = getSprite(s);
 	sprite->visible = false;
 	sprite->setFrame(0);
 	sprite->clearBitmaps();
-	// find all bitmaps used by this sprite and remove it from the list
-	for (auto bitmapUser : bitmapUsers) {
-		auto users = bitmapUser.second;
-		// remove all instances of this sprite from the users list
-		auto it = std::find(users.begin(), users.end(), s);
-		while (it != users.end()) {
-			users.erase(it);
-			it = std::find(users.begin(), users.end(), s);
-		}
+	// remove this sprite from the users of all bitmaps its frames used
+	for (auto bitmapId : spriteFrameBitmaps[s]) {
+		removeBitmapUser(bitmapId, s);
 	}
+	spriteFrameBitmaps[s].clear();
 }
 
 void clearBitmap(uint16_t b) {
+	bitmapDataSources.erase(b);
 	if (bitmaps.find(b) == bitmaps.end()) {
 		return;
 	}
 	bitmaps.erase(b);
+	clearBitmapSpans(b);
 
 	// find all sprites that had used this bitmap and clear their frames
-	if (bitmapUsers.find(b) != bitmapUsers.end()) {
-		auto users = bitmapUsers[b];
-		for (auto user : users) {
-			debug_log("clearBitmap: sprite %d can no longer use bitmap %d, so clearing sprite frames\n\r", user, b);
-			clearSpriteFrames(user);
+	auto usersIter = bitmapUsers.find(b);
+	if (usersIter != bitmapUsers.end()) {
+		// clearing sprite frames will update the users list, so work from a copy
+		auto users = usersIter->second;
+		for (auto user = 0; user < MAX_SPRITES; user++) {
+			if (users.test(user)) {
+				debug_log("clearBitmap: sprite %d can no longer use bitmap %d, so clearing sprite frames\n\r", user, b);
+				clearSpriteFrames(user);
+			}
 		}
 		bitmapUsers.erase(b);
 	}
@@ -95,13 +329,35 @@ void addSpriteFrame(uint16_t bitmapId) {
 		debug_log("addSpriteFrame: bitmap %d is in native or unknown format and cannot be used as a sprite frame\n\r", bitmapId);
 		return;
 	}
-	bitmapUsers[bitmapId].push_back(current_sprite);
+	bitmapUsers[bitmapId].set(current_sprite);
+	spriteFrameBitmaps[current_sprite].push_back(bitmapId);
 	sprite->addBitmap(bitmap.get());
 	if (bitmap->format == PixelFormat::Mask) {
 		sprite->hardware = 0;
 	}
 }
 
+// Point all sprite frames that use a bitmap ID at a new bitmap object
+void updateSpriteFrameBitmaps(uint16_t bitmapId, Bitmap * bitmap) {
+	auto usersIter = bitmapUsers.find(bitmapId);
+	if (usersIter == bitmapUsers.end()) {
+		return;
+	}
+	waitPlotCompletion();
+	for (auto s = 0; s < MAX_SPRITES; s++) {
+		if (!usersIter->second.test(s)) {
+			continue;
+		}
+		auto sprite = getSprite(s);
+		auto &frameBitmaps = spriteFrameBitmaps[s];
+		for (auto frame = 0; frame < frameBitmaps.size() && frame < sprite->framesCount; frame++) {
+			if (frameBitmaps[frame] == bitmapId) {
+				sprite->frames[frame] = bitmap;
+			}
+		}
+	}
+}
+
 void replaceSpriteFrame(uint16_t bitmapId) {
 	auto sprite = getSprite();
 	auto bitmap = getBitmap(bitmapId);
@@ -114,32 +370,20 @@ void replaceSpriteFrame(uint16_t bitmapId) {
 		return;
 	}
 
-	// remove one instance of current_sprite from the bitmapUsers list for the shown frame
-	// first step is to work out the bitmap ID of the current frame
-	auto frameBitmap = sprite->frames[sprite->currentFrame];
-	auto oldBitmapId = -1;
-	for (auto bitmap : bitmaps) {
-		if (bitmap.second.get() == frameBitmap) {
-			oldBitmapId = bitmap.first;
-			break;
-		}
-	}
-
-	// if we found the old bitmap, remove one entry of the sprite from the bitmapUsers list
-	if (oldBitmapId != -1) {
-		auto users = bitmapUsers[oldBitmapId];
-		for (auto user : users) {
-			// remove only one copy of current_sprite from the users list, if it exists
-			auto it = std::find(users.begin(), users.end(), current_sprite);
-			if (it != users.end()) {
-				users.erase(it);
-				break;
-			}
-		}
+	auto &frameBitmaps = spriteFrameBitmaps[current_sprite];
+	if (sprite->currentFrame >= frameBitmaps.size()) {
+		debug_log("replaceSpriteFrame: sprite %d has no frame %d\n\r", current_sprite, sprite->currentFrame);
+		return;
 	}
 
+	// swap in the new bitmap, and stop tracking the old one if no other frames of this sprite use it
+	auto oldBitmapId = frameBitmaps[sprite->currentFrame];
+	frameBitmaps[sprite->currentFrame] = bitmapId;
 	sprite->frames[sprite->currentFrame] = bitmap.get();
-	bitmapUsers[bitmapId].push_back(current_sprite);
+	bitmapUsers[bitmapId].set(current_sprite);
+	if (std::find(frameBitmaps.begin(), frameBitmaps.end(), oldBitmapId) == frameBitmaps.end()) {
+		removeBitmapUser(oldBitmapId, current_sprite);
+	}
 
 	if (bitmap->format == PixelFormat::Mask) {
 		sprite->hardware = 0;
@@ -231,6 +475,328 @@ void hideAllSprites() {
 	refreshSprites();
 }
 
+void stopSpriteAnimation(uint8_t s = current_sprite) {
+	spriteAnimations[s] = SpriteAnimation();
+	animatedSprites.reset(s);
+}
+
+inline void updateSpriteAnimated(uint8_t s) {
+	auto &animation = spriteAnimations[s];
+	auto frameAnimated = (animation.mode & SPRITE_ANIMATE_MODE_MASK) != SPRITE_ANIMATE_NONE && animation.frameDelay;
+	animatedSprites.set(s, frameAnimated || animation.dx || animation.dy);
+}
+
+void setSpriteAnimation(uint8_t firstFrame, uint8_t lastFrame, uint8_t frameDelay, uint8_t mode) {
+	auto &animation = spriteAnimations[current_sprite];
+	animation.mode = mode;
+	animation.firstFrame = std::min(firstFrame, lastFrame);
+	animation.lastFrame = std::max(firstFrame, lastFrame);
+	animation.frameDelay = frameDelay;
+	animation.frameCount = 0;
+	animation.direction = 1;
+	updateSpriteAnimated(current_sprite);
+}
+
+void setSpriteVelocity(int16_t dx, int16_t dy) {
+	auto &animation = spriteAnimations[current_sprite];
+	animation.dx = dx;
+	animation.dy = dy;
+	animation.fractionX = 0;
+	animation.fractionY = 0;
+	updateSpriteAnimated(current_sprite);
+}
+
+void setSpriteBounds(uint8_t mode, int16_t x1, int16_t y1, int16_t x2, int16_t y2) {
+	auto &animation = spriteAnimations[current_sprite];
+	animation.boundsMode = mode;
+	animation.boundsX1 = std::min(x1, x2);
+	animation.boundsY1 = std::min(y1, y2);
+	animation.boundsX2 = std::max(x1, x2);
+	animation.boundsY2 = std::max(y1, y2);
+}
+
+// Step a sprite on to its next animation frame
+// Returns true if the sprite changed
+//
+bool stepSpriteFrame(Sprite * sprite, SpriteAnimation &animation) {
+	if (++animation.frameCount < animation.frameDelay) {
+		return false;
+	}
+	animation.frameCount = 0;
+	int last = std::min<int>(animation.lastFrame, sprite->framesCount - 1);
+	int first = std::min<int>(animation.firstFrame, last);
+	int frame = sprite->currentFrame;
+	if (frame < first || frame > last) {
+		sprite->setFrame(first);
+		return true;
+	}
+	switch (animation.mode & SPRITE_ANIMATE_MODE_MASK) {
+		case SPRITE_ANIMATE_LOOP:
+			frame = (frame >= last) ? first : frame + 1;
+			break;
+		case SPRITE_ANIMATE_PINGPONG:
+			if (first == last) {
+				return false;
+			}
+			if (frame + animation.direction < first || frame + animation.direction > last) {
+				animation.direction = -animation.direction;
+			}
+			frame += animation.direction;
+			break;
+		case SPRITE_ANIMATE_ONCE:
+			if (frame >= last) {
+				// animation is complete
+				animation.frameDelay = 0;
+				if (animation.mode & SPRITE_ANIMATE_HIDE) {
+					sprite->visible = 0;
+					return true;
+				}
+				return false;
+			}
+			frame++;
+			break;
+		default:
+			return false;
+	}
+	sprite->setFrame(frame);
+	return true;
+}
+
+// Move one axis of a sprite by its velocity, applying bounds
+// Returns the new position
+//
+int moveSpriteAxis(int position, int16_t &velocity, uint8_t &fraction, int size, uint8_t boundsMode, int low, int high) {
+	int32_t fixed = position * 256 + fraction + velocity;
+	position = fixed >> 8;
+	fraction = fixed & 0xFF;
+	switch (boundsMode) {
+		case SPRITE_BOUNDS_STOP:
+			if (position < low || position + size > high) {
+				position = std::max(low, std::min(position, high - size));
+				velocity = 0;
+				fraction = 0;
+			}
+			break;
+		case SPRITE_BOUNDS_WRAP: {
+			// wrap once the sprite has completely left the bounds
+			int range = high - low + size;
+			if (position >= high) {
+				position -= range;
+			} else if (position + size <= low) {
+				position += range;
+			}
+		}	break;
+		case SPRITE_BOUNDS_BOUNCE:
+			if (position < low) {
+				position = low + (low - position);
+				velocity = -velocity;
+			} else if (position + size > high) {
+				position = (high - size) - (position + size - high);
+				velocity = -velocity;
+			}
+			break;
+	}
+	return position;
+}
+
+// Advance sprite animations and motion by however many frames have passed
+// Returns true if any sprite changed, and so sprites need refreshing
+//
+bool animateSprites(uint32_t frameCounter) {
+	auto frames = frameCounter - spriteAnimationFrame;
+	spriteAnimationFrame = frameCounter;
+	if (animatedSprites.none() || frames == 0) {
+		return false;
+	}
+	// don't try to catch up on a long stall
+	frames = std::min<uint32_t>(frames, 4);
+	bool changed = false;
+	for (auto n = 0; n < MAX_SPRITES; n++) {
+		if (!animatedSprites.test(n)) {
+			continue;
+		}
+		auto sprite = getSprite(n);
+		auto &animation = spriteAnimations[n];
+		if (sprite->framesCount == 0) {
+			continue;
+		}
+		for (uint32_t f = 0; f < frames; f++) {
+			if ((animation.mode & SPRITE_ANIMATE_MODE_MASK) != SPRITE_ANIMATE_NONE && animation.frameDelay) {
+				changed |= stepSpriteFrame(sprite, animation);
+			}
+			if (animation.dx || animation.dy) {
+				auto bitmap = sprite->frames[sprite->currentFrame];
+				auto x = moveSpriteAxis(sprite->x, animation.dx, animation.fractionX, bitmap->width, animation.boundsMode, animation.boundsX1, animation.boundsX2);
+				auto y = moveSpriteAxis(sprite->y, animation.dy, animation.fractionY, bitmap->height, animation.boundsMode, animation.boundsY1, animation.boundsY2);
+				if (x != sprite->x || y != sprite->y) {
+					sprite->moveTo(x, y);
+					changed = true;
+				}
+			}
+		}
+		updateSpriteAnimated(n);
+	}
+	return changed && numsprites;
+}
+
+void setSpriteCollisionGroups(uint8_t groups) {
+	spriteCollisionGroups[current_sprite] = groups;
+}
+
+// Set the groups a collision group collides with
+// Collisions are symmetrical, so the target groups will also collide with this group
+//
+void setCollisionGroupTargets(uint8_t group, uint8_t targets) {
+	if (group >= SPRITE_COLLISION_GROUPS) {
+		return;
+	}
+	for (auto n = 0; n < SPRITE_COLLISION_GROUPS; n++) {
+		if (targets & (1 << n)) {
+			collisionGroupTargets[n] |= (1 << group);
+		} else {
+			collisionGroupTargets[n] &= ~(1 << group);
+		}
+	}
+	collisionGroupTargets[group] = targets;
+}
+
+void resetSpriteCollisions() {
+	memset(spriteCollisionGroups, 0, sizeof spriteCollisionGroups);
+	memset(collisionGroupTargets, 0, sizeof collisionGroupTargets);
+	spriteCollisionFlags = 0;
+	spriteCollisionBufferId = 65535;
+	spriteCollisionBlock.reset();
+}
+
+// Get the opaque spans for a sprite's current frame, if it has them
+const BitmapSpans * getSpriteFrameSpans(uint8_t s) {
+	auto sprite = getSprite(s);
+	auto &frameBitmaps = spriteFrameBitmaps[s];
+	if (sprite->currentFrame >= frameBitmaps.size()) {
+		return nullptr;
+	}
+	return getBitmapSpans(frameBitmaps[sprite->currentFrame], sprite->frames[sprite->currentFrame]);
+}
+
+// Check whether the opaque runs of two bitmap rows overlap, given the screen x position of each row
+bool spanRowsOverlap(const BitmapSpans * a, int rowA, int xA, const BitmapSpans * b, int rowB, int xB) {
+	auto runA = a->rowStart[rowA];
+	auto endA = a->rowStart[rowA + 1];
+	auto runB = b->rowStart[rowB];
+	auto endB = b->rowStart[rowB + 1];
+	int startA = 0, stopA = 0, startB = 0, stopB = 0;
+	auto nextA = [&]() {
+		if (runA >= endA) {
+			return false;
+		}
+		startA = xA + a->runs[runA];
+		stopA = startA + a->runs[runA + 1];
+		xA = stopA;
+		runA += 2;
+		return true;
+	};
+	auto nextB = [&]() {
+		if (runB >= endB) {
+			return false;
+		}
+		startB = xB + b->runs[runB];
+		stopB = startB + b->runs[runB + 1];
+		xB = stopB;
+		runB += 2;
+		return true;
+	};
+	if (!nextA() || !nextB()) {
+		return false;
+	}
+	while (true) {
+		if (startA < stopB && startB < stopA) {
+			return true;
+		}
+		if (stopA <= stopB ? !nextA() : !nextB()) {
+			return false;
+		}
+	}
+}
+
+// Check the overlapping area of two sprites for a pair of opaque pixels
+bool spritePixelsCollide(uint8_t spriteA, uint8_t spriteB) {
+	auto a = getSprite(spriteA);
+	auto b = getSprite(spriteB);
+	auto bitmapA = a->frames[a->currentFrame];
+	auto bitmapB = b->frames[b->currentFrame];
+	int x1 = std::max<int>(a->x, b->x);
+	int y1 = std::max<int>(a->y, b->y);
+	int x2 = std::min<int>(a->x + bitmapA->width, b->x + bitmapB->width);
+	int y2 = std::min<int>(a->y + bitmapA->height, b->y + bitmapB->height);
+
+	auto spansA = getSpriteFrameSpans(spriteA);
+	auto spansB = getSpriteFrameSpans(spriteB);
+	if (spansA && spansB) {
+		for (int y = y1; y < y2; y++) {
+			if (spanRowsOverlap(spansA, y - a->y, a->x, spansB, y - b->y, b->x)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	for (int y = y1; y < y2; y++) {
+		for (int x = x1; x < x2; x++) {
+			if (isBitmapPixelSolid(bitmapA, x - a->x, y - a->y) && isBitmapPixelSolid(bitmapB, x - b->x, y - b->y)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Find all pairs of colliding sprites, according to their collision groups
+// Candidates are sorted by left edge, and then swept, so only sprites that overlap horizontally are compared
+//
+void detectSpriteCollisions(std::vector<std::pair<uint8_t, uint8_t>> &collisions) {
+	struct Candidate {
+		uint8_t		sprite;
+		int			x1, y1, x2, y2;
+	};
+	std::vector<Candidate> candidates;
+	for (auto n = 0; n < numsprites; n++) {
+		auto sprite = getSprite(n);
+		if (!spriteCollisionGroups[n] || !sprite->visible || sprite->framesCount == 0) {
+			continue;
+		}
+		auto bitmap = sprite->frames[sprite->currentFrame];
+		candidates.push_back({ (uint8_t)n, sprite->x, sprite->y, sprite->x + bitmap->width, sprite->y + bitmap->height });
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+		return a.x1 < b.x1;
+	});
+
+	bool pixelCheck = spriteCollisionFlags & SPRITE_COLLISION_PIXEL;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		auto &a = candidates[i];
+		// groups that sprite a collides with
+		uint8_t targets = 0;
+		for (auto group = 0; group < SPRITE_COLLISION_GROUPS; group++) {
+			if (spriteCollisionGroups[a.sprite] & (1 << group)) {
+				targets |= collisionGroupTargets[group];
+			}
+		}
+		if (!targets) {
+			continue;
+		}
+		for (size_t j = i + 1; j < candidates.size() && candidates[j].x1 < a.x2; j++) {
+			auto &b = candidates[j];
+			if (!(spriteCollisionGroups[b.sprite] & targets) || b.y1 >= a.y2 || a.y1 >= b.y2) {
+				continue;
+			}
+			if (pixelCheck && !spritePixelsCollide(a.sprite, b.sprite)) {
+				continue;
+			}
+			collisions.push_back(std::minmax(a.sprite, b.sprite));
+		}
+	}
+}
+
 void resetSprites() {
 	waitPlotCompletion();
 	hideAllSprites();
@@ -239,7 +805,9 @@ void resetSprites() {
 		auto sprite = getSprite(n);
 		sprite->hardware = autoHardwareSprites ? 1 : 0;
 		clearSpriteFrames(n);
+		stopSpriteAnimation(n);
 	}
+	resetSpriteCollisions();
 	activateSprites(0);
 	setCurrentSprite(0);
 }
@@ -7,6 +7,7 @@
 #ifndef VDU_AUDIO_H
 #define VDU_AUDIO_H
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <unordered_map>
@@ -136,6 +137,26 @@ void VDUStreamProcessor::vdu_sys_audio() {
 					sendAudioStatus(channel, setSampleRepeatLength(bufferId, repeatLength));
 				}	break;
 
+				case AUDIO_SAMPLE_STREAM_CREATE: {
+					auto bufferId = readWord_t();	if (bufferId == -1) return;
+					auto format = readByte_t();		if (format == -1) return;
+					uint32_t sampleRate = AUDIO_DEFAULT_SAMPLE_RATE;
+					if (format & AUDIO_FORMAT_WITH_RATE) {
+						sampleRate = readWord_t();	if (sampleRate == -1) return;
+					}
+					auto capacity = read24_t();		if (capacity == -1) return;
+					auto lowWater = read24_t();		if (lowWater == -1) return;
+
+					sendAudioStatus(channel, createSampleStream(bufferId, format, sampleRate, capacity, lowWater));
+				}	break;
+
+				case AUDIO_SAMPLE_STREAM_WRITE: {
+					auto bufferId = readWord_t();	if (bufferId == -1) return;
+					auto length = read24_t();		if (length == -1) return;
+
+					sendAudioStatus(channel, writeSampleStream(bufferId, length));
+				}	break;
+
 				case AUDIO_SAMPLE_DEBUG_INFO: {
 					auto bufferId = readWord_t();	if (bufferId == -1) return;
 					debug_log("Sample info: %d\n\r", bufferId);
@@ -227,6 +248,18 @@ void VDUStreamProcessor::vdu_sys_audio() {
 
 			sendAudioStatus(channel, setParameter(channel, param, value));
 		}	break;
+
+		case AUDIO_CMD_SEQUENCER: {
+			auto action = readByte_t();		if (action == -1) return;
+
+			sendAudioStatus(channel, sequencerCommand(channel, action));
+		}	break;
+
+		case AUDIO_CMD_QUEUE: {
+			auto action = readByte_t();		if (action == -1) return;
+
+			sendAudioStatus(channel, queueCommand(channel, action));
+		}	break;
 	}
 }
 
@@ -265,6 +298,21 @@ uint8_t VDUStreamProcessor::createSampleFromBuffer(uint16_t bufferId, uint8_t fo
 		return 0;
 	}
 	clearSample(bufferId);
+	auto &buffer = buffers[bufferId];
+	auto dataFormat = format & AUDIO_FORMAT_DATA_MASK;
+	if (buffer.size() > 1 && (dataFormat == AUDIO_FORMAT_8BIT_SIGNED || dataFormat == AUDIO_FORMAT_ADPCM)) {
+		// signed and ADPCM data can be played as it is, so consolidate the buffer itself, as BUFFERED_CONSOLIDATE does,
+		// rather than have the sample hold a second copy of the data
+		// ADPCM must be held in one block whatever its size, as it is decoded as it plays
+		uint32_t size = 0;
+		for (auto &block : buffer) {
+			size += block->size();
+		}
+		if (size <= AUDIO_SAMPLE_CONTIGUOUS_MAX || dataFormat == AUDIO_FORMAT_ADPCM) {
+			bufferConsolidate(bufferId);
+			bufferBlocksChanged(bufferId);
+		}
+	}
 	auto sample = (format & AUDIO_FORMAT_WITH_RATE) ?
 		std::make_shared<AudioSample>(buffers[bufferId], format & AUDIO_FORMAT_DATA_MASK, sampleRate)
 		: std::make_shared<AudioSample>(buffers[bufferId], format & AUDIO_FORMAT_DATA_MASK);
@@ -278,6 +326,107 @@ uint8_t VDUStreamProcessor::createSampleFromBuffer(uint16_t bufferId, uint8_t fo
 	return 0;
 }
 
+// Create a streaming sample, which plays from a ring buffer that is filled as it plays
+// lowWater is the level at which the host is asked for more data, with zero meaning half the capacity
+// The ring is held only by the sample, never in buffers, so buffer commands can't move or reuse it under the mixer
+// Any buffer with this ID is cleared, clearing the buffer stops the stream, and buffered writes to it feed the stream
+//
+uint8_t VDUStreamProcessor::createSampleStream(uint16_t bufferId, uint8_t format, uint16_t sampleRate, uint32_t capacity, uint32_t lowWater) {
+	if (bufferId == 65535) {
+		debug_log("vdu_sys_audio: stream %d is reserved\n\r", bufferId);
+		return 0;
+	}
+	if (capacity == 0) {
+		debug_log("vdu_sys_audio: stream %d needs a capacity\n\r", bufferId);
+		return 0;
+	}
+	if ((format & AUDIO_FORMAT_DATA_MASK) == AUDIO_FORMAT_ADPCM) {
+		debug_log("vdu_sys_audio: stream %d cannot use ADPCM\n\r", bufferId);
+		return 0;
+	}
+	bufferClear(bufferId);
+	auto ring = make_shared_psram<BufferStream>(capacity);
+	if (!ring || !ring->getBuffer()) {
+		debug_log("vdu_sys_audio: not enough memory for stream %d\n\r", bufferId);
+		return 0;
+	}
+	auto sample = (format & AUDIO_FORMAT_WITH_RATE) ?
+		std::make_shared<AudioSample>(BufferVector(), format & AUDIO_FORMAT_DATA_MASK, sampleRate)
+		: std::make_shared<AudioSample>(BufferVector(), format & AUDIO_FORMAT_DATA_MASK);
+	if (sample) {
+		if (format & AUDIO_FORMAT_TUNEABLE) {
+			sample->baseFrequency = AUDIO_DEFAULT_FREQUENCY;
+		}
+		sample->stream = std::make_shared<AudioStream>(ring, lowWater);
+		samples[bufferId] = sample;
+		return 1;
+	}
+	return 0;
+}
+
+// Write data from the host into a streaming sample, returning 1 if it was all accepted
+// Data that doesn't fit in the stream is dropped, in which case this returns 0
+// and the stream reports an overrun along with its free space
+//
+uint8_t VDUStreamProcessor::writeSampleStream(uint16_t bufferId, uint32_t length) {
+	auto sample = samples.find(bufferId) != samples.end() ? samples[bufferId] : nullptr;
+	if (!sample || !sample->stream) {
+		debug_log("vdu_sys_audio: stream %d not found\n\r", bufferId);
+		discardBytes(length);
+		return 0;
+	}
+	uint32_t accepted = 0;
+	return readIntoSampleStream(*sample, length, accepted) == 0 && accepted == length ? 1 : 0;
+}
+
+// Read data from the host into a streaming sample, returning the number of bytes not received before timing out
+// accepted is set to the number of bytes the stream took, as data that doesn't fit is dropped
+//
+uint32_t VDUStreamProcessor::readIntoSampleStream(AudioSample & sample, uint32_t length, uint32_t & accepted) {
+	auto isUnsigned = sample.format == AUDIO_FORMAT_8BIT_UNSIGNED;
+	uint8_t data[64];
+	accepted = 0;
+	for (auto remaining = length; remaining > 0; ) {
+		auto size = std::min<uint32_t>(remaining, sizeof data);
+		auto unread = readIntoBuffer(data, size);
+		if (unread != 0) {
+			debug_log("vdu_sys_audio: timed out writing to stream (%d bytes remaining)\n\r", remaining - size + unread);
+			return remaining - size + unread;
+		}
+		accepted += sample.stream->write(data, size, isUnsigned);
+		remaining -= size;
+	}
+	return 0;
+}
+
+// Tell the host about streams that are running low on data, or have run out
+// Packets hold the stream's buffer ID, its AUDIO_STREAM_* status flags, and its free space as a 24-bit value
+//
+void VDUStreamProcessor::reportAudioStreams() {
+	audioStreamsNeedReport = false;
+	for (auto &samplePair : samples) {
+		auto &sample = samplePair.second;
+		if (!sample || !sample->stream) {
+			continue;
+		}
+		auto status = sample->stream->takeStatus();
+		if (!status) {
+			continue;
+		}
+		auto free = sample->stream->getFree();
+		uint8_t packet[] = {
+			(uint8_t)(samplePair.first & 0xFF),
+			(uint8_t)(samplePair.first >> 8),
+			status,
+			(uint8_t)(free & 0xFF),
+			(uint8_t)((free >> 8) & 0xFF),
+			(uint8_t)((free >> 16) & 0xFF),
+		};
+		bufferCallCallbacks(CALLBACK_SENDING_VDPP | PACKET_AUDIO_STREAM);
+		send_packet(PACKET_AUDIO_STREAM, sizeof packet, packet);
+	}
+}
+
 // Set channel volume envelope
 //
 uint8_t VDUStreamProcessor::setVolumeEnvelope(uint8_t channel, uint8_t type) {
@@ -394,4 +543,90 @@ uint8_t VDUStreamProcessor::setParameter(uint8_t channel, uint8_t parameter, uin
 	return 0;
 }
 
+// Control the pattern sequencer
+// The channel is the first of the channels used by the song's tracks
+//
+uint8_t VDUStreamProcessor::sequencerCommand(uint8_t channel, uint8_t action) {
+	switch (action) {
+		case AUDIO_SEQUENCER_LOAD: {
+			auto instrumentsId = readWord_t();	if (instrumentsId == -1) return 0;
+			auto patternsId = readWord_t();		if (patternsId == -1) return 0;
+			auto orderId = readWord_t();		if (orderId == -1) return 0;
+			auto tracks = readByte_t();			if (tracks == -1) return 0;
+			auto rows = readByte_t();			if (rows == -1) return 0;
+			auto rowLength = readWord_t();		if (rowLength == -1) return 0;
+
+			auto getBuffer = [](uint16_t bufferId) -> std::shared_ptr<BufferStream> {
+				if (buffers.find(bufferId) == buffers.end()) {
+					debug_log("vdu_sys_audio: buffer %d not found\n\r", bufferId);
+					return nullptr;
+				}
+				return consolidateBuffers(buffers[bufferId]);
+			};
+			if (!audioSequencer->load(channel, tracks, rows, rowLength, getBuffer(instrumentsId), getBuffer(patternsId), getBuffer(orderId))) {
+				return 0;
+			}
+			// now the song is known to be valid, make sure every track has a channel to play on
+			for (auto track = 0; track < tracks; track++) {
+				enableChannel(channel + track);
+			}
+			return 1;
+		}
+
+		case AUDIO_SEQUENCER_START:
+			return audioSequencer->start();
+
+		case AUDIO_SEQUENCER_STOP:
+			return audioSequencer->stop();
+
+		case AUDIO_SEQUENCER_TEMPO: {
+			auto rowLength = readWord_t();		if (rowLength == -1) return 0;
+			return audioSequencer->setRowLength(rowLength);
+		}
+
+		case AUDIO_SEQUENCER_JUMP: {
+			auto position = readWord_t();		if (position == -1) return 0;
+			auto row = readByte_t();			if (row == -1) return 0;
+			return audioSequencer->jump(position, row);
+		}
+	}
+	debug_log("vdu_sys_audio: unknown sequencer action %d\n\r", action);
+	return 0;
+}
+
+// Queue timed notes and changes for a channel
+// Times are 24-bit values, in milliseconds since the queue's clock was last reset
+//
+uint8_t VDUStreamProcessor::queueCommand(uint8_t channel, uint8_t action) {
+	switch (action) {
+		case AUDIO_QUEUE_RESET_CLOCK:
+			return resetAudioQueueClock();
+
+		case AUDIO_QUEUE_CLEAR:
+			return clearAudioQueue();
+
+		case AUDIO_QUEUE_PLAY: {
+			auto time = read24_t();				if (time == -1) return 0;
+			auto volume = readByte_t();			if (volume == -1) return 0;
+			auto frequency = readWord_t();		if (frequency == -1) return 0;
+			auto duration = readWord_t();		if (duration == -1) return 0;
+			return queueAudioEvent(time, { channel, AUDIO_QUEUE_PLAY, (uint8_t)volume, (uint16_t)frequency, (uint16_t)duration });
+		}
+
+		case AUDIO_QUEUE_VOLUME: {
+			auto time = read24_t();				if (time == -1) return 0;
+			auto volume = readByte_t();			if (volume == -1) return 0;
+			return queueAudioEvent(time, { channel, AUDIO_QUEUE_VOLUME, (uint8_t)volume, 0, 0 });
+		}
+
+		case AUDIO_QUEUE_FREQUENCY: {
+			auto time = read24_t();				if (time == -1) return 0;
+			auto frequency = readWord_t();		if (frequency == -1) return 0;
+			return queueAudioEvent(time, { channel, AUDIO_QUEUE_FREQUENCY, 0, (uint16_t)frequency, 0 });
+		}
+	}
+	debug_log("vdu_sys_audio: unknown queue action %d\n\r", action);
+	return 0;
+}
+
 #endif // VDU_AUDIO_H
@@ -13,6 +13,7 @@
 #include "agon.h"
 #include "agon_ps2.h"
 #include "agon_fonts.h"
+#include "bitmap_transform.h"
 #include "buffers.h"
 #include "buffer_stream.h"
 #include "compression.h"
@@ -28,6 +29,39 @@
 void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 	auto bufferId = readWord_t(); if (bufferId == -1) return;
 	auto command = readByte_t(); if (command == -1) return;
+	// commands change the buffer they are given, with 65535 being the running buffer
+	uint16_t changedId = bufferId == 65535 && id != 65535 ? id : bufferId;
+
+	switch (command) {
+		// commands that don't change buffers
+		case BUFFERED_CALL:
+		case BUFFERED_SET_OUTPUT:
+		case BUFFERED_COND_CALL:
+		case BUFFERED_JUMP:
+		case BUFFERED_COND_JUMP:
+		case BUFFERED_OFFSET_JUMP:
+		case BUFFERED_OFFSET_COND_JUMP:
+		case BUFFERED_OFFSET_CALL:
+		case BUFFERED_OFFSET_COND_CALL:
+		case BUFFERED_REPEAT_CALL:
+		case BUFFERED_SET_COUNTER:
+		case BUFFERED_DJNZ:
+		case BUFFERED_OFFSET_DJNZ:
+		case BUFFERED_ADD_CALLBACK:
+		case BUFFERED_REMOVE_CALLBACK:
+		case BUFFERED_ADD_TIMER_CALLBACK:
+		case BUFFERED_REMOVE_TIMER_CALLBACK:
+		case BUFFERED_DEBUG_INFO:
+			break;
+		case BUFFERED_ADJUST:
+			// contents may change, but blocks remain the same
+			bufferDataChanged(changedId);
+			break;
+		default:
+			// invalidate anything holding on to buffer blocks or contents, such as compiled conditions
+			bufferBlocksChanged(changedId);
+			break;
+	}
 
 	switch (command) {
 		case BUFFERED_WRITE: {
@@ -100,6 +134,37 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 				bufferCall(bufferId, offset);
 			}
 		}	break;
+		case BUFFERED_REPEAT_CALL: {
+			// VDU 23, 0, &A0, bufferId; &1B, count; : Call buffer count times
+			auto count = readWord_t(); if (count == -1) return;
+			bufferCall(bufferId, {}, count);
+		}	break;
+		case BUFFERED_SET_COUNTER: {
+			// VDU 23, 0, &A0, bufferId; &1C, counter, value; : Set loop counter (bufferId is ignored)
+			auto counter = readByte_t(); if (counter == -1) return;
+			auto value = readWord_t(); if (value == -1) return;
+			if (counter >= BUFFERED_LOOP_COUNTERS) {
+				debug_log("vdu_sys_buffered: invalid loop counter %d\n\r", counter);
+				return;
+			}
+			loopCounters[counter] = value;
+		}	break;
+		case BUFFERED_DJNZ: {
+			// VDU 23, 0, &A0, bufferId; &1D, counter : Decrement loop counter, and jump to buffer if not zero
+			// a bufferId of 65535 (-1) jumps to the start of the current buffer
+			auto counter = readByte_t(); if (counter == -1) return;
+			if (bufferDecrementCounter(counter)) {
+				bufferJump(bufferId, {});
+			}
+		}	break;
+		case BUFFERED_OFFSET_DJNZ: {
+			// VDU 23, 0, &A0, bufferId; &1E, counter, offset; offsetHighByte : Decrement loop counter, and jump to buffer with offset if not zero
+			auto counter = readByte_t(); if (counter == -1) return;
+			auto offset = getOffsetFromStream(true); if (offset.blockOffset == -1) return;
+			if (bufferDecrementCounter(counter)) {
+				bufferJump(bufferId, offset);
+			}
+		}	break;
 		case BUFFERED_COPY: {
 			// read list of source buffer IDs
 			auto sourceBufferIds = getBufferIdsFromStream();
@@ -237,13 +302,23 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 		case BUFFERED_COMPRESS: {
 			auto sourceBufferId = readWord_t();
 			if (sourceBufferId == -1) return;
-			bufferCompress(bufferId, sourceBufferId);
+			bufferCompress(bufferId, sourceBufferId, COMPRESSION_TYPE_TURBO);
 		}	break;
 		case BUFFERED_DECOMPRESS: {
 			auto sourceBufferId = readWord_t();
 			if (sourceBufferId == -1) return;
 			bufferDecompress(bufferId, sourceBufferId);
 		}	break;
+		case BUFFERED_COMPRESS_TYPE: {
+			auto type = readByte_t(); if (type == -1) return;
+			auto sourceBufferId = readWord_t();
+			if (sourceBufferId == -1) return;
+			bufferCompress(bufferId, sourceBufferId, type);
+		}	break;
+		case BUFFERED_WRITE_DECOMPRESS: {
+			auto length = readWord_t(); if (length == -1) return;
+			bufferWriteDecompress(bufferId, length);
+		}	break;
 		case BUFFERED_EXPAND_BITMAP: {
 			auto options = readByte_t(); if (options == -1) return;
 			auto sourceBufferId = readWord_t();
@@ -258,6 +333,14 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 			auto type = readWord_t(); if (type == -1) return;
 			bufferRemoveCallback(bufferId, type);
 		}	break;
+		case BUFFERED_ADD_TIMER_CALLBACK: {
+			auto flags = readByte_t(); if (flags == -1) return;
+			auto interval = readWord_t(); if (interval == -1) return;
+			bufferAddTimerCallback(bufferId, flags, interval);
+		}	break;
+		case BUFFERED_REMOVE_TIMER_CALLBACK: {
+			bufferRemoveTimerCallback(bufferId);
+		}	break;
 		case BUFFERED_DEBUG_INFO: {
 			// force_debug_log("vdu_sys_buffered: debug info stack highwater %d\n\r",uxTaskGetStackHighWaterMark(nullptr));
 			force_debug_log("vdu_sys_buffered: buffer %d, %d streams stored\n\r", bufferId, buffers[bufferId].size());
@@ -296,8 +379,16 @@ void IRAM_ATTR VDUStreamProcessor::vdu_sys_buffered() {
 // VDU 23, 0, &A0, bufferId; 0, length; data...: store stream into buffer
 // This adds a new stream to the given bufferId
 // allowing a single bufferId to store multiple streams of data
+// If bufferId holds a streaming sample the data is written into that stream instead
 //
 uint32_t VDUStreamProcessor::bufferWrite(uint16_t bufferId, uint32_t length) {
+	auto sampleIter = samples.find(bufferId);
+	if (sampleIter != samples.end() && sampleIter->second && sampleIter->second->stream) {
+		// streaming samples keep their ring buffer out of buffers, so the data goes into the stream rather than a new block
+		uint32_t accepted = 0;
+		return readIntoSampleStream(*sampleIter->second, length, accepted);
+	}
+	bufferBlocksChanged(bufferId);
 	auto bufferStream = make_shared_psram<BufferStream>(length);
 
 	debug_log("bufferWrite: storing stream into buffer %d, length %d\n\r", bufferId, length);
@@ -320,12 +411,115 @@ uint32_t VDUStreamProcessor::bufferWrite(uint16_t bufferId, uint32_t length) {
 	return remaining;
 }
 
+// VDU 23, 0, &A0, bufferId; &43, length; data...: write compressed data, decompressing it as it arrives
+// Data must start with a compression header (as output by the compress commands)
+// and is decompressed as it is read, so the compressed copy is never stored.
+// Compressed data longer than 65535 bytes can be sent using several of these commands.
+// Once all of the original data has been decompressed it is added as a new block to bufferId
+//
+uint32_t VDUStreamProcessor::bufferWriteDecompress(uint16_t bufferId, uint32_t length) {
+	if (bufferId == 65535) {
+		debug_log("bufferWriteDecompress: bufferId %d is reserved\n\r", bufferId);
+		return discardBytes(length);
+	}
+
+	auto &stream = pendingDecompressions[bufferId];
+	if (!stream) {
+		stream = make_shared_psram<StreamingDecompression>();
+		if (!stream) {
+			debug_log("bufferWriteDecompress: cannot allocate decompression state\n\r");
+			pendingDecompressions.erase(bufferId);
+			return discardBytes(length);
+		}
+	}
+	debug_log("bufferWriteDecompress: decompressing stream into buffer %d, length %d\n\r", bufferId, length);
+
+	uint8_t chunk[128];
+	auto remaining = length;
+	bool failed = false;
+	while (remaining > 0) {
+		uint32_t chunkSize = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+		if (readIntoBuffer(chunk, chunkSize) != 0) {
+			debug_log("bufferWriteDecompress: timed out write for buffer %d (%d bytes remaining)\n\r", bufferId, remaining);
+			pendingDecompressions.erase(bufferId);
+			return remaining;
+		}
+		remaining -= chunkSize;
+		if (failed) {
+			continue;
+		}
+
+		auto p_data = chunk;
+		// Collect the compression header
+		while (chunkSize > 0 && stream->headerCount < sizeof(CompressionFileHeader)) {
+			((uint8_t *) &stream->header)[stream->headerCount++] = *p_data++;
+			chunkSize--;
+			if (stream->headerCount == sizeof(CompressionFileHeader)) {
+				auto &hdr = stream->header;
+				if (hdr.marker[0] != 'C' || hdr.marker[1] != 'm' || hdr.marker[2] != 'p' ||
+					(hdr.type != COMPRESSION_TYPE_TURBO && hdr.type != COMPRESSION_TYPE_LZ)) {
+					debug_log("bufferWriteDecompress: header is invalid\n\r");
+					failed = true;
+					break;
+				}
+				stream->bufferStream = make_shared_psram<BufferStream>(hdr.orig_size);
+				if (!stream->bufferStream || !stream->bufferStream->getBuffer()) {
+					debug_log("bufferWriteDecompress: failed to create buffer %d\n\r", bufferId);
+					failed = true;
+					break;
+				}
+				stream->output = stream->bufferStream->getBuffer();
+				if (hdr.type == COMPRESSION_TYPE_LZ) {
+					agon_init_lz_decompression(&stream->lz, stream->output, hdr.orig_size);
+				} else {
+					agon_init_decompression(&stream->turbo, &stream->output, &local_write_decompressed_byte, hdr.orig_size);
+				}
+			}
+		}
+		if (failed || chunkSize == 0) {
+			continue;
+		}
+
+		if (stream->header.type == COMPRESSION_TYPE_LZ) {
+			if (stream->lz.output_count < stream->header.orig_size &&
+				!agon_lz_decompress(&stream->lz, p_data, chunkSize)) {
+				debug_log("bufferWriteDecompress: compressed data is invalid\n\r");
+				failed = true;
+			}
+		} else {
+			stream->turbo.input_count += chunkSize;
+			while (chunkSize-- && stream->turbo.output_count < stream->header.orig_size) {
+				agon_decompress_byte(&stream->turbo, *p_data++);
+			}
+		}
+	}
+
+	if (failed) {
+		pendingDecompressions.erase(bufferId);
+		return remaining;
+	}
+
+	if (stream->headerCount == sizeof(CompressionFileHeader)) {
+		auto outputCount = stream->header.type == COMPRESSION_TYPE_LZ ? stream->lz.output_count : stream->turbo.output_count;
+		if (outputCount == stream->header.orig_size) {
+			buffers[bufferId].push_back(std::move(stream->bufferStream));
+			pendingDecompressions.erase(bufferId);
+			debug_log("bufferWriteDecompress: stored %d bytes in buffer %d, %d streams stored\n\r", outputCount, bufferId, buffers[bufferId].size());
+		}
+	}
+	return remaining;
+}
+
 // VDU 23, 0, &A0, bufferId; 1: Call buffer
 // VDU 23, 0, &A0, bufferId; &0B, offset; offsetHighByte  : Offset call
 // Processes all commands from the streams stored against the given bufferId
+// repeat gives the number of times to call the buffer, with the buffer only being looked up once
 //
-void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset) {
+void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset, uint16_t repeat) {
 	debug_log("bufferCall: buffer %d\n\r", callBufferId);
+	if (repeat == 0) {
+		return;
+	}
 	auto bufferId = resolveBufferId(callBufferId, id);
 	if (bufferId == -1) {
 		debug_log("bufferCall: no buffer ID\n\r");
@@ -333,7 +527,7 @@ void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset
 	}
 	AdvancedOffset returnOffset;
 	if (id != 65535) {
-		if (inputStream->available() == 0) {
+		if (inputStream->available() == 0 && repeat == 1) {
 			// tail-call optimise - turn the call into a jump
 			bufferJump(bufferId, offset);
 			return;
@@ -343,8 +537,16 @@ void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset
 		multiBufferStream->tellBuffer(returnOffset.blockOffset, returnOffset.blockIndex);
 		if (id == bufferId) {
 			// calling ourselves, just seek to the old offset after returning
-			multiBufferStream->seekTo(offset.blockOffset, offset.blockIndex);
-			processAllAvailable();
+			// keep hold of our stream, as the called code may jump elsewhere
+			auto selfStream = inputStream;
+			for (auto i = 0; i < repeat; i++) {
+				id = bufferId;
+				inputStream = selfStream;
+				multiBufferStream->seekTo(offset.blockOffset, offset.blockIndex);
+				processAllAvailable();
+			}
+			id = bufferId;
+			inputStream = std::move(selfStream);
 			multiBufferStream->seekTo(returnOffset.blockOffset, returnOffset.blockIndex);
 			return;
 		}
@@ -367,9 +569,17 @@ void VDUStreamProcessor::bufferCall(uint16_t callBufferId, AdvancedOffset offset
 	// update originalOutputStream so it is correct for the context of the call
 	originalOutputStream = outputStream;
 	// using the current VDUStreamProcessor, swap in our new input stream
+	auto loopStream = repeat > 1 ? callInputStream : nullptr;
 	std::swap(id, callBufferId);
 	std::swap(inputStream, callInputStream);
 	processAllAvailable();
+	for (auto i = 1; i < repeat; i++) {
+		// restore our stream, as the called code may have jumped elsewhere, and rewind it
+		id = bufferId;
+		inputStream = loopStream;
+		((MultiBufferStream *)loopStream.get())->seekTo(offset.blockOffset, offset.blockIndex);
+		processAllAvailable();
+	}
 	// restore the original buffer id and streams
 	id = callBufferId;
 	inputStream = std::move(callInputStream);
@@ -397,6 +607,7 @@ void VDUStreamProcessor::bufferRemoveUsers(uint16_t bufferId) {
 //
 void VDUStreamProcessor::bufferClear(uint16_t bufferId) {
 	debug_log("bufferClear: buffer %d\n\r", bufferId);
+	bufferBlocksChanged(bufferId);
 	if (bufferId == 65535) {
 		buffers.clear();
 		matrixMetadata.clear();
@@ -407,14 +618,17 @@ void VDUStreamProcessor::bufferClear(uint16_t bufferId) {
 		context->resetCharToBitmap();
 		resetFonts();
 		resetSamples();
+		pendingDecompressions.clear();
 		return;
 	}
+	pendingDecompressions.erase(bufferId);
+	// bitmap views may not have a buffer of their own, so remove users first
+	bufferRemoveUsers(bufferId);
 	auto bufferIter = buffers.find(bufferId);
 	if (bufferIter == buffers.end()) {
 		debug_log("bufferClear: buffer %d not found\n\r", bufferId);
 		return;
 	}
-	bufferRemoveUsers(bufferId);
 	buffers.erase(bufferIter);
 	matrixMetadata.erase(bufferId);
 	debug_log("bufferClear: cleared buffer %d\n\r", bufferId);
@@ -437,6 +651,7 @@ std::shared_ptr<WritableBufferStream> VDUStreamProcessor::bufferCreate(uint16_t
 		debug_log("bufferCreate: failed to create buffer %d\n\r", bufferId);
 		return nullptr;
 	}
+	bufferBlocksChanged(bufferId);
 	buffers[bufferId].push_back(buffer);
 	debug_log("bufferCreate: created buffer %d, size %d\n\r", bufferId, size);
 	return buffer;
@@ -1046,14 +1261,89 @@ void VDUStreamProcessor::bufferAdjust(uint16_t adjustBufferId) {
 	}
 }
 
-// returns true or false depending on whether conditions are met
-// Will read the following arguments from the stream
-// operation, checkBufferId; offset; [operand]
-// This works in a similar manner to bufferAdjust
-// for now, this only supports single-byte comparisons
-// as multi-byte comparisons are a bit more complex
+// Convert a raw value to a comparable value, masking to the given size and sign-extending if required
 //
-bool VDUStreamProcessor::bufferConditional() {
+static inline int64_t conditionValue(uint32_t value, uint8_t size, bool isSigned) {
+	auto shift = 32 - (size * 8);
+	value <<= shift;
+	return isSigned ? (int64_t)((int32_t)value >> shift) : (int64_t)(value >> shift);
+}
+
+static inline int64_t readConditionValue(const uint8_t * data, uint8_t size, bool isSigned) {
+	uint32_t value = 0;
+	memcpy(&value, data, size);
+	return conditionValue(value, size, isSigned);
+}
+
+// Resolve a pointer to a condition value in a buffer
+// Returns nullptr if the buffer or offset is not found
+//
+static uint8_t * resolveConditionValue(uint16_t bufferId, AdvancedOffset offset, uint8_t size, std::shared_ptr<BufferStream> &block) {
+	auto bufferIter = buffers.find(bufferId);
+	if (bufferIter == buffers.end()) {
+		return nullptr;
+	}
+	auto span = getBufferSpan(bufferIter->second, offset, size);
+	if (span.empty()) {
+		return nullptr;
+	}
+	block = bufferIter->second[offset.blockIndex];
+	return span.data();
+}
+
+// Evaluate a compiled condition
+// Values are read through the resolved pointers, so always reflect current buffer contents
+//
+static bool evaluateCondition(const CompiledCondition &condition) {
+	int64_t sourceValue;
+	if (condition.useVariable) {
+		bool isSet = isVDPVariableSet(condition.variableId);
+		if (condition.op <= COND_NOT_EXISTS) {
+			// Flag existence is a pure check, not check for zero
+			return (condition.op == COND_NOT_EXISTS) ? !isSet : isSet;
+		}
+		if (!isSet) {
+			return false;
+		}
+		sourceValue = conditionValue(getVDPVariable(condition.variableId), condition.size, condition.isSigned);
+	} else {
+		if (!condition.source) {
+			debug_log("bufferConditional: invalid source value\n\r");
+			return false;
+		}
+		sourceValue = readConditionValue(condition.source, condition.size, condition.isSigned);
+	}
+
+	int64_t operandValue = condition.operandValue;
+	if (condition.hasOperand && condition.useBufferValue) {
+		if (!condition.operand) {
+			debug_log("bufferConditional: invalid operand value\n\r");
+			return false;
+		}
+		operandValue = readConditionValue(condition.operand, condition.size, condition.isSigned);
+	}
+
+	switch (condition.op) {
+		case COND_EXISTS:			return sourceValue != 0;
+		case COND_NOT_EXISTS:		return sourceValue == 0;
+		case COND_EQUAL:			return sourceValue == operandValue;
+		case COND_NOT_EQUAL:		return sourceValue != operandValue;
+		case COND_LESS:				return sourceValue < operandValue;
+		case COND_GREATER:			return sourceValue > operandValue;
+		case COND_LESS_EQUAL:		return sourceValue <= operandValue;
+		case COND_GREATER_EQUAL:	return sourceValue >= operandValue;
+		case COND_AND:				return sourceValue && operandValue;
+		case COND_OR:				return sourceValue || operandValue;
+	}
+	return false;
+}
+
+// Reads conditional arguments from the stream, and compiles them into a condition
+// operation, [extendedOperation,] checkBufferId; offset; [operand]
+// Buffer values are resolved to pointers, so the condition can be re-evaluated without re-parsing
+// Returns false if the arguments could not be read
+//
+bool VDUStreamProcessor::bufferCompileConditional(CompiledCondition &condition) {
 	auto command = readByte_t();
 	if (command == -1) {
 		debug_log("bufferConditional: invalid command\n\r");
@@ -1061,24 +1351,40 @@ bool VDUStreamProcessor::bufferConditional() {
 	}
 
 	bool useAdvancedOffsets = command & COND_ADVANCED_OFFSETS;
-	bool useBufferValue = command & COND_BUFFER_VALUE;	// Operand is a buffer value
-	bool useVariableValue = command & COND_VAR_VALUE;	// source to check is a feature flag
-	bool use16BitValue = command & COND_16BIT;	// source and operand are 16-bit values
+	condition.useBufferValue = command & COND_BUFFER_VALUE;	// Operand is a buffer value
+	condition.useVariable = command & COND_VAR_VALUE;	// source to check is a feature flag
+	condition.size = (command & COND_16BIT) ? 2 : 1;	// source and operand are 16-bit values
+	condition.isSigned = false;
 
-	auto checkBufferId = useVariableValue ? readWord_t() : resolveBufferId(readWord_t(), id);
-	
 	uint8_t op = command & COND_OP_MASK;
+	if (op == COND_EXTENDED) {
+		// extended operation byte gives the actual operation, and signed/32-bit flags
+		auto extended = readByte_t();
+		if (extended == -1) {
+			debug_log("bufferConditional: invalid extended command\n\r");
+			return false;
+		}
+		op = extended & COND_OP_MASK;
+		condition.isSigned = extended & COND_EXT_SIGNED;
+		if (extended & COND_EXT_32BIT) {
+			condition.size = 4;
+		}
+	}
+	condition.op = op;
+
+	auto checkBufferId = condition.useVariable ? readWord_t() : resolveBufferId(readWord_t(), id);
+
 	// conditional operators that are greater than NOT_EXISTS require an operand
-	bool hasOperand = op > COND_NOT_EXISTS;
+	condition.hasOperand = op > COND_NOT_EXISTS;
 
 	AdvancedOffset offset = {};
-	if (!useVariableValue) {
+	if (!condition.useVariable) {
 		offset = getOffsetFromStream(useAdvancedOffsets);
 	}
 
 	auto operandBufferId = 0;
 	AdvancedOffset operandOffset = {};
-	if (useBufferValue && hasOperand) {
+	if (condition.useBufferValue && condition.hasOperand) {
 		operandBufferId = resolveBufferId(readWord_t(), id);
 		operandOffset = getOffsetFromStream(useAdvancedOffsets);
 	}
@@ -1088,80 +1394,107 @@ bool VDUStreamProcessor::bufferConditional() {
 		return false;
 	}
 
-	int32_t sourceValue = -1;
-	if (useVariableValue) {
-		if (isVDPVariableSet(checkBufferId)) {
-			sourceValue = getVDPVariable(checkBufferId);
-			if (!use16BitValue) {
-				sourceValue &= 0xFF;
+	condition.operandValue = 0;
+	if (condition.hasOperand && !condition.useBufferValue) {
+		uint32_t value = 0;
+		if (condition.size == 1) {
+			auto byte = readByte_t(); if (byte == -1) return false;
+			value = byte;
+		} else {
+			auto word = readWord_t(); if (word == -1) return false;
+			value = word;
+			if (condition.size == 4) {
+				auto highWord = readWord_t(); if (highWord == -1) return false;
+				value |= (uint32_t)highWord << 16;
 			}
 		}
+		condition.operandValue = conditionValue(value, condition.size, condition.isSigned);
+	}
+
+	if (condition.useVariable) {
+		condition.variableId = checkBufferId;
 	} else {
-		readBufferBytes(checkBufferId, offset, &sourceValue, use16BitValue ? 2 : 1);
+		condition.source = resolveConditionValue(checkBufferId, offset, condition.size, condition.sourceBlock);
+	}
+	if (condition.useBufferValue && condition.hasOperand) {
+		condition.operand = resolveConditionValue(operandBufferId, operandOffset, condition.size, condition.operandBlock);
 	}
 
-	int32_t operandValue = hasOperand ? -1 : 0;
-	if (hasOperand) {
-		if (useBufferValue) {
-			readBufferBytes(operandBufferId, operandOffset, &operandValue, use16BitValue ? 2 : 1);
-		} else {
-			operandValue = use16BitValue ? readWord_t() : readByte_t();
-		}
+	debug_log("bufferConditional: command %d, op %d, size %d, checkBufferId %d, offset %d:%d, operandBufferId %d, operandOffset %d:%d\n\r",
+		command, op, condition.size, checkBufferId, (int)offset.blockIndex, offset.blockOffset, operandBufferId, (int)operandOffset.blockIndex, operandOffset.blockOffset);
+	return true;
+}
+
+// returns true or false depending on whether conditions are met
+// Will read the following arguments from the stream
+// operation, [extendedOperation,] checkBufferId; offset; [operand]
+// This works in a similar manner to bufferAdjust
+// Using COND_EXTENDED as the operation allows for signed and 32-bit comparisons
+//
+// When running inside a buffer, the compiled condition is cached against its location,
+// so subsequent evaluations skip over the arguments without parsing them or looking up buffers.
+// Cached conditions are discarded when buffer blocks are added or removed,
+// and are recompiled if their argument bytes have been modified
+//
+bool VDUStreamProcessor::bufferConditional() {
+	if (id == 65535) {
+		CompiledCondition condition;
+		return bufferCompileConditional(condition) && evaluateCondition(condition);
 	}
 
-	debug_log("bufferConditional: command %d, checkBufferId %d, offset %d:%d, operandBufferId %d, operandOffset %d:%d, sourceValue %d, operandValue %d\n\r",
-		command, checkBufferId, (int)offset.blockIndex, offset.blockOffset, operandBufferId, (int)operandOffset.blockIndex, operandOffset.blockOffset, sourceValue, operandValue);
+	if (conditionCacheGeneration != bufferGeneration || conditionCache.size() >= BUFFERED_CONDITION_CACHE_SIZE) {
+		conditionCache.clear();
+		conditionCacheGeneration = bufferGeneration;
+	}
+
+	auto multiBufferStream = (MultiBufferStream *)inputStream.get();
+	ConditionSite site = {};
+	size_t blockIndex;
+	auto &blocks = multiBufferStream->tellBuffer(site.offset, blockIndex);
+	if (blockIndex >= blocks.size()) {
+		// at end of buffer, so there are no arguments to read
+		CompiledCondition condition;
+		return bufferCompileConditional(condition) && evaluateCondition(condition);
+	}
+	site.block = blocks[blockIndex].get();
+	site.bufferId = id;
+	auto argsStart = site.block->getBuffer() + site.offset;
 
-	if (useVariableValue && op <= COND_NOT_EXISTS) {	// Flag existence is a pure check, not check for zero
-		if (op == COND_NOT_EXISTS) {
-			return sourceValue == -1;
+	auto cached = conditionCache.find(site);
+	if (cached != conditionCache.end()) {
+		auto &condition = cached->second;
+		if (memcmp(argsStart, condition.args, condition.argsLength) == 0) {
+			multiBufferStream->seekTo(condition.endOffset, condition.endIndex);
+			bool result = evaluateCondition(condition);
+			debug_log("bufferConditional: cached condition evaluated as %s\n\r", result ? "true" : "false");
+			return result;
 		}
-		return sourceValue != -1;
+		// arguments have been modified, so recompile
+		conditionCache.erase(cached);
 	}
 
-	if (sourceValue == -1 || operandValue == -1) {
-		debug_log("bufferConditional: invalid source or operand value\n\r");
+	CompiledCondition condition;
+	if (!bufferCompileConditional(condition)) {
 		return false;
 	}
+	multiBufferStream->tellBuffer(condition.endOffset, condition.endIndex);
 
-	bool shouldCall = false;
-
-	switch (op) {
-		case COND_EXISTS: {
-			shouldCall = sourceValue != 0;
-		}	break;
-		case COND_NOT_EXISTS: {
-			shouldCall = sourceValue == 0;
-		}	break;
-		case COND_EQUAL: {
-			shouldCall = sourceValue == operandValue;
-		}	break;
-		case COND_NOT_EQUAL: {
-			shouldCall = sourceValue != operandValue;
-		}	break;
-		case COND_LESS: {
-			shouldCall = sourceValue < operandValue;
-		}	break;
-		case COND_GREATER: {
-			shouldCall = sourceValue > operandValue;
-		}	break;
-		case COND_LESS_EQUAL: {
-			shouldCall = sourceValue <= operandValue;
-		}	break;
-		case COND_GREATER_EQUAL: {
-			shouldCall = sourceValue >= operandValue;
-		}	break;
-		case COND_AND: {
-			shouldCall = sourceValue && operandValue;
-		}	break;
-		case COND_OR: {
-			shouldCall = sourceValue || operandValue;
-		}	break;
+	// only cache conditions whose arguments are held within a single block
+	uint32_t argsLength = 0;
+	if (condition.endIndex == blockIndex) {
+		argsLength = condition.endOffset - site.offset;
+	} else if (condition.endIndex == blockIndex + 1 && condition.endOffset == 0) {
+		argsLength = site.block->size() - site.offset;
+	}
+	bool result = evaluateCondition(condition);
+	if (argsLength > 0 && argsLength <= sizeof(condition.args)) {
+		condition.argsLength = argsLength;
+		memcpy(condition.args, argsStart, argsLength);
+		conditionCache.emplace(site, std::move(condition));
 	}
 
-	debug_log("bufferConditional: evaluated as %s\n\r", shouldCall ? "true" : "false");
-
-	return shouldCall;
+	debug_log("bufferConditional: evaluated as %s\n\r", result ? "true" : "false");
+	return result;
 }
 
 // VDU 23, 0, &A0, bufferId; 7: Jump to a buffer
@@ -1197,6 +1530,17 @@ void VDUStreamProcessor::bufferJump(uint16_t bufferId, AdvancedOffset offset) {
 	inputStream = std::move(multiBufferStream);
 }
 
+// Decrement a loop counter, returning true if the result is not zero
+// As with a Z80 DJNZ, a counter of zero wraps around, giving 65536 iterations
+//
+bool VDUStreamProcessor::bufferDecrementCounter(uint8_t counter) {
+	if (counter >= BUFFERED_LOOP_COUNTERS) {
+		debug_log("bufferDecrementCounter: invalid loop counter %d\n\r", counter);
+		return false;
+	}
+	return --loopCounters[counter] != 0;
+}
+
 // VDU 23, 0, &A0, bufferId; &0D, sourceBufferId; sourceBufferId; ...; 65535; : Copy blocks from buffers
 // Copy (blocks from) a list of buffers into a new buffer
 // list is terminated with a bufferId of 65535 (-1)
@@ -2043,6 +2387,7 @@ void VDUStreamProcessor::bufferMatrixManipulate(uint16_t bufferId, uint8_t comma
 
 // VDU 23, 0, &A0, bufferId; &28, options, transformBufferId; bitmapId; : Apply 2d affine transformation to bitmap
 // Apply an affine transformation to a bitmap, creating a new RGBA2222 format bitmap
+// Flips, quarter turns and integer scales of RGBA2222 bitmaps are detected and use a faster exact path
 // Replaces the target buffer with the new bitmap, and creates a corresponding bitmap
 //
 void VDUStreamProcessor::bufferTransformBitmap(uint16_t bufferId, uint8_t options, uint16_t transformBufferId, uint16_t bitmapId) {
@@ -2151,27 +2496,12 @@ void VDUStreamProcessor::bufferTransformBitmap(uint16_t bufferId, uint8_t option
 		return;
 	}
 
-	// iterate over our destination buffer, and apply the transformation to each pixel
+	// render the transformed bitmap into our destination buffer
 	auto destination = (RGBA2222 *)bufferStream->getBuffer();
-	float pos[3] = {0.0f, 0.0f, 1.0f};
-	float srcPos[3] = {0.0f, 0.0f, 1.0f};
 
 	debug_log("bufferTransformBitmap: width %d, height %d, xOffset %d, yOffset %d\n\r", width, height, xOffset, yOffset);
 
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			// calculate the source pixel
-			// NB we will need to adjust x,y here if we are auto-translating
-			pos[0] = (float)x + xOffset;
-			pos[1] = (float)y + yOffset;
-			dspm_mult_3x3x1_f32(inverse, pos, srcPos);
-			auto srcPixel = RGBA2222(0,0,0,0);
-			if (srcPos[0] >= 0.0f && srcPos[0] < srcWidthF && srcPos[1] >= 0.0f && srcPos[1] < srcHeightF) {
-				srcPixel = bitmap->getPixel2222((int)srcPos[0], (int)srcPos[1]);
-			}
-			destination[(int)y * width + (int)x] = srcPixel;
-		}
-	}
+	transformBitmap(bitmap.get(), transform, inverse, destination, width, height, xOffset, yOffset);
 
 	// save new bitmap data to target buffer
 	bufferClear(bufferId);
@@ -2423,10 +2753,12 @@ void VDUStreamProcessor::bufferReadVariable(uint16_t bufferId) {
 }
 
 // VDU 23, 0, &A0, bufferId; &40, sourceBufferId; : Compress blocks from a buffer
+// VDU 23, 0, &A0, bufferId; &42, type, sourceBufferId; : Compress blocks from a buffer using a given compression type
 // Compress (blocks from) a buffer into a new buffer.
 // Replaces the target buffer with the new one.
+// type is the compression header type byte, 'T' (TurboVega) or 'L' (byte-aligned LZ)
 //
-void VDUStreamProcessor::bufferCompress(uint16_t bufferId, uint16_t sourceBufferId) {
+void VDUStreamProcessor::bufferCompress(uint16_t bufferId, uint16_t sourceBufferId, uint8_t type) {
 	debug_log("Compressing into buffer %u\n\r", bufferId);
 
 	auto sourceBufferIter = buffers.find(sourceBufferId);
@@ -2435,6 +2767,74 @@ void VDUStreamProcessor::bufferCompress(uint16_t bufferId, uint16_t sourceBuffer
 		return;
 	}
 
+	if (type == COMPRESSION_TYPE_LZ) {
+		// LZ compressor works on contiguous data, so consolidate multiple blocks first
+		auto &sourceBuffer = sourceBufferIter->second;
+		uint32_t orig_size = 0;
+		for (const auto &block : sourceBuffer) {
+			orig_size += block->size();
+		}
+		uint8_t* p_source = nullptr;
+		const uint8_t* source = nullptr;
+		if (sourceBuffer.size() == 1) {
+			source = sourceBuffer[0]->getBuffer();
+		} else if (orig_size > 0) {
+			p_source = (uint8_t*) ps_malloc(orig_size);
+			if (!p_source) {
+				debug_log("bufferCompress: cannot allocate temporary buffer of %d bytes\n\r", orig_size);
+				return;
+			}
+			auto p_dest = p_source;
+			for (const auto &block : sourceBuffer) {
+				memcpy(p_dest, block->getBuffer(), block->size());
+				p_dest += block->size();
+			}
+			source = p_source;
+		}
+
+		auto bound = sizeof(CompressionFileHeader) + agon_lz_compress_bound(orig_size);
+		uint8_t* p_temp = (uint8_t*) ps_malloc(bound);
+		if (!p_temp) {
+			debug_log("bufferCompress: cannot allocate temporary buffer of %d bytes\n\r", bound);
+			heap_caps_free(p_source);
+			return;
+		}
+		auto p_hdr = (CompressionFileHeader*) p_temp;
+		p_hdr->marker[0] = 'C';
+		p_hdr->marker[1] = 'm';
+		p_hdr->marker[2] = 'p';
+		p_hdr->type = COMPRESSION_TYPE_LZ;
+		p_hdr->orig_size = orig_size;
+
+		uint32_t output_count = sizeof(CompressionFileHeader);
+		if (orig_size > 0) {
+			auto compressed = agon_lz_compress(source, orig_size, p_temp + output_count);
+			heap_caps_free(p_source);
+			if (compressed == 0) {
+				heap_caps_free(p_temp);
+				return;
+			}
+			output_count += compressed;
+		}
+
+		auto bufferStream = make_shared_psram<BufferStream>(output_count);
+		if (!bufferStream || !bufferStream->getBuffer()) {
+			// buffer couldn't be created
+			debug_log("bufferCompress: failed to create buffer %d\n\r", bufferId);
+			heap_caps_free(p_temp);
+			return;
+		}
+		memcpy(bufferStream->getBuffer(), p_temp, output_count);
+		heap_caps_free(p_temp);
+		bufferClear(bufferId);
+		buffers[bufferId].push_back(bufferStream);
+		debug_log("Compressed %u input bytes to %u output bytes\n\r", orig_size, output_count);
+		return;
+	} else if (type != COMPRESSION_TYPE_TURBO) {
+		debug_log("bufferCompress: unknown compression type %d\n\r", type);
+		return;
+	}
+
 	// create a temporary output buffer, which may be expanded during compression
 	uint8_t* p_temp = (uint8_t*) ps_malloc(COMPRESSION_OUTPUT_CHUNK_SIZE);
 	if (p_temp) {
@@ -2527,7 +2927,7 @@ void VDUStreamProcessor::bufferDecompress(uint16_t bufferId, uint16_t sourceBuff
 	if (p_hdr->marker[0] != 'C' ||
 		p_hdr->marker[1] != 'm' ||
 		p_hdr->marker[2] != 'p' ||
-		p_hdr->type != COMPRESSION_TYPE_TURBO) {
+		(p_hdr->type != COMPRESSION_TYPE_TURBO && p_hdr->type != COMPRESSION_TYPE_LZ)) {
 		debug_log("bufferDecompress: header is invalid\n\r");
 		return;
 	}
@@ -2543,8 +2943,33 @@ void VDUStreamProcessor::bufferDecompress(uint16_t bufferId, uint16_t sourceBuff
 		return;
 	}
 
-	// prepare for doing compression
 	auto buffer = bufferStream->getBuffer();
+
+	if (p_hdr->type == COMPRESSION_TYPE_LZ) {
+		// byte-aligned data can be decoded a whole block at a time
+		LzDecompressionData lz;
+		agon_init_lz_decompression(&lz, buffer, orig_size);
+		uint32_t skip_hdr = sizeof(CompressionFileHeader);
+		for (const auto &block : sourceBuffer) {
+			if (!agon_lz_decompress(&lz, block->getBuffer() + skip_hdr, block->size() - skip_hdr)) {
+				debug_log("bufferDecompress: compressed data is invalid\n\r");
+				return;
+			}
+			skip_hdr = 0;
+		}
+		if (!agon_lz_decompression_complete(&lz)) {
+			debug_log("Decompressed buffer size %u does not equal original size %u\r\n",
+						lz.output_count, orig_size);
+		}
+		bufferClear(bufferId);
+		buffers[bufferId].push_back(bufferStream);
+		#ifdef DEBUG
+		debug_log("Decompress took %u ms\n\r", millis() - start);
+		#endif
+		return;
+	}
+
+	// prepare for doing compression
 	DecompressionData dd;
 	agon_init_decompression(&dd, &buffer, &local_write_decompressed_byte, orig_size);
 
@@ -2769,5 +3194,84 @@ void VDUStreamProcessor::bufferCallCallbacks(uint16_t type) {
 	}
 }
 
+// Heap ordering for timer callbacks, earliest deadline at the front
+// Deadlines are compared as a signed difference so counter wrap-around is handled
+//
+static inline bool timerCallbackLater(const TimerCallback & a, const TimerCallback & b) {
+	return (int32_t)(a.deadline - b.deadline) > 0;
+}
+
+// VDU 23, 0, &A0, bufferId; &52, flags, interval; : Add a timer callback
+// Calls bufferId after interval milliseconds, or frames if flags bit 0 is set
+// If flags bit 1 is set the callback repeats, otherwise it fires once
+// Adding a timer for a buffer replaces any existing timer for that buffer
+//
+void VDUStreamProcessor::bufferAddTimerCallback(uint16_t bufferId, uint8_t flags, uint16_t interval) {
+	if (bufferId == 65535) {
+		debug_log("bufferAddTimerCallback: bufferId %d is reserved\n\r", bufferId);
+		return;
+	}
+	bufferRemoveTimerCallback(bufferId);
+	bool useFrames = flags & TIMER_CALLBACK_FRAMES;
+	auto &timers = useFrames ? frameTimers : msTimers;
+	uint32_t now = useFrames ? lastFrameCounter : millis();
+	if (interval == 0) {
+		interval = 1;
+	}
+	timers.push_back({ now + interval, interval, bufferId, (flags & TIMER_CALLBACK_REPEAT) != 0 });
+	std::push_heap(timers.begin(), timers.end(), timerCallbackLater);
+	debug_log("bufferAddTimerCallback: buffer %d, interval %d %s\n\r", bufferId, interval, useFrames ? "frames" : "ms");
+}
+
+// VDU 23, 0, &A0, bufferId; &53 : Remove a timer callback
+// bufferId of 65535 removes all timer callbacks
+//
+void VDUStreamProcessor::bufferRemoveTimerCallback(uint16_t bufferId) {
+	for (auto timers : { &msTimers, &frameTimers }) {
+		if (bufferId == 65535) {
+			timers->clear();
+			continue;
+		}
+		auto end = std::remove_if(timers->begin(), timers->end(), [bufferId](const TimerCallback & timer) {
+			return timer.bufferId == bufferId;
+		});
+		if (end != timers->end()) {
+			timers->erase(end, timers->end());
+			std::make_heap(timers->begin(), timers->end(), timerCallbackLater);
+		}
+	}
+}
+
+// Call any timer callbacks that are due
+// Repeating timers are re-armed before their buffer is called,
+// so a callback may safely remove or replace its own timer
+// Timers whose buffer has been cleared are dropped when they next fall due
+//
+void VDUStreamProcessor::bufferCallTimerCallbacks() {
+	for (auto timers : { &msTimers, &frameTimers }) {
+		uint32_t now = timers == &frameTimers ? lastFrameCounter : millis();
+		while (!timers->empty() && (int32_t)(now - timers->front().deadline) >= 0) {
+			std::pop_heap(timers->begin(), timers->end(), timerCallbackLater);
+			auto timer = timers->back();
+			timers->pop_back();
+			if (buffers.find(timer.bufferId) == buffers.end()) {
+				debug_log("bufferCallTimerCallbacks: buffer %d not found, removing timer\n\r", timer.bufferId);
+				continue;
+			}
+			if (timer.repeat) {
+				auto next = timer;
+				next.deadline += next.interval;
+				if ((int32_t)(now - next.deadline) >= 0) {
+					// we've fallen behind, so skip missed intervals rather than firing a burst
+					next.deadline = now + next.interval;
+				}
+				timers->push_back(next);
+				std::push_heap(timers->begin(), timers->end(), timerCallbackLater);
+			}
+			bufferCall(timer.bufferId, {});
+		}
+	}
+}
+
 
 #endif // VDU_BUFFERED_H
@@ -4,6 +4,7 @@
 #include <fabgl.h>
 #include <cmath>
 
+#include "agon_fonts.h"
 #include "agon_ps2.h"
 #include "buffers.h"
 #include "sprites.h"
@@ -205,6 +206,34 @@ void VDUStreamProcessor::vdu_sys_sprites() {
 			}
 		}	break;
 
+		case 0x22: {	// Create bitmap as a view of a rectangle within another bitmap
+			auto parentId = readWord_t(); if (parentId == -1) return;
+			auto x = readWord_t(); if (x == -1) return;
+			auto y = readWord_t(); if (y == -1) return;
+			auto width = readWord_t(); if (width == -1) return;
+			auto height = readWord_t(); if (height == -1) return;
+			createBitmapView(context->getCurrentBitmapId(), parentId, x, y, width, height);
+		}	break;
+
+		case 0x23: {	// Create bitmaps for frames of a sprite sheet, starting at current bitmap
+			auto parentId = readWord_t(); if (parentId == -1) return;
+			auto frameWidth = readWord_t(); if (frameWidth == -1) return;
+			auto frameHeight = readWord_t(); if (frameHeight == -1) return;
+			auto count = readWord_t(); if (count == -1) return;
+			createBitmapsFromSheet(context->getCurrentBitmapId(), parentId, frameWidth, frameHeight, count);
+		}	break;
+
+		case 0x24: {	// Convert current bitmap to display format
+			convertBitmapForDisplay(context->getCurrentBitmapId());
+		}	break;
+
+		case 0x25: {	// Redirect graphics drawing to a bitmap, or back to the screen
+			auto bitmapId = readWord_t(); if (bitmapId == -1) return;
+			auto width = readWord_t(); if (width == -1) return;
+			auto height = readWord_t(); if (height == -1) return;
+			setBitmapRenderTarget(bitmapId, width, height);
+		}	break;
+
 		case 0x26: {	// add sprite frame for bitmap (long ID)
 			auto bufferId = readWord_t(); if (bufferId == -1) return;
 			addSpriteFrame(bufferId);
@@ -230,6 +259,58 @@ void VDUStreamProcessor::vdu_sys_sprites() {
 			debug_log("vdu_sys_sprites: cursor created from bitmap %d\n\r", context->getCurrentBitmapId());
 		}	break;
 
+		case 0x50: {	// Set sprite frame animation
+			auto firstFrame = readByte_t(); if (firstFrame == -1) return;
+			auto lastFrame = readByte_t(); if (lastFrame == -1) return;
+			auto frameDelay = readByte_t(); if (frameDelay == -1) return;
+			auto mode = readByte_t(); if (mode == -1) return;
+			setSpriteAnimation(firstFrame, lastFrame, frameDelay, mode);
+			debug_log("vdu_sys_sprites: sprite %d - animate frames %d to %d, delay %d, mode %d\n\r", getCurrentSprite(), firstFrame, lastFrame, frameDelay, mode);
+		}	break;
+
+		case 0x51: {	// Set sprite velocity, in 1/256ths of a pixel per frame
+			auto dx = readWord_t(); if (dx == -1) return;
+			auto dy = readWord_t(); if (dy == -1) return;
+			setSpriteVelocity((int16_t)dx, (int16_t)dy);
+			debug_log("vdu_sys_sprites: sprite %d - velocity (%d,%d)\n\r", getCurrentSprite(), (int16_t)dx, (int16_t)dy);
+		}	break;
+
+		case 0x52: {	// Set sprite motion bounds
+			auto mode = readByte_t(); if (mode == -1) return;
+			auto x1 = readWord_t(); if (x1 == -1) return;
+			auto y1 = readWord_t(); if (y1 == -1) return;
+			auto x2 = readWord_t(); if (x2 == -1) return;
+			auto y2 = readWord_t(); if (y2 == -1) return;
+			setSpriteBounds(mode, x1, y1, x2, y2);
+			debug_log("vdu_sys_sprites: sprite %d - bounds mode %d (%d,%d)-(%d,%d)\n\r", getCurrentSprite(), mode, x1, y1, x2, y2);
+		}	break;
+
+		case 0x53: {	// Stop sprite animation and motion
+			stopSpriteAnimation();
+			debug_log("vdu_sys_sprites: sprite %d - animation stopped\n\r", getCurrentSprite());
+		}	break;
+
+		case 0x58: {	// Set collision groups for current sprite
+			auto groups = readByte_t(); if (groups == -1) return;
+			setSpriteCollisionGroups(groups);
+			debug_log("vdu_sys_sprites: sprite %d - collision groups 0x%02X\n\r", getCurrentSprite(), groups);
+		}	break;
+
+		case 0x59: {	// Set which groups a collision group collides with
+			auto group = readByte_t(); if (group == -1) return;
+			auto targets = readByte_t(); if (targets == -1) return;
+			setCollisionGroupTargets(group, targets);
+			debug_log("vdu_sys_sprites: collision group %d collides with groups 0x%02X\n\r", group, targets);
+		}	break;
+
+		case 0x5A: {	// Set collision detection mode
+			auto flags = readByte_t(); if (flags == -1) return;
+			auto bufferId = readWord_t(); if (bufferId == -1) return;
+			spriteCollisionFlags = flags;
+			spriteCollisionBufferId = bufferId;
+			debug_log("vdu_sys_sprites: collision detection flags 0x%02X, buffer %d\n\r", flags, bufferId);
+		}	break;
+
 		default: {
 			debug_log("vdu_sys_sprites: unknown command %d\n\r", cmd);
 		}	break;
@@ -302,6 +383,9 @@ void VDUStreamProcessor::createBitmapFromBuffer(uint16_t bufferId, uint8_t forma
 
 	// create bitmap from buffer
 	auto stream = buffers[bufferId][0];
+	// top bit of format requests an opaque span encoding
+	bool computeSpans = format & 0x80;
+	format &= 0x7F;
 	// map our pixel format, default to RGBA8888
 	PixelFormat pixelFormat = PixelFormat::RGBA8888;
 	auto bytesPerPixel = 4.;
@@ -344,7 +428,306 @@ void VDUStreamProcessor::createBitmapFromBuffer(uint16_t bufferId, uint8_t forma
 	} else {
 		bitmaps[bufferId] = make_shared_psram<Bitmap>(width, height, (uint8_t *)data, pixelFormat);
 	}
+	if (computeSpans) {
+		computeBitmapSpans(bufferId, bitmaps[bufferId].get());
+	}
 	debug_log("vdu_sys_sprites: bitmap created for bufferId %d, format %d, (%dx%d)\n\r", bufferId, format, width, height);
 }
 
+// Detect sprite collisions, and report them either with a VDP packet or by writing them to a buffer
+// Packets hold a count byte followed by pairs of colliding sprite numbers, and are only sent when there are collisions
+// Buffers hold a 16-bit count followed by the pairs, and are rewritten every frame, even when there are no collisions
+// The block created for the buffer is rewritten in place while it is still the buffer's only block, is large enough,
+// and nothing else has been made from it, so it may be longer than the pairs it holds
+//
+void VDUStreamProcessor::reportSpriteCollisions() {
+	std::vector<std::pair<uint8_t, uint8_t>> collisions;
+	detectSpriteCollisions(collisions);
+
+	if (spriteCollisionFlags & SPRITE_COLLISION_BUFFER) {
+		if (spriteCollisionBufferId == 65535) {
+			return;
+		}
+		uint32_t size = 2 + collisions.size() * 2;
+		std::shared_ptr<BufferStream> buffer;
+		auto bufferIter = buffers.find(spriteCollisionBufferId);
+		auto block = spriteCollisionBlock.lock();
+		// the block must be referenced only by the buffer and ourselves, and have no bitmap or font made from it,
+		// so nothing else sees it rewritten
+		bool reusable = block && bufferIter != buffers.end() && bufferIter->second.size() == 1 && bufferIter->second[0] == block
+			&& block.use_count() == 2 && block->size() >= size
+			&& bitmaps.find(spriteCollisionBufferId) == bitmaps.end() && fonts.find(spriteCollisionBufferId) == fonts.end();
+		if (reusable) {
+			// only the contents change, so cached blocks stay valid
+			buffer = block;
+			bufferDataChanged(spriteCollisionBufferId);
+		} else {
+			bufferClear(spriteCollisionBufferId);
+			buffer = bufferCreate(spriteCollisionBufferId, size);
+			if (!buffer) {
+				debug_log("reportSpriteCollisions: failed to create buffer %d\n\r", spriteCollisionBufferId);
+				return;
+			}
+			spriteCollisionBlock = buffer;
+		}
+		auto data = buffer->getBuffer();
+		data[0] = collisions.size() & 0xFF;
+		data[1] = (collisions.size() >> 8) & 0xFF;
+		for (size_t n = 0; n < collisions.size(); n++) {
+			data[2 + n * 2] = collisions[n].first;
+			data[3 + n * 2] = collisions[n].second;
+		}
+		return;
+	}
+
+	// packet length is a single byte, so send collisions in batches
+	const int maxPairs = 127;
+	for (size_t start = 0; start < collisions.size(); start += maxPairs) {
+		auto count = std::min<int>(maxPairs, collisions.size() - start);
+		uint8_t packet[1 + maxPairs * 2];
+		packet[0] = count;
+		for (auto n = 0; n < count; n++) {
+			packet[1 + n * 2] = collisions[start + n].first;
+			packet[2 + n * 2] = collisions[start + n].second;
+		}
+		bufferCallCallbacks(CALLBACK_SENDING_VDPP | PACKET_SPRITE_COLLISION);
+		send_packet(PACKET_SPRITE_COLLISION, 1 + count * 2, packet);
+	}
+}
+
+// Get the buffer block that holds a bitmap's data, if the bitmap was created directly from a buffer
+std::shared_ptr<BufferStream> getBitmapBufferBlock(uint16_t bitmapId, Bitmap * bitmap) {
+	auto bufferIter = buffers.find(bitmapId);
+	if (bufferIter != buffers.end() && bufferIter->second.size() == 1 && bufferIter->second[0]->getBuffer() == bitmap->data) {
+		return bufferIter->second[0];
+	}
+	return nullptr;
+}
+
+// Create a bitmap that uses existing pixel data, which is kept alive by owner
+std::shared_ptr<Bitmap> makeBitmapView(uint16_t width, uint16_t height, const uint8_t * data, PixelFormat format, std::shared_ptr<void> owner) {
+	auto bitmap = make_unique_psram<Bitmap>(width, height, data, format);
+	return std::shared_ptr<Bitmap>(bitmap.release(), [owner](Bitmap * bitmap) {
+		psram_deleter<Bitmap>()(bitmap);
+	});
+}
+
+// Bytes per pixel for a bitmap, or zero if its pixels are not byte aligned
+inline uint8_t getBitmapBytesPerPixel(Bitmap * bitmap) {
+	switch (bitmap->format) {
+		case PixelFormat::RGBA8888:
+			return 4;
+		case PixelFormat::RGBA2222:
+		case PixelFormat::Native:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Copy a rectangle of pixels from a bitmap into a contiguous destination
+void copyBitmapRect(Bitmap * bitmap, uint8_t bytesPerPixel, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t * destination) {
+	auto rowLength = width * bytesPerPixel;
+	auto source = bitmap->data + (y * bitmap->width + x) * bytesPerPixel;
+	for (int row = 0; row < height; row++) {
+		memcpy(destination + row * rowLength, source + row * bitmap->width * bytesPerPixel, rowLength);
+	}
+}
+
+// VDU 23, 27, &22, parentId; x; y; width; height; : Create bitmap from a rectangle within another bitmap
+// When the rectangle's rows are contiguous in the parent (full width, or a single row) the new bitmap
+// shares the parent's pixel data, so it sees later changes to the parent
+// Otherwise the rectangle is copied into a new block, making the new bitmap a snapshot of the parent
+// that later changes to the parent don't affect, and which uses memory of its own
+//
+void VDUStreamProcessor::createBitmapView(uint16_t bitmapId, uint16_t parentId, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
+	auto parent = getBitmap(parentId);
+	if (!parent) {
+		debug_log("createBitmapView: bitmap %d not found\n\r", parentId);
+		return;
+	}
+	auto bytesPerPixel = getBitmapBytesPerPixel(parent.get());
+	if (bytesPerPixel == 0) {
+		debug_log("createBitmapView: bitmap %d is not in a byte aligned format\n\r", parentId);
+		return;
+	}
+	if (width == 0 || height == 0 || x + width > parent->width || y + height > parent->height) {
+		debug_log("createBitmapView: rectangle is outside of bitmap %d\n\r", parentId);
+		return;
+	}
+	clearBitmap(bitmapId);
+	context->unmapBitmapFromChars(bitmapId);
+
+	if (width == parent->width || height == 1) {
+		// rows are contiguous, so we can use the parent data directly
+		std::shared_ptr<void> owner = getBitmapBufferBlock(parentId, parent.get());
+		if (!owner) {
+			owner = parent;
+		}
+		auto data = parent->data + (y * parent->width + x) * bytesPerPixel;
+		bitmaps[bitmapId] = makeBitmapView(width, height, data, parent->format, owner);
+		bitmapDataSources[bitmapId] = getBitmapDataId(parentId);
+	} else {
+		auto block = make_shared_psram<BufferStream>(width * height * bytesPerPixel);
+		if (!block || !block->getBuffer()) {
+			debug_log("createBitmapView: failed to allocate data for bitmap %d\n\r", bitmapId);
+			return;
+		}
+		copyBitmapRect(parent.get(), bytesPerPixel, x, y, width, height, block->getBuffer());
+		bitmaps[bitmapId] = makeBitmapView(width, height, block->getBuffer(), parent->format, block);
+	}
+	debug_log("createBitmapView: bitmap %d created from bitmap %d (%d,%d %dx%d)\n\r", bitmapId, parentId, x, y, width, height);
+}
+
+// VDU 23, 27, &23, parentId; frameWidth; frameHeight; count; : Create bitmaps from a sprite sheet
+// Frames are taken left to right, top to bottom, and given consecutive bitmap IDs starting at bitmapId
+// A count of zero will create bitmaps for all frames in the sheet
+// Single column sheets share the parent's pixel data, so frames see later changes to the parent
+// Otherwise all frames are copied into one contiguous block, making them snapshots of the parent,
+// and as the frames then use as much memory again as the parent, the parent can be cleared to free its copy
+//
+void VDUStreamProcessor::createBitmapsFromSheet(uint16_t bitmapId, uint16_t parentId, uint16_t frameWidth, uint16_t frameHeight, uint16_t count) {
+	auto parent = getBitmap(parentId);
+	if (!parent) {
+		debug_log("createBitmapsFromSheet: bitmap %d not found\n\r", parentId);
+		return;
+	}
+	auto bytesPerPixel = getBitmapBytesPerPixel(parent.get());
+	if (bytesPerPixel == 0) {
+		debug_log("createBitmapsFromSheet: bitmap %d is not in a byte aligned format\n\r", parentId);
+		return;
+	}
+	if (frameWidth == 0 || frameHeight == 0 || frameWidth > parent->width || frameHeight > parent->height) {
+		debug_log("createBitmapsFromSheet: invalid frame size for bitmap %d\n\r", parentId);
+		return;
+	}
+	uint16_t columns = parent->width / frameWidth;
+	uint32_t frames = columns * (parent->height / frameHeight);
+	if (count == 0 || count > frames) {
+		count = frames;
+	}
+	if (bitmapId + count > 65535 || (parentId >= bitmapId && parentId < bitmapId + count)) {
+		debug_log("createBitmapsFromSheet: invalid bitmap ID range\n\r");
+		return;
+	}
+
+	std::shared_ptr<void> owner;
+	uint8_t * data = nullptr;
+	uint32_t frameSize = frameWidth * frameHeight * bytesPerPixel;
+	if (columns == 1) {
+		owner = getBitmapBufferBlock(parentId, parent.get());
+		if (!owner) {
+			owner = parent;
+		}
+	} else {
+		auto block = make_shared_psram<BufferStream>(frameSize * count);
+		if (!block || !block->getBuffer()) {
+			debug_log("createBitmapsFromSheet: failed to allocate data for %d frames\n\r", count);
+			return;
+		}
+		data = block->getBuffer();
+		owner = block;
+	}
+
+	for (uint16_t frame = 0; frame < count; frame++) {
+		auto id = bitmapId + frame;
+		auto x = (frame % columns) * frameWidth;
+		auto y = (frame / columns) * frameHeight;
+		clearBitmap(id);
+		context->unmapBitmapFromChars(id);
+		const uint8_t * frameData;
+		if (data) {
+			copyBitmapRect(parent.get(), bytesPerPixel, x, y, frameWidth, frameHeight, data + frame * frameSize);
+			frameData = data + frame * frameSize;
+		} else {
+			frameData = parent->data + y * parent->width * bytesPerPixel;
+		}
+		bitmaps[id] = makeBitmapView(frameWidth, frameHeight, frameData, parent->format, owner);
+		if (!data) {
+			bitmapDataSources[id] = getBitmapDataId(parentId);
+		}
+	}
+	debug_log("createBitmapsFromSheet: bitmaps %d to %d created from bitmap %d\n\r", bitmapId, bitmapId + count - 1, parentId);
+}
+
+// VDU 23, 27, &24 : Convert current bitmap to display format
+// Pre-converts an RGBA8888 bitmap to RGBA2222, which is the format the display uses for all modes,
+// so that drawing it and using it as a sprite frame no longer needs per-pixel colour reduction
+// Any opaque pixel stays opaque, and sprite frames using the bitmap are updated to use the converted version
+// The converted bitmap has its own copy of the pixel data, so later changes to the buffer will not affect it
+//
+void VDUStreamProcessor::convertBitmapForDisplay(uint16_t bitmapId) {
+	auto bitmap = getBitmap(bitmapId);
+	if (!bitmap) {
+		debug_log("convertBitmapForDisplay: bitmap %d not found\n\r", bitmapId);
+		return;
+	}
+	if (bitmap->format != PixelFormat::RGBA8888) {
+		debug_log("convertBitmapForDisplay: bitmap %d is not in RGBA8888 format, so needs no conversion\n\r", bitmapId);
+		return;
+	}
+	auto size = bitmap->width * bitmap->height;
+	auto block = make_shared_psram<BufferStream>(size);
+	if (!block || !block->getBuffer()) {
+		debug_log("convertBitmapForDisplay: failed to allocate data for bitmap %d\n\r", bitmapId);
+		return;
+	}
+	auto source = bitmap->data;
+	auto destination = block->getBuffer();
+	for (auto n = 0; n < size; n++, source += 4) {
+		destination[n] = packRGBA2222(source[0], source[1], source[2], source[3]);
+	}
+
+	auto converted = makeBitmapView(bitmap->width, bitmap->height, block->getBuffer(), PixelFormat::RGBA2222, block);
+	updateSpriteFrameBitmaps(bitmapId, converted.get());
+	if (getBitmapSpans(bitmapId, bitmap.get())) {
+		computeBitmapSpans(bitmapId, converted.get());
+	}
+	// replacing the bitmap frees the original, so ensure no pending drawing operations are using it
+	waitPlotCompletion();
+	bitmaps[bitmapId] = converted;
+	debug_log("convertBitmapForDisplay: bitmap %d converted to RGBA2222\n\r", bitmapId);
+}
+
+// VDU 23, 27, &25, bitmapId; width; height; : Redirect graphics drawing to a bitmap
+// If width and height are non-zero a new transparent RGBA2222 bitmap of that size is created first,
+// replacing any existing buffer and bitmap with that ID, otherwise the bitmap must already exist in RGBA2222 format
+// Graphics plots, bitmap plots, CLG and text at the graphics cursor then draw into the bitmap, using screen coordinates
+// A bitmap ID of 65535 returns drawing to the screen
+//
+void VDUStreamProcessor::setBitmapRenderTarget(uint16_t bitmapId, uint16_t width, uint16_t height) {
+	if (bitmapId == 65535) {
+		context->setRenderTarget(nullptr);
+		debug_log("setBitmapRenderTarget: drawing to screen\n\r");
+		return;
+	}
+	if (width != 0 && height != 0) {
+		bufferClear(bitmapId);
+		auto buffer = bufferCreate(bitmapId, width * height);
+		if (!buffer || !buffer->getBuffer()) {
+			debug_log("setBitmapRenderTarget: failed to create buffer for bitmap %d\n\r", bitmapId);
+			return;
+		}
+		memset(buffer->getBuffer(), 0, width * height);
+		createBitmapFromBuffer(bitmapId, 1, width, height);
+	}
+	auto bitmap = getBitmap(bitmapId);
+	if (!bitmap) {
+		debug_log("setBitmapRenderTarget: bitmap %d not found\n\r", bitmapId);
+		return;
+	}
+	if (bitmap->format != PixelFormat::RGBA2222) {
+		debug_log("setBitmapRenderTarget: bitmap %d is not in RGBA2222 format\n\r", bitmapId);
+		return;
+	}
+	// make sure nothing still queued for the screen is reading from the bitmap's old contents
+	waitPlotCompletion();
+	std::shared_ptr<void> owner = getBitmapBufferBlock(bitmapId, bitmap.get());
+	if (!owner) {
+		owner = bitmap;
+	}
+	context->setRenderTarget(make_shared_psram<RenderTarget>(bitmapId, bitmap, owner));
+	debug_log("setBitmapRenderTarget: drawing to bitmap %d (%dx%d)\n\r", bitmapId, bitmap->width, bitmap->height);
+}
+
 #endif // _VDU_SPRITES_H_
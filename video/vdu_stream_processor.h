@@ -25,6 +25,52 @@ extern uint16_t getVDPVariable(uint16_t flag);
 extern void setVDPVariable(uint16_t flag, uint16_t value);
 extern void clearVDPVariable(uint16_t flag);
 
+// Timer callback, as held in the processor's timer heaps
+struct TimerCallback {
+	uint32_t	deadline;				// Time (ms) or frame count when callback is due
+	uint16_t	interval;				// Interval in ms or frames
+	uint16_t	bufferId;				// Buffer to call
+	bool		repeat;					// Re-arm after firing
+};
+
+// Conditional arguments compiled into a predicate
+struct CompiledCondition {
+	uint8_t		op = 0;						// Conditional operation
+	uint8_t		size = 1;					// Value size in bytes (1, 2 or 4)
+	bool		isSigned = false;			// Values are signed
+	bool		useVariable = false;		// Source value is a VDP variable
+	bool		useBufferValue = false;		// Operand is a buffer value
+	bool		hasOperand = false;
+	uint16_t	variableId = 0;				// VDP variable to check
+	uint8_t *	source = nullptr;			// Resolved source value, or nullptr if not found
+	uint8_t *	operand = nullptr;			// Resolved operand buffer value, or nullptr if not found
+	int64_t		operandValue = 0;			// Immediate operand value
+	std::shared_ptr<BufferStream>	sourceBlock;	// Blocks holding resolved values
+	std::shared_ptr<BufferStream>	operandBlock;
+	uint32_t	endOffset = 0;				// Stream position after the arguments
+	size_t		endIndex = 0;
+	uint8_t		argsLength = 0;				// Copy of the argument bytes, to detect modification
+	uint8_t		args[24];
+};
+
+// Location of a conditional command within a buffer
+// The running buffer's ID is part of the key, as buffer ID 65535 in a condition resolves to it,
+// and a block may be shared between buffers
+struct ConditionSite {
+	const BufferStream *	block;
+	uint32_t				offset;
+	uint16_t				bufferId;
+	bool operator==(const ConditionSite &other) const {
+		return block == other.block && offset == other.offset && bufferId == other.bufferId;
+	}
+};
+
+struct ConditionSiteHash {
+	size_t operator()(const ConditionSite &site) const {
+		return std::hash<const void *>()(site.block) ^ (site.offset * 2654435761u) ^ ((size_t)site.bufferId << 16);
+	}
+};
+
 class VDUStreamProcessor {
 	private:
 		std::shared_ptr<Stream> inputStream;
@@ -41,6 +87,16 @@ class VDUStreamProcessor {
 
 		std::vector<uint8_t> echoBuffer;
 
+		// Timer callbacks, held as min-heaps ordered by deadline
+		std::vector<TimerCallback> msTimers;		// Millisecond timers
+		std::vector<TimerCallback> frameTimers;		// Frame timers
+
+		uint16_t loopCounters[BUFFERED_LOOP_COUNTERS] = {};	// Loop counters for buffer programs
+
+		// Compiled conditions, keyed by their location in a buffer
+		std::unordered_map<ConditionSite, CompiledCondition, ConditionSiteHash> conditionCache;
+		uint32_t conditionCacheGeneration = 0;
+
 		int16_t readByte_t(uint16_t timeout);
 		int32_t readWord_t(uint16_t timeout);
 		int32_t read24_t(uint16_t timeout);
@@ -96,12 +152,18 @@ class VDUStreamProcessor {
 		void sendAudioStatus(uint8_t channel, uint8_t status);
 		uint8_t loadSample(uint16_t bufferId, uint32_t length);
 		uint8_t createSampleFromBuffer(uint16_t bufferId, uint8_t format, uint16_t sampleRate);
+		uint8_t createSampleStream(uint16_t bufferId, uint8_t format, uint16_t sampleRate, uint32_t capacity, uint32_t lowWater);
+		uint8_t writeSampleStream(uint16_t bufferId, uint32_t length);
+		uint32_t readIntoSampleStream(AudioSample & sample, uint32_t length, uint32_t & accepted);
+		void reportAudioStreams();
 		uint8_t setVolumeEnvelope(uint8_t channel, uint8_t type);
 		uint8_t setFrequencyEnvelope(uint8_t channel, uint8_t type);
 		uint8_t setSampleFrequency(uint16_t bufferId, uint16_t frequency);
 		uint8_t setSampleRepeatStart(uint16_t bufferId, uint32_t offset);
 		uint8_t setSampleRepeatLength(uint16_t bufferId, uint32_t length);
 		uint8_t setParameter(uint8_t channel, uint8_t parameter, uint16_t value);
+		uint8_t sequencerCommand(uint8_t channel, uint8_t action);
+		uint8_t queueCommand(uint8_t channel, uint8_t action);
 
 		void vdu_sys_font();
 
@@ -119,13 +181,19 @@ class VDUStreamProcessor {
 		void createBitmapFromScreen(uint16_t bufferId);
 		void createEmptyBitmap(uint16_t bufferId, uint16_t width, uint16_t height, uint32_t color);
 		void createBitmapFromBuffer(uint16_t bufferId, uint8_t format, uint16_t width, uint16_t height);
+		void createBitmapView(uint16_t bitmapId, uint16_t parentId, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+		void createBitmapsFromSheet(uint16_t bitmapId, uint16_t parentId, uint16_t frameWidth, uint16_t frameHeight, uint16_t count);
+		void reportSpriteCollisions();
+		void convertBitmapForDisplay(uint16_t bitmapId);
+		void setBitmapRenderTarget(uint16_t bitmapId, uint16_t width, uint16_t height);
 
 		void vdu_sys_hexload(void);
 		void sendKeycodeByte(uint8_t b, bool waitack);
 
 		void vdu_sys_buffered();
 		uint32_t bufferWrite(uint16_t bufferId, uint32_t size);
-		void bufferCall(uint16_t bufferId, AdvancedOffset offset);
+		uint32_t bufferWriteDecompress(uint16_t bufferId, uint32_t length);
+		void bufferCall(uint16_t bufferId, AdvancedOffset offset, uint16_t repeat = 1);
 		void bufferRemoveUsers(uint16_t bufferId);
 		void bufferClear(uint16_t bufferId);
 		std::shared_ptr<WritableBufferStream> bufferCreate(uint16_t bufferId, uint32_t size);
@@ -133,8 +201,10 @@ class VDUStreamProcessor {
 		AdvancedOffset getOffsetFromStream(bool isAdvanced);
 		std::vector<uint16_t> getBufferIdsFromStream();
 		void bufferAdjust(uint16_t bufferId);
+		bool bufferCompileConditional(CompiledCondition &condition);
 		bool bufferConditional();
 		void bufferJump(uint16_t bufferId, AdvancedOffset offset);
+		bool bufferDecrementCounter(uint8_t counter);
 		void bufferCopy(uint16_t bufferId, tcb::span<const uint16_t> sourceBufferIds);
 		void bufferConsolidate(uint16_t bufferId);
 		void clearTargets(tcb::span<const uint16_t> targets);
@@ -150,11 +220,14 @@ class VDUStreamProcessor {
 		void bufferTransformBitmap(uint16_t bufferId, uint8_t options, uint16_t transformBufferId, uint16_t sourceBufferId);
 		void bufferTransformData(uint16_t bufferId, uint8_t options, uint8_t format, uint16_t transformBufferId, uint16_t sourceBufferId);
 		void bufferReadVariable(uint16_t bufferId);
-		void bufferCompress(uint16_t bufferId, uint16_t sourceBufferId);
+		void bufferCompress(uint16_t bufferId, uint16_t sourceBufferId, uint8_t type);
 		void bufferDecompress(uint16_t bufferId, uint16_t sourceBufferId);
 		void bufferExpandBitmap(uint16_t bufferId, uint8_t options, uint16_t sourceBufferId);
 		void bufferAddCallback(uint16_t bufferId, uint16_t type);
 		void bufferRemoveCallback(uint16_t bufferId, uint16_t type);
+		void bufferAddTimerCallback(uint16_t bufferId, uint8_t flags, uint16_t interval);
+		void bufferRemoveTimerCallback(uint16_t bufferId);
+		void bufferCallTimerCallbacks();
 
 		void vdu_sys_updater();
 		void unlock();
@@ -590,6 +663,12 @@ void VDUStreamProcessor::processAllAvailable() {
 void VDUStreamProcessor::processNext() {
 	auto hasPending = byteAvailable();
 	if (context->checkForVSYNC(hasPending)) {
+		if (animateSprites(lastFrameCounter)) {
+			refreshSprites();
+		}
+		if (spriteCollisionFlags & SPRITE_COLLISION_ENABLE) {
+			reportSpriteCollisions();
+		}
 		// TODO consider making this an event pushed to the queue?
 		bufferCallCallbacks(CALLBACK_VSYNC);
 		if (!hasPending) {
@@ -601,6 +680,10 @@ void VDUStreamProcessor::processNext() {
 		}
 	}
 
+	bufferCallTimerCallbacks();
+	if (audioStreamsNeedReport) {
+		reportAudioStreams();
+	}
 	processEventQueue();
 	handleKeyboardAndMouse();
 	context->doCursorFlash();